@@ -50,6 +50,8 @@ int main(int argc, char *argv[]) {
     using Pipeline = Unlit<RenderOutputs::Color | RenderOutputs::Depth,
                            DataSource::Texture>;
 
+    auto startup_start = chrono::steady_clock::now();
+
     BatchRenderer renderer({0, 1, num_threads, 1, 256, 256,
         glm::mat4(
             1, 0, 0, 0,
@@ -60,6 +62,11 @@ int main(int argc, char *argv[]) {
         RenderFeatures<Pipeline> { RenderOptions::CpuSynchronization }
     );
 
+    // Dominated by pipeline compilation, see RenderConfig::pipelineCacheDir
+    auto startup_end = chrono::steady_clock::now();
+    cout << "Startup MS: " << chrono::duration_cast<chrono::milliseconds>(
+            startup_end - startup_start).count() << endl;
+
     vector<glm::mat4> init_views = readViews(argv[2]);
     size_t num_frames = min(init_views.size(), max_render_frames);
 
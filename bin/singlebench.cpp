@@ -19,6 +19,8 @@ int main(int argc, char *argv[]) {
     using Pipeline = Unlit<RenderOutputs::Color | RenderOutputs::Depth,
                            DataSource::Texture>;
 
+    auto startup_start = chrono::steady_clock::now();
+
     BatchRenderer renderer({0, 1, 1, batch_size, 256, 256,
         glm::mat4(
             1, 0, 0, 0,
@@ -29,6 +31,11 @@ int main(int argc, char *argv[]) {
         RenderFeatures<Pipeline> { RenderOptions::CpuSynchronization }
     );
 
+    // Dominated by pipeline compilation, see RenderConfig::pipelineCacheDir
+    auto startup_end = chrono::steady_clock::now();
+    cout << "Startup MS: " << chrono::duration_cast<chrono::milliseconds>(
+            startup_end - startup_start).count() << endl;
+
     auto loader = renderer.makeLoader();
     auto scene = loader.loadScene(argv[1]);
 
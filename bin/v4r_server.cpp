@@ -0,0 +1,510 @@
+#include <v4r.hpp>
+#include <v4r/server.hpp>
+#include <v4r/shm.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace v4r;
+
+// Owns the renderer and a single command stream, and packs step requests
+// from many client processes into shared batches. Results are returned
+// through the stream's shared frame memory.
+
+using Clock = chrono::steady_clock;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+struct Client {
+    int fd;
+    bool connected;
+    vector<Environment> envs;
+    bool stepPending;
+    Clock::time_point requestTime;
+};
+
+static int makeListenSocket(const char *path)
+{
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long" << endl;
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(path);
+
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr),
+             sizeof(addr)) == -1) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    return listen_fd;
+}
+
+static bool sendConnectReply(int fd, const ServerConnectReply &reply,
+                             int shm_fd)
+{
+    iovec iov {
+        const_cast<ServerConnectReply *>(&reply),
+        sizeof(ServerConnectReply)
+    };
+
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (shm_fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) ==
+        static_cast<ssize_t>(sizeof(ServerConnectReply));
+}
+
+class RenderServer {
+public:
+    RenderServer(BatchRendererShm &renderer,
+                 const shared_ptr<Scene> &scene,
+                 uint32_t batch_size,
+                 uint32_t img_width,
+                 uint32_t img_height,
+                 chrono::microseconds max_wait)
+        : stream_(renderer.makeCommandStream()),
+          reader_(stream_.getFD()),
+          scene_(scene),
+          batch_size_(batch_size),
+          img_width_(img_width),
+          img_height_(img_height),
+          max_wait_(max_wait),
+          clients_(),
+          pending_(),
+          num_pending_envs_(0),
+          frame_tickets_(),
+          next_frame_(0),
+          last_ticket_ { 0, 0 },
+          msg_buffer_(server_max_message_bytes)
+    {
+        for (uint32_t frame_idx = 0; frame_idx < reader_.getNumFrames();
+             frame_idx++) {
+            frame_tickets_.push_back({ 0, frame_idx });
+        }
+    }
+
+    void run(int listen_fd);
+
+private:
+    void acceptClient(int listen_fd);
+    bool handleMessage(Client &client);
+    bool handleConnect(Client &client, size_t num_bytes);
+    bool handleStep(Client &client, size_t num_bytes);
+    void disconnect(list<Client>::iterator client_iter);
+    bool shouldFlush(Clock::time_point now) const;
+    void flushBatch();
+
+    CommandStreamShm stream_;
+    ShmFrameReader reader_;
+    shared_ptr<Scene> scene_;
+    uint32_t batch_size_;
+    uint32_t img_width_;
+    uint32_t img_height_;
+    chrono::microseconds max_wait_;
+
+    list<Client> clients_;
+    deque<Client *> pending_;
+    uint32_t num_pending_envs_;
+
+    vector<FrameTicket> frame_tickets_;
+    uint32_t next_frame_;
+    FrameTicket last_ticket_;
+
+    vector<uint8_t> msg_buffer_;
+};
+
+void RenderServer::acceptClient(int listen_fd)
+{
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+
+    clients_.push_back(Client {
+        fd,
+        false,
+        {},
+        false,
+        Clock::time_point()
+    });
+}
+
+void RenderServer::disconnect(list<Client>::iterator client_iter)
+{
+    Client *client = &*client_iter;
+    if (client->stepPending) {
+        pending_.erase(find(pending_.begin(), pending_.end(), client));
+        num_pending_envs_ -= client->envs.size();
+    }
+
+    close(client->fd);
+    clients_.erase(client_iter);
+}
+
+bool RenderServer::handleConnect(Client &client, size_t num_bytes)
+{
+    ServerConnectRequest req;
+    if (num_bytes != sizeof(ServerConnectRequest)) {
+        return false;
+    }
+    memcpy(&req, msg_buffer_.data(), sizeof(ServerConnectRequest));
+
+    ServerConnectReply reply {
+        0,
+        img_width_,
+        img_height_,
+        reader_.getNumFrames(),
+        uint64_t(img_width_) * img_height_ * 4 * sizeof(uint8_t),
+        uint64_t(img_width_) * img_height_ * sizeof(float)
+    };
+
+    // Requests are never split across batches
+    if (req.numEnvs == 0 || req.numEnvs > batch_size_) {
+        reply.status = 1;
+        sendConnectReply(client.fd, reply, -1);
+        return false;
+    }
+
+    for (uint32_t env_idx = 0; env_idx < req.numEnvs; env_idx++) {
+        client.envs.emplace_back(stream_.makeEnvironment(
+                scene_, req.hfov, req.near, req.far));
+    }
+
+    client.connected = true;
+
+    return sendConnectReply(client.fd, reply, stream_.getFD());
+}
+
+bool RenderServer::handleStep(Client &client, size_t num_bytes)
+{
+    // Clients must wait for the reply before stepping again
+    if (client.stepPending || num_bytes < sizeof(ServerStepRequest)) {
+        return false;
+    }
+
+    ServerStepRequest req;
+    memcpy(&req, msg_buffer_.data(), sizeof(ServerStepRequest));
+
+    uint32_t num_envs = client.envs.size();
+    size_t expected_bytes = sizeof(ServerStepRequest) +
+        num_envs * sizeof(glm::mat4) +
+        size_t(req.numInstanceUpdates) * sizeof(ServerInstanceUpdate);
+
+    if (num_bytes != expected_bytes) {
+        return false;
+    }
+
+    const uint8_t *cur_ptr = msg_buffer_.data() + sizeof(ServerStepRequest);
+
+    for (Environment &env : client.envs) {
+        glm::mat4 view;
+        memcpy(&view, cur_ptr, sizeof(glm::mat4));
+        cur_ptr += sizeof(glm::mat4);
+
+        env.setCameraView(view);
+    }
+
+    for (uint32_t update_idx = 0; update_idx < req.numInstanceUpdates;
+         update_idx++) {
+        ServerInstanceUpdate update;
+        memcpy(&update, cur_ptr, sizeof(ServerInstanceUpdate));
+        cur_ptr += sizeof(ServerInstanceUpdate);
+
+        if (update.envIdx >= num_envs) {
+            return false;
+        }
+
+        // The server never deletes instances, so every ID below this is live
+        Environment &env = client.envs[update.envIdx];
+        if (update.instanceID >= env.getNumInstanceIDs()) {
+            return false;
+        }
+
+        env.updateInstanceTransform(update.instanceID, update.transform);
+    }
+
+    client.stepPending = true;
+    client.requestTime = Clock::now();
+    pending_.push_back(&client);
+    num_pending_envs_ += num_envs;
+
+    return true;
+}
+
+bool RenderServer::handleMessage(Client &client)
+{
+    ssize_t num_bytes = recv(client.fd, msg_buffer_.data(),
+                             msg_buffer_.size(), 0);
+    if (num_bytes <= 0) {
+        return false;
+    }
+
+    ServerMessage type;
+    if (size_t(num_bytes) < sizeof(ServerMessage)) {
+        return false;
+    }
+    memcpy(&type, msg_buffer_.data(), sizeof(ServerMessage));
+
+    if (!client.connected) {
+        return type == ServerMessage::Connect &&
+            handleConnect(client, num_bytes);
+    }
+
+    return type == ServerMessage::Step && handleStep(client, num_bytes);
+}
+
+bool RenderServer::shouldFlush(Clock::time_point now) const
+{
+    if (pending_.empty()) {
+        return false;
+    }
+
+    // Full, or the next request can't fit anyway
+    if (num_pending_envs_ >= batch_size_) {
+        return true;
+    }
+
+    return now - pending_.front()->requestTime >= max_wait_;
+}
+
+void RenderServer::flushBatch()
+{
+    vector<Environment> batch;
+    vector<pair<Client *, uint32_t>> members;
+
+    while (!pending_.empty()) {
+        Client *client = pending_.front();
+        if (batch.size() + client->envs.size() > batch_size_) {
+            break;
+        }
+
+        members.emplace_back(client, batch.size());
+        for (Environment &env : client->envs) {
+            batch.emplace_back(move(env));
+        }
+
+        pending_.pop_front();
+        num_pending_envs_ -= client->envs.size();
+    }
+
+    // The frame may still be read by clients, but it can't be rendered
+    // into until the GPU is done with it
+    FrameTicket &prev_ticket = frame_tickets_[next_frame_];
+    if (prev_ticket.id != 0) {
+        stream_.waitForFrame(prev_ticket);
+    }
+
+    uint32_t frame_id = stream_.render(batch);
+    next_frame_ = (frame_id + 1) % frame_tickets_.size();
+
+    FrameTicket ticket = stream_.getTicket(frame_id);
+    frame_tickets_[frame_id] = ticket;
+    last_ticket_ = ticket;
+
+    for (auto [client, base_slot] : members) {
+        uint32_t num_envs = client->envs.size();
+        for (uint32_t env_idx = 0; env_idx < num_envs; env_idx++) {
+            client->envs[env_idx] = move(batch[base_slot + env_idx]);
+        }
+
+        ServerStepReply reply {
+            ticket.id,
+            frame_id,
+            num_envs
+        };
+
+        uint8_t *reply_ptr = msg_buffer_.data();
+        memcpy(reply_ptr, &reply, sizeof(ServerStepReply));
+        reply_ptr += sizeof(ServerStepReply);
+
+        for (uint32_t env_idx = 0; env_idx < num_envs; env_idx++) {
+            uint32_t slot = base_slot + env_idx;
+            memcpy(reply_ptr, &slot, sizeof(uint32_t));
+            reply_ptr += sizeof(uint32_t);
+        }
+
+        client->stepPending = false;
+
+        // A failed send shows up as a hangup on the next poll
+        send(client->fd, msg_buffer_.data(), reply_ptr - msg_buffer_.data(),
+             MSG_NOSIGNAL);
+    }
+}
+
+void RenderServer::run(int listen_fd)
+{
+    vector<pollfd> poll_fds;
+    vector<list<Client>::iterator> poll_clients;
+
+    while (!stop_requested) {
+        // Checked before publishing, so a frame finishing in between is
+        // still published before sleeping indefinitely
+        bool frames_outstanding = last_ticket_.id != 0 &&
+            !stream_.isFrameReady(last_ticket_);
+
+        stream_.publishReadyFrames();
+
+        poll_fds.clear();
+        poll_clients.clear();
+
+        poll_fds.push_back({ listen_fd, POLLIN, 0 });
+        for (auto iter = clients_.begin(); iter != clients_.end(); iter++) {
+            poll_fds.push_back({ iter->fd, POLLIN, 0 });
+            poll_clients.push_back(iter);
+        }
+
+        // Completion isn't signaled through a descriptor, so poll for it
+        // while frames are in flight
+        timespec timeout;
+        timespec *timeout_ptr = nullptr;
+        chrono::nanoseconds wait = chrono::nanoseconds::max();
+        if (frames_outstanding) {
+            wait = chrono::microseconds(100);
+        }
+
+        if (!pending_.empty()) {
+            wait = min<chrono::nanoseconds>(wait, max(
+                pending_.front()->requestTime + max_wait_ - Clock::now(),
+                Clock::duration::zero()));
+        }
+
+        if (wait != chrono::nanoseconds::max()) {
+            timeout.tv_sec = wait.count() / 1000000000;
+            timeout.tv_nsec = wait.count() % 1000000000;
+            timeout_ptr = &timeout;
+        }
+
+        int res = ppoll(poll_fds.data(), poll_fds.size(), timeout_ptr,
+                        nullptr);
+        if (res == -1 && errno != EINTR) {
+            perror("ppoll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (res > 0) {
+            for (uint32_t client_idx = 0; client_idx < poll_clients.size();
+                 client_idx++) {
+                short revents = poll_fds[client_idx + 1].revents;
+                if (revents == 0) continue;
+
+                auto client_iter = poll_clients[client_idx];
+                if ((revents & POLLIN) && handleMessage(*client_iter)) {
+                    continue;
+                }
+
+                disconnect(client_iter);
+            }
+
+            if (poll_fds[0].revents & POLLIN) {
+                acceptClient(listen_fd);
+            }
+        }
+
+        while (shouldFlush(Clock::now())) {
+            flushBatch();
+        }
+    }
+}
+
+static void handleStopSignal(int)
+{
+    stop_requested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        cerr << argv[0] << " socket_path scene batch_size "
+            "[width height] [max_wait_us]" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    const char *socket_path = argv[1];
+    uint32_t batch_size = stoul(argv[3]);
+
+    uint32_t img_width = 256;
+    uint32_t img_height = 256;
+    if (argc > 5) {
+        img_width = stoul(argv[4]);
+        img_height = stoul(argv[5]);
+    }
+
+    chrono::microseconds max_wait(1000);
+    if (argc > 6) {
+        max_wait = chrono::microseconds(stoul(argv[6]));
+    }
+
+    using Pipeline = Unlit<RenderOutputs::Color | RenderOutputs::Depth,
+                           DataSource::Texture>;
+
+    BatchRendererShm renderer({0, 1, 1, batch_size, img_width, img_height,
+        glm::mat4(
+            1, 0, 0, 0,
+            0, -1.19209e-07, -1, 0,
+            0, 1, -1.19209e-07, 0,
+            0, 0, 0, 1
+        )},
+        RenderFeatures<Pipeline> { RenderOptions::DoubleBuffered }
+    );
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(argv[2]);
+
+    RenderServer server(renderer, scene, batch_size, img_width, img_height,
+                        max_wait);
+
+    struct sigaction stop_action {};
+    stop_action.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &stop_action, nullptr);
+    sigaction(SIGTERM, &stop_action, nullptr);
+
+    int listen_fd = makeListenSocket(socket_path);
+
+    server.run(listen_fd);
+
+    close(listen_fd);
+    unlink(socket_path);
+}
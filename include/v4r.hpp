@@ -9,6 +9,8 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <cstdint>
+#include <future>
 #include <string_view>
 #include <vector>
 
@@ -35,6 +37,14 @@ public:
     // Shortcut for Gibson style scene files
     std::shared_ptr<Scene> loadScene(std::string_view scene_path);
 
+    // Returns immediately, parsing and uploading the scene on the
+    // loader's worker thread, which runs queued loads in order. Streams
+    // can render the scene once the future is ready, the first render
+    // using it waits if the upload is still in flight. Destroying the
+    // loader finishes every queued load first.
+    std::future<std::shared_ptr<Scene>> loadSceneAsync(
+            std::string_view scene_path);
+
 private:
     AssetLoader(Handle<LoaderState> &&state);
 
@@ -43,6 +53,13 @@ private:
 friend class BatchRenderer;
 };
 
+// Identifies one rendered batch. Ticket ids increase monotonically within
+// a stream, and frameID is the frame the batch was rendered into.
+struct FrameTicket {
+    uint64_t id;
+    uint32_t frameID;
+};
+
 class CommandStream {
 public:
     Environment makeEnvironment(const std::shared_ptr<Scene> &scene,
@@ -53,6 +70,43 @@ public:
 
     void waitForFrame(uint32_t frame_id = 0);
 
+    // Ticket for the last batch rendered into frame_id
+    FrameTicket getTicket(uint32_t frame_id = 0) const;
+
+    bool isFrameReady(const FrameTicket &ticket) const;
+
+    // Returns false if timeout (in nanoseconds) expires first. Staged
+    // outputs are only copied out if ticket is still the frame's latest.
+    bool waitForFrame(const FrameTicket &ticket,
+                      uint64_t timeout = UINT64_MAX) const;
+
+    // Waits until any of the tickets, where tickets[i] belongs to
+    // streams[i], is ready. Returns the index of a ready ticket, or -1 if
+    // timeout expires first. All streams must come from the same renderer.
+    static int32_t waitAny(const std::vector<const CommandStream *> &streams,
+                           const std::vector<FrameTicket> &tickets,
+                           uint64_t timeout = UINT64_MAX);
+
+    // Results of frame_id in host memory, laid out like the CUDA device
+    // pointers. Requires RenderOptions::HostReadback and is only valid
+    // once the frame is ready.
+    uint8_t *getColorHostPtr(uint32_t frame_id = 0) const;
+    float *getDepthHostPtr(uint32_t frame_id = 0) const;
+
+    // Frames render cycles through, see RenderConfig::numFramesInFlight
+    uint32_t getNumFrames() const;
+
+    // Writes the results of frame_id directly into caller owned memory,
+    // laid out like the host pointers above. Page aligned memory is
+    // imported so the GPU writes it in place. Otherwise the results are
+    // staged and copied in by waitForFrame, which must then be used
+    // rather than waitAny / isFrameReady alone. The frame must not be in
+    // flight, and ptr must outlive the stream or be unset with nullptr.
+    void setColorOutputMemory(uint32_t frame_id, void *ptr,
+                              size_t num_bytes);
+    void setDepthOutputMemory(uint32_t frame_id, void *ptr,
+                              size_t num_bytes);
+
 protected:
     CommandStream(Handle<CommandStreamState> &&state,
                   uint32_t render_width,
@@ -73,8 +127,23 @@ public:
     BatchRenderer(const RenderConfig &cfg,
                   const RenderFeatures<PipelineType> &features);
 
+    // Adds another pipeline sharing this renderer's device, queues,
+    // loaders and scenes, returning the index to make its streams with.
+    // The batch, stream, image and output settings of cfg apply to the new
+    // pipeline; the rest are taken from the renderer. Scenes keep the
+    // first pipeline's vertex and material format, which PipelineType
+    // must be able to read, e.g. a depth only Unlit pipeline next to a
+    // textured BlinnPhong one. The device only enables the optional
+    // features the first pipeline's options need, so IndirectDraw here
+    // needs the first pipeline to use IndirectDraw or GpuCulling, and
+    // GpuCulling or LayeredOutput here need the first pipeline to use
+    // the same option. Call before making any streams.
+    template <typename PipelineType>
+    uint32_t addPipeline(const RenderConfig &cfg,
+                         const RenderFeatures<PipelineType> &features);
+
     AssetLoader makeLoader();
-    CommandStream makeCommandStream();
+    CommandStream makeCommandStream(uint32_t pipeline_idx = 0);
 
 protected:
     BatchRenderer(Handle<VulkanState> &&vk_state);
@@ -35,8 +35,11 @@ public:
     inline uint32_t addInstance(uint32_t model_idx, uint32_t material_idx,
                                 const glm::mat4 &model_transform);
 
+    // Lights with a radius > 0 fade out to nothing at that distance,
+    // which lets them be skipped for fragments outside it
     inline uint32_t addLight(const glm::vec3 &position,
-                             const glm::vec3 &color);
+                             const glm::vec3 &color,
+                             float radius = 0.f);
 
     inline const std::vector<std::shared_ptr<Mesh>> & getMeshes() const;
     inline const std::vector<std::shared_ptr<Material>> & getMaterials() const;
@@ -47,10 +47,11 @@ uint32_t SceneDescription::addInstance(
 }
 
 uint32_t SceneDescription::addLight(const glm::vec3 &position,
-                                    const glm::vec3 &color)
+                                    const glm::vec3 &color,
+                                    float radius)
 {
     default_lights_.push_back({
-        glm::vec4(position, 1.f),
+        glm::vec4(position, radius),
         glm::vec4(color, 1.f)
     });
 
@@ -22,8 +22,62 @@ enum class RenderOutputs : uint32_t {
 
 enum class RenderOptions : uint32_t {
     CpuSynchronization = 1 << 0,
+    // Shorthand for RenderConfig::numFramesInFlight = 2
     DoubleBuffered = 1 << 1,
-    VerticalSync = 1 << 2
+    VerticalSync = 1 << 2,
+    // Record each frame's render commands once and drive draws from
+    // a host written indirect argument buffer. Commands are only
+    // rerecorded when the scenes in the batch change.
+    IndirectDraw = 1 << 3,
+    // Cull instances against each env's view frustum in a compute pass
+    // before rendering. Implies IndirectDraw.
+    GpuCulling = 1 << 4,
+    // Cull instances against each env's view frustum on the CPU while
+    // copying them into the per frame param buffer. Ignored with
+    // GpuCulling.
+    CpuCulling = 1 << 5,
+    // Split each batch into slices that are recorded in parallel into
+    // secondary command buffers by a shared worker pool
+    ParallelRecording = 1 << 6,
+    // Render each env into its own layer of an array image rather than
+    // a tile of one wide framebuffer. Avoids the framebuffer width limit
+    // for large batches and makes each env's readback a single copy.
+    LayeredOutput = 1 << 7,
+    // Write results straight into persistently mapped, host cached
+    // memory for CPU consumers, read through
+    // CommandStream::getColorHostPtr / getDepthHostPtr. The results
+    // can't be exported to CUDA.
+    HostReadback = 1 << 8
+};
+
+// Per pixel format of the color output. RGBA8 is copied straight out of
+// the framebuffer; the other formats are written by a compute pass.
+enum class ColorFormat : uint32_t {
+    RGBA8,
+    // RGBA8 without the alpha channel
+    RGB8,
+    // Channels normalized to [0, 1] and stored as 16 bit floats
+    RGBA16F,
+    RGB16F,
+    // Single channel luminance
+    R8
+};
+
+// Order of each env's color output. HWC interleaves the channels of each
+// pixel, CHW stores each channel as a separate plane. Envs are always
+// stored back to back in batch order.
+enum class ColorLayout : uint32_t {
+    HWC,
+    CHW
+};
+
+// Per pixel format of the linear depth output. Float32 is copied straight
+// out of the framebuffer; the other formats are written by a compute pass.
+enum class DepthFormat : uint32_t {
+    Float32,
+    Float16,
+    // Depth in millimetres, clamped to RenderConfig::maxDepth
+    UInt16Millimetres
 };
 
 struct NoMaterial {
@@ -47,6 +101,27 @@ struct RenderConfig {
     uint32_t imgWidth;
     uint32_t imgHeight;
     glm::mat4 coordinateTransform;
+    // Frames each stream can have in flight. 0 picks 1, or 2 with
+    // RenderOptions::DoubleBuffered.
+    uint32_t numFramesInFlight = 0;
+    ColorFormat colorFormat = ColorFormat::RGBA8;
+    ColorLayout colorLayout = ColorLayout::HWC;
+    DepthFormat depthFormat = DepthFormat::Float32;
+    // Largest depth in scene units (metres) representable by
+    // DepthFormat::UInt16Millimetres, at most 65.535
+    float maxDepth = 65.535f;
+    // Directory compiled pipelines are cached in across runs, one file per
+    // device and driver version. Defaults to $V4R_PIPELINE_CACHE_DIR; the
+    // cache is disabled when neither is set.
+    const char *pipelineCacheDir = nullptr;
+    // Size of the device buffers loaded scenes' vertices and indices are
+    // sub-allocated from. Buffers are only added when the existing ones are
+    // full, and scenes larger than this get a buffer of their own. 0 picks
+    // 64 MiB. Only the config the renderer is created with is used.
+    uint64_t geometryBlockBytes = 0;
+    // Most host memory each loader keeps for staging uploads, larger
+    // scenes are streamed through it in pieces. 0 picks 128 MiB.
+    uint64_t loaderStagingBytes = 0;
 };
 
 inline constexpr RenderOutputs & operator|=(RenderOutputs &a,
@@ -18,7 +18,9 @@ class CommandStreamCUDA : public CommandStream {
 public:
     uint32_t render(const std::vector<Environment> &envs);
 
+    // Raw bytes in RenderConfig::colorFormat / colorLayout
     uint8_t *getColorDevicePtr(uint32_t frame_id = 0) const;
+    // Only holds floats with DepthFormat::Float32, reinterpret otherwise
     float *getDepthDevicePtr(uint32_t frame_id = 0) const;
 
     cudaExternalSemaphore_t getCudaSemaphore(uint32_t frame_id = 0) const;
@@ -28,9 +30,9 @@ public:
 private:
     CommandStreamCUDA(CommandStream &&base,
                       const CudaState &cuda_global,
-                      bool double_buffered);
+                      uint32_t num_frames);
 
-    Handle<SyncState[]> syncs_;
+    Handle<SyncState> syncs_;
     Handle<CudaStreamState[]> cuda_;
 
 friend class BatchRendererCUDA;
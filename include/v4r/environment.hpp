@@ -34,6 +34,10 @@ public:
 
     inline void setInstanceMaterial(uint32_t inst_id, uint32_t material_idx);
 
+    // Every instance ID handed out so far is below this, including IDs of
+    // deleted instances
+    inline uint32_t getNumInstanceIDs() const;
+
     // Camera transformations
     inline const glm::mat4 &getCameraView() const;
 
@@ -46,17 +50,28 @@ public:
 
     inline void translateCamera(const glm::vec3 &v);
 
-    uint32_t addLight(const glm::vec3 &position, const glm::vec3 &color);
+    // See SceneDescription::addLight
+    uint32_t addLight(const glm::vec3 &position, const glm::vec3 &color,
+                      float radius = 0.f);
     void deleteLight(uint32_t light_id);
 
 private:
     Environment(Handle<EnvironmentState> &&env);
 
+    inline void markDirty(uint32_t model_idx, uint32_t instance_idx);
+
     Handle<EnvironmentState> state_;
     glm::mat4 view_;
     std::vector<std::pair<uint32_t, uint32_t>> index_map_;
     std::vector<std::vector<glm::mat4x3>> transforms_;
+    // Global material table indices, see material_base_
     std::vector<std::vector<uint32_t>> materials_;
+    // Offset of the scene's materials in the renderer's material table
+    uint32_t material_base_;
+
+    // Per model [begin, end) range of instances modified since the last
+    // render, so unchanged instance data isn't reuploaded
+    mutable std::vector<std::pair<uint32_t, uint32_t>> dirty_ranges_;
 
 friend class CommandStream;
 friend class CommandStreamState;
@@ -5,6 +5,8 @@
 
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <algorithm>
+
 namespace v4r {
 
 uint32_t Environment::addInstance(uint32_t model_idx, uint32_t material_idx,
@@ -25,6 +27,7 @@ void Environment::updateInstanceTransform(uint32_t inst_id,
 {
     const auto &p = index_map_[inst_id];
     transforms_[p.first][p.second] = mat;
+    markDirty(p.first, p.second);
 }
 
 void Environment::updateInstanceTransform(uint32_t inst_id,
@@ -33,11 +36,24 @@ void Environment::updateInstanceTransform(uint32_t inst_id,
     updateInstanceTransform(inst_id, glm::mat4x3(mat));
 }
 
+uint32_t Environment::getNumInstanceIDs() const
+{
+    return index_map_.size();
+}
+
 void Environment::setInstanceMaterial(uint32_t inst_id,
                                       uint32_t material_idx)
 {
     const auto &p = index_map_[inst_id];
-    materials_[p.first][p.second] = material_idx;
+    materials_[p.first][p.second] = material_base_ + material_idx;
+    markDirty(p.first, p.second);
+}
+
+void Environment::markDirty(uint32_t model_idx, uint32_t instance_idx)
+{
+    auto &range = dirty_ranges_[model_idx];
+    range.first = std::min(range.first, instance_idx);
+    range.second = std::max(range.second, instance_idx + 1);
 }
 
 void Environment::setCameraView(const glm::vec3 &eye, const glm::vec3 &look,
@@ -0,0 +1,111 @@
+#ifndef V4R_SCHEDULER_HPP_INCLUDED
+#define V4R_SCHEDULER_HPP_INCLUDED
+
+#include <v4r.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace v4r {
+
+// Where a scheduled env ended up. Its results are at batchIdx of frameID
+// in the stream, and stay there until the render is passed to
+// BatchScheduler::release.
+struct ScheduledRender {
+    uint32_t streamIdx;
+    uint32_t frameID;
+    uint32_t batchIdx;
+    uint64_t ticket;
+};
+
+// Forms batches out of envs submitted one at a time from any thread, and
+// renders them on whichever stream has the fewest frames in flight.
+// StreamT can be any CommandStream type, e.g. CommandStreamCUDA. The
+// streams are driven exclusively by the scheduler from then on, and must
+// not use RenderOptions::CpuSynchronization.
+template <typename StreamT = CommandStream>
+class BatchScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A batch is rendered once batch_size envs are waiting, or when the
+    // oldest has waited max_wait
+    BatchScheduler(std::vector<StreamT *> streams,
+                   uint32_t batch_size,
+                   std::chrono::microseconds max_wait);
+    BatchScheduler(const BatchScheduler &) = delete;
+
+    // Renders anything still pending, which may need earlier renders to
+    // be released first
+    ~BatchScheduler();
+
+    // env must outlive the returned future becoming ready and not be
+    // touched until then. With a deadline the env is rendered early
+    // enough to likely be ready by it, going by recent batch latencies.
+    std::future<ScheduledRender> submit(
+        Environment &env,
+        Clock::time_point deadline = Clock::time_point::max());
+
+    // Call once done reading render's outputs. A frame is only rendered
+    // into again after every env of the batch in it has been released.
+    void release(const ScheduledRender &render);
+
+private:
+    struct Request {
+        Environment *env;
+        Clock::time_point submitTime;
+        Clock::time_point deadline;
+        std::promise<ScheduledRender> promise;
+    };
+
+    struct InFlightBatch {
+        uint32_t streamIdx;
+        FrameTicket ticket;
+        Clock::time_point dispatchTime;
+        std::vector<std::promise<ScheduledRender>> promises;
+    };
+
+    Clock::time_point getFlushTime(const Request &req) const;
+    int32_t pickStream() const;
+
+    void dispatchLoop();
+    void completionLoop(uint32_t stream_idx);
+
+    std::vector<StreamT *> streams_;
+    uint32_t batch_size_;
+    std::chrono::microseconds max_wait_;
+
+    std::mutex lock_;
+    std::condition_variable dispatch_cv_;
+    std::vector<Request> pending_;
+
+    // Every stream is completed by its own thread, a stream's batches
+    // finish in order but a slow stream doesn't hold up the others
+    std::vector<std::condition_variable> complete_cvs_;
+    std::vector<std::deque<InFlightBatch>> in_flight_;
+
+    // Per stream and frame, how many envs rendered into the frame haven't
+    // been released yet
+    std::vector<std::vector<uint32_t>> frame_holds_;
+    // Frame each stream renders into next, streams cycle through frames
+    std::vector<uint32_t> next_frames_;
+    // Frames of each stream that are held
+    std::vector<uint32_t> stream_loads_;
+    Clock::duration latency_estimate_;
+    bool stop_;
+    bool dispatch_done_;
+
+    std::thread dispatcher_;
+    std::vector<std::thread> completers_;
+};
+
+}
+
+#include <v4r/scheduler.inl>
+
+#endif
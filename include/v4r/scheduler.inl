@@ -0,0 +1,265 @@
+#ifndef V4R_SCHEDULER_INL_INCLUDED
+#define V4R_SCHEDULER_INL_INCLUDED
+
+#include <v4r/scheduler.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+namespace v4r {
+
+template <typename StreamT>
+BatchScheduler<StreamT>::BatchScheduler(std::vector<StreamT *> streams,
+                                        uint32_t batch_size,
+                                        std::chrono::microseconds max_wait)
+    : streams_(std::move(streams)),
+      batch_size_(batch_size),
+      max_wait_(max_wait),
+      lock_(),
+      dispatch_cv_(),
+      pending_(),
+      complete_cvs_(streams_.size()),
+      in_flight_(streams_.size()),
+      frame_holds_(),
+      next_frames_(streams_.size(), 0),
+      stream_loads_(streams_.size(), 0),
+      latency_estimate_(Clock::duration::zero()),
+      stop_(false),
+      dispatch_done_(false),
+      dispatcher_(),
+      completers_()
+{
+    frame_holds_.reserve(streams_.size());
+    for (StreamT *stream : streams_) {
+        frame_holds_.emplace_back(stream->getNumFrames(), 0);
+    }
+
+    dispatcher_ = std::thread([this]() { dispatchLoop(); });
+
+    completers_.reserve(streams_.size());
+    for (uint32_t stream_idx = 0; stream_idx < streams_.size();
+         stream_idx++) {
+        completers_.emplace_back([this, stream_idx]() {
+            completionLoop(stream_idx);
+        });
+    }
+}
+
+template <typename StreamT>
+BatchScheduler<StreamT>::~BatchScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+    }
+    dispatch_cv_.notify_all();
+    dispatcher_.join();
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        dispatch_done_ = true;
+    }
+
+    for (std::condition_variable &complete_cv : complete_cvs_) {
+        complete_cv.notify_all();
+    }
+
+    for (std::thread &completer : completers_) {
+        completer.join();
+    }
+}
+
+template <typename StreamT>
+std::future<ScheduledRender> BatchScheduler<StreamT>::submit(
+    Environment &env, Clock::time_point deadline)
+{
+    std::promise<ScheduledRender> promise;
+    std::future<ScheduledRender> result = promise.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        pending_.push_back(Request {
+            &env,
+            Clock::now(),
+            deadline,
+            std::move(promise)
+        });
+    }
+    dispatch_cv_.notify_one();
+
+    return result;
+}
+
+template <typename StreamT>
+void BatchScheduler<StreamT>::release(const ScheduledRender &render)
+{
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        uint32_t &holds = frame_holds_[render.streamIdx][render.frameID];
+        assert(holds > 0);
+
+        if (--holds > 0) return;
+
+        stream_loads_[render.streamIdx]--;
+    }
+
+    // The frame can be rendered into again
+    dispatch_cv_.notify_one();
+}
+
+template <typename StreamT>
+typename BatchScheduler<StreamT>::Clock::time_point
+BatchScheduler<StreamT>::getFlushTime(const Request &req) const
+{
+    // Leave a typical batch's worth of time before the deadline
+    return std::min(req.submitTime + max_wait_,
+                    req.deadline - latency_estimate_);
+}
+
+template <typename StreamT>
+int32_t BatchScheduler<StreamT>::pickStream() const
+{
+    int32_t best_idx = -1;
+    for (uint32_t stream_idx = 0; stream_idx < streams_.size();
+         stream_idx++) {
+        // The next render would overwrite results that are still in
+        // flight or being read
+        if (frame_holds_[stream_idx][next_frames_[stream_idx]] > 0) {
+            continue;
+        }
+
+        if (best_idx == -1 ||
+            stream_loads_[stream_idx] < stream_loads_[best_idx]) {
+            best_idx = stream_idx;
+        }
+    }
+
+    return best_idx;
+}
+
+template <typename StreamT>
+void BatchScheduler<StreamT>::dispatchLoop()
+{
+    std::unique_lock<std::mutex> lock(lock_);
+
+    while (true) {
+        if (pending_.empty()) {
+            if (stop_) break;
+
+            dispatch_cv_.wait(lock);
+            continue;
+        }
+
+        // Most urgent first
+        std::sort(pending_.begin(), pending_.end(),
+                  [this](const Request &a, const Request &b) {
+                      return getFlushTime(a) < getFlushTime(b);
+                  });
+
+        Clock::time_point flush_time = getFlushTime(pending_.front());
+        if (!stop_ && pending_.size() < batch_size_ &&
+            Clock::now() < flush_time) {
+            dispatch_cv_.wait_until(lock, flush_time);
+            continue;
+        }
+
+        int32_t stream_idx = pickStream();
+        if (stream_idx == -1) {
+            // Woken once a frame is released
+            dispatch_cv_.wait(lock);
+            continue;
+        }
+
+        uint32_t num_envs =
+            std::min<size_t>(pending_.size(), batch_size_);
+
+        std::vector<Request> batch_reqs(
+            std::make_move_iterator(pending_.begin()),
+            std::make_move_iterator(pending_.begin() + num_envs));
+        pending_.erase(pending_.begin(), pending_.begin() + num_envs);
+
+        lock.unlock();
+
+        // The envs are only read while rendering, so they're handed back
+        // as soon as render returns
+        std::vector<Environment> batch;
+        batch.reserve(num_envs);
+        for (Request &req : batch_reqs) {
+            batch.emplace_back(std::move(*req.env));
+        }
+
+        StreamT &stream = *streams_[stream_idx];
+        Clock::time_point dispatch_time = Clock::now();
+        uint32_t frame_id = stream.render(batch);
+
+        InFlightBatch in_flight {
+            static_cast<uint32_t>(stream_idx),
+            stream.getTicket(frame_id),
+            dispatch_time,
+            {}
+        };
+        in_flight.promises.reserve(num_envs);
+
+        for (uint32_t batch_idx = 0; batch_idx < num_envs; batch_idx++) {
+            *batch_reqs[batch_idx].env = std::move(batch[batch_idx]);
+            in_flight.promises.emplace_back(
+                std::move(batch_reqs[batch_idx].promise));
+        }
+
+        lock.lock();
+
+        // Held until every env is released, which can't happen before the
+        // promises are fulfilled by the completion thread
+        std::vector<uint32_t> &frame_holds = frame_holds_[stream_idx];
+        frame_holds[frame_id] = num_envs;
+        next_frames_[stream_idx] = (frame_id + 1) % frame_holds.size();
+        stream_loads_[stream_idx]++;
+
+        in_flight_[stream_idx].push_back(std::move(in_flight));
+        complete_cvs_[stream_idx].notify_one();
+    }
+}
+
+template <typename StreamT>
+void BatchScheduler<StreamT>::completionLoop(uint32_t stream_idx)
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    std::deque<InFlightBatch> &in_flight = in_flight_[stream_idx];
+
+    while (true) {
+        complete_cvs_[stream_idx].wait(lock, [&]() {
+            return dispatch_done_ || !in_flight.empty();
+        });
+
+        if (in_flight.empty()) break;
+
+        InFlightBatch batch = std::move(in_flight.front());
+        in_flight.pop_front();
+
+        lock.unlock();
+
+        streams_[stream_idx]->waitForFrame(batch.ticket);
+        Clock::duration latency = Clock::now() - batch.dispatchTime;
+
+        lock.lock();
+        latency_estimate_ = (latency_estimate_ * 7 + latency) / 8;
+        lock.unlock();
+
+        for (uint32_t batch_idx = 0; batch_idx < batch.promises.size();
+             batch_idx++) {
+            batch.promises[batch_idx].set_value(ScheduledRender {
+                batch.streamIdx,
+                batch.ticket.frameID,
+                batch_idx,
+                batch.ticket.id
+            });
+        }
+
+        lock.lock();
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef V4R_SERVER_HPP_INCLUDED
+#define V4R_SERVER_HPP_INCLUDED
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+namespace v4r {
+
+// Wire format of v4r_server. Clients connect to its SOCK_SEQPACKET Unix
+// socket, send one ServerConnectRequest, then alternate between sending a
+// step and receiving its ServerStepReply. Every struct is sent as is,
+// both ends run on the same machine.
+
+constexpr uint32_t server_max_message_bytes = 1 << 20;
+
+enum class ServerMessage : uint32_t {
+    Connect,
+    Step
+};
+
+struct ServerConnectRequest {
+    ServerMessage type;
+    // Must be at most the server's batch size
+    uint32_t numEnvs;
+    float hfov;
+    float near;
+    float far;
+};
+
+// Sent with the descriptor of the server's shared frame memory attached
+// (SCM_RIGHTS), which can be mapped with ShmFrameReader. Env data lives
+// at batchSlot * envColorBytes from the frame's color pointer, and
+// likewise for depth.
+struct ServerConnectReply {
+    // 0 on success, in which case a descriptor is attached
+    uint32_t status;
+    uint32_t imgWidth;
+    uint32_t imgHeight;
+    uint32_t numFrames;
+    uint64_t envColorBytes;
+    uint64_t envDepthBytes;
+};
+
+struct ServerInstanceUpdate {
+    uint32_t envIdx;
+    // IDs of the scene's default instances, in scene order
+    uint32_t instanceID;
+    glm::mat4x3 transform;
+};
+
+// Followed by one glm::mat4 camera view per env, then numInstanceUpdates
+// ServerInstanceUpdates
+struct ServerStepRequest {
+    ServerMessage type;
+    uint32_t numInstanceUpdates;
+};
+
+// Followed by the batch slot of each of the client's envs. The results
+// are complete once ShmFrameReader::waitForFrame(frameID, ticket)
+// returns, and stay valid until the server cycles through every frame,
+// which can be detected with isStillReady.
+struct ServerStepReply {
+    uint64_t ticket;
+    uint32_t frameID;
+    uint32_t numEnvs;
+};
+
+}
+
+#endif
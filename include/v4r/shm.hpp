@@ -0,0 +1,131 @@
+#ifndef V4R_SHM_HPP_INCLUDED
+#define V4R_SHM_HPP_INCLUDED
+
+#include <v4r.hpp>
+
+#include <atomic>
+#include <cstdint>
+
+namespace v4r {
+
+// Per frame state in the shared header
+struct ShmFrameSlot {
+    // Ticket of the batch held by the frame, only meaningful while ready
+    // is set
+    std::atomic<uint64_t> ticket;
+    // Cleared before the frame is rendered into again
+    std::atomic<uint32_t> ready;
+    uint32_t pad;
+};
+
+// Start of the shared memory region exported by CommandStreamShm, followed
+// by numFrames ShmFrameSlots. Frame i starts at
+// frameOffset + i * frameStride, with color first and depth at depthOffset
+// within the frame, in the layout of the host readback pointers.
+struct ShmHeader {
+    static constexpr uint32_t magic_value = 0x56345253;
+
+    uint32_t magic;
+    uint32_t numFrames;
+    uint64_t frameOffset;
+    uint64_t frameStride;
+    uint64_t colorBytes;
+    uint64_t depthOffset;
+    uint64_t depthBytes;
+    uint64_t totalBytes;
+    // Futex word, incremented whenever a frame becomes ready
+    std::atomic<uint32_t> publishCount;
+    uint32_t pad;
+
+    ShmFrameSlot *getSlots()
+    {
+        return reinterpret_cast<ShmFrameSlot *>(this + 1);
+    }
+
+    const ShmFrameSlot *getSlots() const
+    {
+        return reinterpret_cast<const ShmFrameSlot *>(this + 1);
+    }
+};
+
+struct ShmStreamState;
+
+class BatchRendererShm;
+
+// Renders every frame into a memfd / POSIX shared memory region that other
+// processes can map with ShmFrameReader. Frames are published to readers
+// once waitForFrame or publishReadyFrames sees them complete.
+class CommandStreamShm : public CommandStream {
+public:
+    CommandStreamShm(CommandStreamShm &&) = default;
+    ~CommandStreamShm();
+
+    uint32_t render(const std::vector<Environment> &envs);
+
+    void waitForFrame(uint32_t frame_id = 0);
+    bool waitForFrame(const FrameTicket &ticket,
+                      uint64_t timeout = UINT64_MAX) const;
+
+    // Publishes every completed frame without blocking
+    void publishReadyFrames() const;
+
+    // Can be passed to other processes over a Unix socket or inherited
+    int getFD() const;
+    uint64_t getNumBytes() const;
+
+private:
+    CommandStreamShm(CommandStream &&base, const char *shm_name);
+
+    Handle<ShmStreamState> shm_;
+
+friend class BatchRendererShm;
+};
+
+class BatchRendererShm : public BatchRenderer {
+public:
+    template <typename PipelineType>
+    BatchRendererShm(const RenderConfig &cfg,
+                     const RenderFeatures<PipelineType> &features)
+        : BatchRenderer(cfg, features)
+    {}
+
+    // Without a name the region is an anonymous memfd, see getFD()
+    CommandStreamShm makeCommandStream(const char *shm_name = nullptr,
+                                       uint32_t pipeline_idx = 0);
+};
+
+// Consumer side, needs no GPU
+class ShmFrameReader {
+public:
+    explicit ShmFrameReader(const char *shm_name);
+    explicit ShmFrameReader(int fd);
+    ShmFrameReader(const ShmFrameReader &) = delete;
+    ShmFrameReader(ShmFrameReader &&o);
+    ~ShmFrameReader();
+
+    uint32_t getNumFrames() const { return header_->numFrames; }
+
+    const uint8_t *getColorPtr(uint32_t frame_id = 0) const;
+    const void *getDepthPtr(uint32_t frame_id = 0) const;
+
+    // 0 while the frame isn't ready
+    uint64_t getReadyTicket(uint32_t frame_id = 0) const;
+
+    // Blocks until frame_id holds a batch with a ticket of at least
+    // min_ticket, and returns that ticket. Returns 0 if timeout (in
+    // nanoseconds) expires first.
+    uint64_t waitForFrame(uint32_t frame_id, uint64_t min_ticket,
+                          uint64_t timeout = UINT64_MAX) const;
+
+    // Frames aren't locked, so after reading a frame check that it wasn't
+    // rendered into again in the meantime
+    bool isStillReady(uint32_t frame_id, uint64_t ticket) const;
+
+private:
+    ShmHeader *header_;
+    uint64_t num_bytes_;
+};
+
+}
+
+#endif
@@ -397,16 +397,19 @@ struct MaterialImpl<{parent_type}::MaterialParams> {{
 f"""BindingConfig<{len(bindings)}, VK_DESCRIPTOR_TYPE_SAMPLER, 1,
                       VK_SHADER_STAGE_FRAGMENT_BIT>""")
 
+            # Filled in as scenes are loaded while streams are rendering
             for i in range(self.num_textures):
                 bindings.append(
 f"""BindingConfig<{len(bindings)}, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
                       VulkanConfig::max_materials,
                       VK_SHADER_STAGE_FRAGMENT_BIT,
-                      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT>""")
+                      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+                      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+                      VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT>""")
 
         if self.num_params > 0:
             bindings.append(
-f"""BindingConfig<{len(bindings)}, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
+f"""BindingConfig<{len(bindings)}, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
                       VK_SHADER_STAGE_FRAGMENT_BIT>""")
 
         if len(bindings) == 0:
@@ -514,7 +517,7 @@ def generate_props_specialization(specialization_type, props,
                       VK_SHADER_STAGE_FRAGMENT_BIT"""
                  
         frame_bindings.append(
-"""BindingConfig<1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
+"""BindingConfig<1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
                       VK_SHADER_STAGE_FRAGMENT_BIT>""")
     else:
         view_info_stages = "VK_SHADER_STAGE_VERTEX_BIT"
@@ -546,6 +549,8 @@ struct PipelineProps<{specialization_type}> {{
 
     static constexpr const char *vertexShaderName =
         "{shader_name}.vert.spv";
+    static constexpr const char *layeredVertexShaderName =
+        "{shader_name}_layered.vert.spv";
     static constexpr const char *fragmentShaderName =
         "{shader_name}.frag.spv";
 
@@ -563,6 +568,9 @@ def write_template_instantiations(type_str, v4r, v4r_display,
 f"""template BatchRenderer::BatchRenderer(const RenderConfig &,
     const RenderFeatures<{type_str}> &);
 
+template uint32_t BatchRenderer::addPipeline(const RenderConfig &,
+    const RenderFeatures<{type_str}> &);
+
 template std::shared_ptr<Mesh> AssetLoader::loadMesh(
         std::vector<{type_str}::Vertex>,
         std::vector<uint32_t>);
@@ -589,6 +597,9 @@ f"""template VulkanState::VulkanState(const RenderConfig &,
 template VulkanState::VulkanState(const RenderConfig &,
     const RenderFeatures<{type_str}> &,
     CoreVulkanHandles &&);
+
+template uint32_t VulkanState::addVariant(const RenderConfig &,
+    const RenderFeatures<{type_str}> &);
 """, file=render)
 
     loader_instantiate = \
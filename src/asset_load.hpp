@@ -2,6 +2,7 @@
 #define ASSET_LOAD_HPP_INCLUDED
 
 #include "scene.hpp"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 
 #include <v4r/assets.hpp>
@@ -16,7 +17,8 @@ std::shared_ptr<Texture> readSDRTexture(const uint8_t *input,
 
 template <typename MaterialParamType>
 std::vector<std::shared_ptr<Material>> assimpParseMaterials(
-        const aiScene *scene, const std::shared_ptr<Texture> &default_diffuse);
+        const aiScene *scene, const std::shared_ptr<Texture> &default_diffuse,
+        ThreadPool &decode_pool);
 
 template <typename VertexType>
 std::pair<std::vector<VertexType>, std::vector<uint32_t>> assimpParseMesh(
@@ -115,7 +117,8 @@ inline GLTFScene gltfLoad(const std::string_view gltf_path) noexcept;
 template <typename MaterialParamsType>
 std::vector<std::shared_ptr<Material>> gltfParseMaterials(
         const GLTFScene &scene,
-        const std::shared_ptr<Texture> &default_diffuse);
+        const std::shared_ptr<Texture> &default_diffuse,
+        ThreadPool &decode_pool);
 
 template <typename VertexType>
 std::pair<std::vector<VertexType>, std::vector<uint32_t>>
@@ -17,9 +17,12 @@
 #include <stb/stb_image.h>
 #undef STB_IMAGE_IMPLEMENTATION
 
+#include <array>
 #include <cassert>
 #include <iostream>
+#include <optional>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
 
@@ -132,35 +135,35 @@ std::shared_ptr<Texture> readBasisTexture(const uint8_t *raw_input,
     });
 }
 
-static const std::shared_ptr<Texture> assimpLoadTexture(
+// Returns the index in textures of the material's embedded texture of
+// type, adding it the first time it's seen
+static std::optional<uint32_t> assimpFindTexture(
         const aiScene *raw_scene,
         const aiMaterial *raw_mat,
         aiTextureType type,
-        std::unordered_map<std::string, std::shared_ptr<Texture>> &loaded)
+        std::vector<const aiTexture *> &textures,
+        std::unordered_map<std::string, uint32_t> &indices)
 {
     aiString tex_path;
     bool has_texture = raw_mat->Get(AI_MATKEY_TEXTURE(type, 0), tex_path) ==
         AI_SUCCESS;
 
-    if (!has_texture) return nullptr;
+    if (!has_texture) return std::nullopt;
 
-    auto lookup = loaded.find(tex_path.C_Str());
+    auto lookup = indices.find(tex_path.C_Str());
 
-    if (lookup != loaded.end()) return lookup->second;
+    if (lookup != indices.end()) return lookup->second;
 
     if (auto texture = raw_scene->GetEmbeddedTexture(tex_path.C_Str())) {
         if (texture->mHeight > 0) {
             std::cerr << "Uncompressed textures not supported" << std::endl;
             fatalExit();
         } else {
-            const uint8_t *raw_input =
-                reinterpret_cast<const uint8_t *>(texture->pcData);
+            uint32_t texture_idx = textures.size();
+            textures.push_back(texture);
+            indices.emplace(tex_path.C_Str(), texture_idx);
 
-            auto loaded_texture = readSDRTexture(raw_input, texture->mWidth);
-
-            loaded.emplace(tex_path.C_Str(), loaded_texture);
-
-            return loaded_texture;
+            return texture_idx;
         }
     } else {
         std::cerr << "External textures not supported yet" << std::endl;
@@ -171,18 +174,54 @@ static const std::shared_ptr<Texture> assimpLoadTexture(
 template <typename MaterialParamsType>
 std::vector<std::shared_ptr<Material>> assimpParseMaterials(
         const aiScene *raw_scene,
-        const std::shared_ptr<Texture> &default_diffuse)
+        const std::shared_ptr<Texture> &default_diffuse,
+        ThreadPool &decode_pool)
 {
+    // Ambient, diffuse and specular
+    constexpr std::array<aiTextureType, 3> texture_types {
+        aiTextureType_AMBIENT,
+        aiTextureType_DIFFUSE,
+        aiTextureType_SPECULAR
+    };
+
+    std::vector<const aiTexture *> raw_textures;
+    std::unordered_map<std::string, uint32_t> texture_indices;
+
+    // Find every texture first so they can all be decoded at once
+    std::vector<std::array<std::optional<uint32_t>, 3>> material_textures(
+        raw_scene->mNumMaterials);
+    for (uint32_t mat_idx = 0; mat_idx < raw_scene->mNumMaterials; mat_idx++) {
+        const aiMaterial *raw_mat = raw_scene->mMaterials[mat_idx];
+
+        for (uint32_t type_idx = 0; type_idx < texture_types.size();
+             type_idx++) {
+            material_textures[mat_idx][type_idx] = assimpFindTexture(
+                raw_scene, raw_mat, texture_types[type_idx], raw_textures,
+                texture_indices);
+        }
+    }
+
+    std::vector<std::shared_ptr<Texture>> textures(raw_textures.size());
+    decode_pool.parallelFor(textures.size(), [&](uint32_t texture_idx) {
+        const aiTexture *raw_texture = raw_textures[texture_idx];
+
+        textures[texture_idx] = readSDRTexture(
+            reinterpret_cast<const uint8_t *>(raw_texture->pcData),
+            raw_texture->mWidth);
+    });
+
+    auto getTexture = [&](uint32_t mat_idx, uint32_t type_idx) {
+        const auto &texture_idx = material_textures[mat_idx][type_idx];
+
+        return texture_idx ? textures[*texture_idx] : nullptr;
+    };
+
     std::vector<std::shared_ptr<Material>> materials;
-    
-    std::unordered_map<std::string, std::shared_ptr<Texture>> loaded;
 
     for (uint32_t mat_idx = 0; mat_idx < raw_scene->mNumMaterials; mat_idx++) {
         const aiMaterial *raw_mat = raw_scene->mMaterials[mat_idx];
 
-        auto ambient_tex = assimpLoadTexture(raw_scene, raw_mat,
-                                             aiTextureType_AMBIENT,
-                                             loaded);
+        auto ambient_tex = getTexture(mat_idx, 0);
 
         glm::vec4 ambient_color {};
         if (!ambient_tex) {
@@ -191,9 +230,7 @@ std::vector<std::shared_ptr<Material>> assimpParseMaterials(
             ambient_color = glm::vec4(color.r, color.g, color.b, color.a);
         }
 
-        auto diffuse_tex = assimpLoadTexture(raw_scene, raw_mat,
-                                             aiTextureType_DIFFUSE,
-                                             loaded);
+        auto diffuse_tex = getTexture(mat_idx, 1);
 
         glm::vec4 diffuse_color {};
         if (!diffuse_tex) {
@@ -202,9 +239,7 @@ std::vector<std::shared_ptr<Material>> assimpParseMaterials(
             diffuse_color = glm::vec4(color.r, color.g, color.b, color.a);
         }
 
-        auto specular_tex = assimpLoadTexture(raw_scene, raw_mat,
-                                              aiTextureType_SPECULAR,
-                                              loaded);
+        auto specular_tex = getTexture(mat_idx, 2);
         glm::vec4 specular_color {};
         if (!specular_tex) {
             aiColor4D color;
@@ -768,10 +803,27 @@ static std::shared_ptr<Texture> gltfLoadTexture(const GLTFScene &scene,
 template <typename MaterialParamsType>
 std::vector<std::shared_ptr<Material>> gltfParseMaterials(
         const GLTFScene &scene,
-        const std::shared_ptr<Texture> &default_diffuse)
+        const std::shared_ptr<Texture> &default_diffuse,
+        ThreadPool &decode_pool)
 {
-    std::vector<std::shared_ptr<Material>> materials;
+    // Only decode textures some material uses
+    std::vector<uint32_t> used_textures;
+    std::vector<bool> texture_used(scene.textures.size(), false);
+    for (const auto &gltf_mat : scene.materials) {
+        if (gltf_mat.textureIdx < scene.textures.size() &&
+            !texture_used[gltf_mat.textureIdx]) {
+            texture_used[gltf_mat.textureIdx] = true;
+            used_textures.push_back(gltf_mat.textureIdx);
+        }
+    }
+
     std::vector<std::shared_ptr<Texture>> textures(scene.textures.size());
+    decode_pool.parallelFor(used_textures.size(), [&](uint32_t used_idx) {
+        uint32_t texture_idx = used_textures[used_idx];
+        textures[texture_idx] = gltfLoadTexture(scene, texture_idx);
+    });
+
+    std::vector<std::shared_ptr<Material>> materials;
 
     for (const auto &gltf_mat : scene.materials) {
         std::shared_ptr<Texture> texture;
@@ -781,11 +833,6 @@ std::vector<std::shared_ptr<Material>> gltfParseMaterials(
             texture = default_diffuse;
         }
 
-        if (texture == nullptr) {
-            texture = gltfLoadTexture(scene, gltf_mat.textureIdx);
-            textures[gltf_mat.textureIdx] = texture;
-        }
-
         materials.emplace_back(MaterialImpl<MaterialParamsType>::make(
                 MaterialParam::DiffuseColorTexture { move(texture) },
                 MaterialParam::DiffuseColorUniform { 
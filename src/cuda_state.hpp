@@ -10,6 +10,7 @@ namespace v4r {
 
 class CudaStreamState {
 public:
+    CudaStreamState() = default;
     CudaStreamState(uint8_t *color_ptr, float *depth_ptr,
                     int sem_fd);
 
@@ -0,0 +1,214 @@
+#include "culling.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace v4r {
+
+Frustum extractFrustum(const glm::mat4 &projection, const glm::mat4 &view)
+{
+    glm::mat4 clip = projection * view;
+    auto row = [&clip](int idx) {
+        return glm::vec4(clip[0][idx], clip[1][idx], clip[2][idx],
+                         clip[3][idx]);
+    };
+
+    glm::vec4 x = row(0), y = row(1), z = row(2), w = row(3);
+
+    // Depth is in [0, 1], so the near plane is just z >= 0
+    Frustum frustum {{
+        w + x,
+        w - x,
+        w + y,
+        w - y,
+        z,
+        w - z
+    }};
+
+    for (glm::vec4 &plane : frustum.planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+
+    return frustum;
+}
+
+static inline bool sphereVisible(const Frustum &frustum,
+                                 const glm::vec4 &bounding_sphere,
+                                 const glm::mat4x3 &txfm)
+{
+    glm::vec3 center = txfm * glm::vec4(glm::vec3(bounding_sphere), 1.f);
+
+    float max_scale2 = max(max(glm::dot(txfm[0], txfm[0]),
+                               glm::dot(txfm[1], txfm[1])),
+                           glm::dot(txfm[2], txfm[2]));
+    float radius = bounding_sphere.w * sqrtf(max_scale2);
+
+    for (const glm::vec4 &plane : frustum.planes) {
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t cullInstances(const Frustum &frustum,
+                       const glm::vec4 &bounding_sphere,
+                       const glm::mat4x3 *transforms,
+                       const uint32_t *materials,
+                       uint32_t num_instances,
+                       glm::mat4x3 *out_transforms,
+                       uint32_t *out_materials)
+{
+    uint32_t num_visible = 0;
+    auto emit = [&](uint32_t inst_idx) {
+        out_transforms[num_visible] = transforms[inst_idx];
+        if (out_materials) {
+            out_materials[num_visible] = materials[inst_idx];
+        }
+        num_visible++;
+    };
+
+    uint32_t inst_idx = 0;
+
+#ifdef __SSE2__
+    // Test 4 instances per iteration, with each lane holding one instance.
+    // Transforms are transposed into SoA form as they are loaded.
+    const __m128 sphere_x = _mm_set1_ps(bounding_sphere.x);
+    const __m128 sphere_y = _mm_set1_ps(bounding_sphere.y);
+    const __m128 sphere_z = _mm_set1_ps(bounding_sphere.z);
+    const __m128 sphere_r = _mm_set1_ps(bounding_sphere.w);
+
+    for (; inst_idx + 4 <= num_instances; inst_idx += 4) {
+        const float *m0 = &transforms[inst_idx][0][0];
+        const float *m1 = &transforms[inst_idx + 1][0][0];
+        const float *m2 = &transforms[inst_idx + 2][0][0];
+        const float *m3 = &transforms[inst_idx + 3][0][0];
+
+        __m128 m[12];
+        for (int i = 0; i < 12; i++) {
+            m[i] = _mm_set_ps(m3[i], m2[i], m1[i], m0[i]);
+        }
+
+        // a * b + c * d + e * f + g
+        auto dot3 = [](__m128 a, __m128 b, __m128 c, __m128 d,
+                       __m128 e, __m128 f, __m128 g) {
+            return _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(a, b), _mm_mul_ps(c, d)),
+                _mm_add_ps(_mm_mul_ps(e, f), g));
+        };
+
+        const __m128 zero = _mm_setzero_ps();
+
+        __m128 cx = dot3(m[0], sphere_x, m[3], sphere_y, m[6], sphere_z, m[9]);
+        __m128 cy = dot3(m[1], sphere_x, m[4], sphere_y, m[7], sphere_z, m[10]);
+        __m128 cz = dot3(m[2], sphere_x, m[5], sphere_y, m[8], sphere_z, m[11]);
+
+        // Conservative radius under non uniform scale
+        __m128 scale0 = dot3(m[0], m[0], m[1], m[1], m[2], m[2], zero);
+        __m128 scale1 = dot3(m[3], m[3], m[4], m[4], m[5], m[5], zero);
+        __m128 scale2 = dot3(m[6], m[6], m[7], m[7], m[8], m[8], zero);
+
+        __m128 neg_radius = _mm_sub_ps(zero, _mm_mul_ps(sphere_r,
+            _mm_sqrt_ps(_mm_max_ps(_mm_max_ps(scale0, scale1), scale2))));
+
+        __m128 visible = _mm_cmpeq_ps(zero, zero);
+        for (const glm::vec4 &plane : frustum.planes) {
+            __m128 dist = dot3(_mm_set1_ps(plane.x), cx,
+                               _mm_set1_ps(plane.y), cy,
+                               _mm_set1_ps(plane.z), cz,
+                               _mm_set1_ps(plane.w));
+
+            visible = _mm_and_ps(visible, _mm_cmpge_ps(dist, neg_radius));
+        }
+
+        int mask = _mm_movemask_ps(visible);
+        if (mask == 0xF) {
+            memcpy(out_transforms + num_visible, transforms + inst_idx,
+                   4 * sizeof(glm::mat4x3));
+            if (out_materials) {
+                memcpy(out_materials + num_visible, materials + inst_idx,
+                       4 * sizeof(uint32_t));
+            }
+            num_visible += 4;
+            continue;
+        }
+
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            if (mask & (1 << lane)) {
+                emit(inst_idx + lane);
+            }
+        }
+    }
+#endif
+
+    for (; inst_idx < num_instances; inst_idx++) {
+        if (sphereVisible(frustum, bounding_sphere, transforms[inst_idx])) {
+            emit(inst_idx);
+        }
+    }
+
+    return num_visible;
+}
+
+bool sphereTileBounds(const glm::mat4 &projection,
+                      const glm::vec3 &center,
+                      float radius,
+                      uint32_t tile_dim,
+                      glm::u32vec4 &bounds)
+{
+    const glm::u32vec4 all_tiles(0, 0, tile_dim, tile_dim);
+
+    // The camera looks down -Z
+    if (center.z - radius >= 0.f) {
+        return false;
+    }
+
+    if (center.z + radius >= 0.f) {
+        bounds = all_tiles;
+        return true;
+    }
+
+    // Conservatively project the corners of the sphere's bounding box
+    glm::vec2 ndc_min(INFINITY), ndc_max(-INFINITY);
+    for (uint32_t corner_idx = 0; corner_idx < 8; corner_idx++) {
+        glm::vec3 corner = center + glm::vec3(
+            (corner_idx & 1) ? radius : -radius,
+            (corner_idx & 2) ? radius : -radius,
+            (corner_idx & 4) ? radius : -radius);
+
+        glm::vec4 clip = projection * glm::vec4(corner, 1.f);
+        if (clip.w <= 0.f) {
+            bounds = all_tiles;
+            return true;
+        }
+
+        glm::vec2 ndc = glm::vec2(clip) / clip.w;
+        ndc_min = glm::min(ndc_min, ndc);
+        ndc_max = glm::max(ndc_max, ndc);
+    }
+
+    if (ndc_max.x < -1.f || ndc_max.y < -1.f ||
+        ndc_min.x > 1.f || ndc_min.y > 1.f) {
+        return false;
+    }
+
+    auto to_tile = [tile_dim](float ndc) {
+        float tile = (ndc * 0.5f + 0.5f) * tile_dim;
+        return static_cast<uint32_t>(
+            glm::clamp(tile, 0.f, static_cast<float>(tile_dim - 1)));
+    };
+
+    bounds = glm::u32vec4(to_tile(ndc_min.x), to_tile(ndc_min.y),
+                          to_tile(ndc_max.x) + 1, to_tile(ndc_max.y) + 1);
+
+    return true;
+}
+
+}
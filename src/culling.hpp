@@ -0,0 +1,42 @@
+#ifndef CULLING_HPP_INCLUDED
+#define CULLING_HPP_INCLUDED
+
+#include <array>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+namespace v4r {
+
+// World space frustum planes, normalized so that dot(xyz, p) + w is the
+// signed distance of p from the plane (positive inside)
+struct Frustum {
+    std::array<glm::vec4, 6> planes;
+};
+
+Frustum extractFrustum(const glm::mat4 &projection, const glm::mat4 &view);
+
+// Copies the instances whose bounding sphere intersects the frustum into
+// out_transforms / out_materials and returns the number of survivors.
+// materials and out_materials may be null.
+uint32_t cullInstances(const Frustum &frustum,
+                       const glm::vec4 &bounding_sphere,
+                       const glm::mat4x3 *transforms,
+                       const uint32_t *materials,
+                       uint32_t num_instances,
+                       glm::mat4x3 *out_transforms,
+                       uint32_t *out_materials);
+
+// Computes the [min, max) range of tiles in a tile_dim x tile_dim screen
+// grid that a view space sphere may cover, as (min_x, min_y, max_x, max_y).
+// Returns false if the sphere can't be visible.
+bool sphereTileBounds(const glm::mat4 &projection,
+                      const glm::vec3 &center,
+                      float radius,
+                      uint32_t tile_dim,
+                      glm::u32vec4 &bounds);
+
+}
+
+#endif
@@ -26,6 +26,11 @@ template<typename... Binding>
 struct DescriptorLayout {
     static constexpr size_t NumBindings = sizeof...(Binding);
 
+    // Sets with any update after bind binding need a matching pool
+    static constexpr bool UpdateAfterBind =
+        ((Binding::Flags::value &
+          VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT) || ...);
+
     template<typename... SamplerType>
     static VkDescriptorSetLayout makeSetLayout(
             const DeviceState &dev,
@@ -59,7 +64,8 @@ struct DescriptorLayout {
         VkDescriptorSetLayoutCreateInfo info;
         info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         info.pNext = &flag_info;
-        info.flags = 0;
+        info.flags = UpdateAfterBind ?
+            VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT : 0;
         info.bindingCount = static_cast<uint32_t>(bindings.size());
         info.pBindings = bindings.data();
 
@@ -86,7 +92,8 @@ struct DescriptorLayout {
         VkDescriptorPoolCreateInfo pool_info;
         pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         pool_info.pNext = nullptr;
-        pool_info.flags = 0;
+        pool_info.flags = UpdateAfterBind ?
+            VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT : 0;
         pool_info.maxSets = max_sets;
         pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
         pool_info.pPoolSizes = pool_sizes.data();
@@ -13,6 +13,19 @@ struct BRDFParams {
     vec3 H;
 };
 
+// Smoothly reaches 0 at the light's radius, so lights can be skipped
+// outside of it. Lights without a radius don't fall off.
+float lightFalloff(vec4 light_position, vec3 fragment_pos)
+{
+    float radius = light_position.w;
+    if (radius <= 0.f) return 1.f;
+
+    float dist = length(light_position.xyz - fragment_pos) / radius;
+    float window = clamp(1.f - dist * dist * dist * dist, 0.f, 1.f);
+
+    return window * window;
+}
+
 BRDFParams makeBRDFParams(vec3 light_pos, vec3 fragment_pos,
                           vec3 normal, vec3 light_color)
 {
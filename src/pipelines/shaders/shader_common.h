@@ -8,14 +8,68 @@ struct ViewInfo {
 
 struct RenderPushConstant {
     uint batchIdx;
+    uint layerIdx;
 };
 
+// Lights are stored in view space, with the radius of influence in
+// position.w (0 for lights with unbounded range)
 struct LightProperties {
     vec4 position;
     vec4 color;
 };
 
-#define MAX_MATERIALS (1000)
-#define MAX_LIGHTS (2000)
+// Range of an env's light index list that affects one screen tile
+struct LightTile {
+    uint offset;
+    uint count;
+};
+
+struct CullingInfo {
+    uint numWorkgroupsX;
+    uint numWorkgroupsY;
+    uint numWorkgroupsZ;
+    uint numInstances;
+};
+
+struct DrawCullInfo {
+    vec3 aabbMin;
+    uint batchIdx;
+    vec3 aabbMax;
+    uint pad;
+};
+
+// Describes where one frame of an attachment is read from and how it is
+// packed into the result buffer. Offsets are in 32 bit words.
+struct PackPushConstant {
+    uvec2 baseFBOffset;
+    uint baseFBLayer;
+    uint layered;
+    uint imgWidth;
+    uint imgHeight;
+    uint numImagesWide;
+    uint numChannels;
+    uint grayscale;
+    uint format;
+    uint channelsFirst;
+    uint numElements;
+    uint numWords;
+    uint outputOffset;
+    float maxValue;
+};
+
+#define PACK_FORMAT_UNORM8 (0)
+#define PACK_FORMAT_FLOAT16 (1)
+#define PACK_FORMAT_UINT16_MM (2)
+
+// Shared by every scene loaded into a renderer
+#define MAX_MATERIALS (1 << 14)
+#define MAX_LIGHTS (16384)
+#define MAX_LIGHT_INDICES (1 << 20)
+// Each env has LIGHT_TILE_DIM^2 screen tiles plus one list of the lights
+// that affect every tile
+#define LIGHT_TILE_DIM (8)
+#define LIGHT_TILES_PER_ENV (LIGHT_TILE_DIM * LIGHT_TILE_DIM + 1)
+#define CULL_WORKGROUP_SIZE (64)
+#define PACK_WORKGROUP_SIZE (256)
 
 #endif
@@ -17,9 +17,10 @@ layout (push_constant, scalar) uniform PushConstant {
     RenderPushConstant render_const;
 };
 
-layout (set = 0, binding = 1, scalar) uniform LightingInfo {
+layout (set = 0, binding = 1, scalar) readonly buffer LightingInfo {
     LightProperties lights[MAX_LIGHTS];
-    uint numLights;
+    uint lightIndices[MAX_LIGHT_INDICES];
+    LightTile tiles[];
 } lighting_info;
 
 layout (location = NORMAL_LOC) in vec3 in_normal;
@@ -39,8 +40,8 @@ struct MaterialParams {
     vec4 data[NUM_PARAM_VECS];
 };
 
-layout (set = 1, binding = PARAM_BIND, scalar) uniform Params {
-    MaterialParams material_params[MAX_MATERIALS];
+layout (set = 1, binding = PARAM_BIND, scalar) readonly buffer Params {
+    MaterialParams material_params[];
 };
 
 #endif
@@ -107,20 +108,35 @@ vec4 compute_color()
     float shininess = SHININESS_ACCESS;
 #endif
 
+    // Find this fragment's screen tile the same way the CPU bins lights
+    vec4 clip_pos = view_info[render_const.batchIdx].projection *
+        vec4(in_camera_pos, 1.f);
+    vec2 tile_pos = (clip_pos.xy / clip_pos.w * 0.5f + 0.5f) * LIGHT_TILE_DIM;
+    uvec2 tile = uvec2(clamp(tile_pos, vec2(0.f), vec2(LIGHT_TILE_DIM - 1)));
+
+    uint tile_base = render_const.batchIdx * LIGHT_TILES_PER_ENV;
+    LightTile light_ranges[2] = {
+        lighting_info.tiles[tile_base + LIGHT_TILES_PER_ENV - 1],
+        lighting_info.tiles[tile_base + tile.y * LIGHT_TILE_DIM + tile.x]
+    };
+
     vec3 Lo = vec3(0.0);
-    for (int light_idx = 0; light_idx < lighting_info.numLights; light_idx++) {
-        vec3 world_light_position =
-            lighting_info.lights[light_idx].position.xyz;
-        vec3 light_position =
-                (view_info[render_const.batchIdx].view *
-                    vec4(world_light_position, 1.f)).xyz;
-        vec3 light_color = lighting_info.lights[light_idx].color.xyz;
-        BRDFParams brdf_params = makeBRDFParams(light_position, in_camera_pos,
-                                                in_normal, light_color);
+    for (int range_idx = 0; range_idx < 2; range_idx++) {
+        LightTile range = light_ranges[range_idx];
+
+        for (uint i = 0; i < range.count; i++) {
+            uint light_idx = lighting_info.lightIndices[range.offset + i];
+            LightProperties light = lighting_info.lights[light_idx];
+
+            vec3 light_color = light.color.xyz *
+                lightFalloff(light.position, in_camera_pos);
+            BRDFParams brdf_params = makeBRDFParams(light.position.xyz,
+                in_camera_pos, in_normal, light_color);
 
 #ifdef BLINN_PHONG
-        Lo += blinnPhong(brdf_params, shininess, diffuse, specular);
+            Lo += blinnPhong(brdf_params, shininess, diffuse, specular);
 #endif
+        }
     }
 
     return vec4(Lo, 1.f);
@@ -1,6 +1,10 @@
 #version 450
 #extension GL_EXT_scalar_block_layout : require
 
+#ifdef LAYERED_OUTPUT
+#extension GL_ARB_shader_viewport_layer_array : require
+#endif
+
 #include "shader_common.h"
 
 // FIXME switch back to a max sized uniform
@@ -63,6 +67,10 @@ void main()
 
     gl_Position = view_info[render_const.batchIdx].projection * camera_space;
 
+#ifdef LAYERED_OUTPUT
+    gl_Layer = int(render_const.layerIdx);
+#endif
+
 #ifdef LIT_PIPELINE
 
 #ifdef USE_NORMAL_MATRIX
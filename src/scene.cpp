@@ -12,8 +12,15 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <numeric>
 #include <unordered_map>
 
 using namespace std;
@@ -62,15 +69,22 @@ EnvironmentState::EnvironmentState(const shared_ptr<Scene> &s,
       lights(s->envDefaults.lights),
       freeLightIDs(),
       lightIDs(s->envDefaults.lightIDs),
-      lightReverseIDs(s->envDefaults.lightReverseIDs)
+      lightReverseIDs(s->envDefaults.lightReverseIDs),
+      uploadStream(nullptr),
+      uploadSlot(~0u),
+      uploadID(makeUploadID())
 {}
 
+uint64_t EnvironmentState::makeUploadID()
+{
+    // 0 is never handed out, so it can mark empty upload slots
+    static atomic_uint64_t next_id(1);
+
+    return next_id.fetch_add(1, memory_order_relaxed);
+}
+
 template <typename VertexType>
-static StagedScene stageScene(
-        const vector<shared_ptr<Mesh>> &meshes,
-        const vector<uint8_t> &param_bytes,
-        const DeviceState &dev,
-        MemoryAllocator &alloc)
+static StagedScene stageScene(const vector<shared_ptr<Mesh>> &meshes)
 {
     using MeshT = VertexMesh<VertexType>;
 
@@ -85,33 +99,41 @@ static StagedScene stageScene(
 
     VkDeviceSize total_geometry_bytes = total_vertex_bytes + total_index_bytes;
 
-    VkDeviceSize total_bytes = total_geometry_bytes;
-    VkDeviceSize material_offset = 0;
-    if (param_bytes.size() > 0) {
-        material_offset = alloc.alignUniformBufferOffset(total_bytes);
-
-        total_bytes = material_offset + param_bytes.size();
-    }
-
-    HostBuffer staging = alloc.makeStagingBuffer(total_bytes);
+    vector<uint8_t> staging(total_geometry_bytes);
 
     vector<InlineMesh> inline_meshes;
     inline_meshes.reserve(meshes.size());
 
     // Copy all vertices
     uint32_t vertex_offset = 0;
-    uint8_t *staging_start = reinterpret_cast<uint8_t *>(staging.ptr);
-    uint8_t *cur_ptr = staging_start;
+    uint8_t *cur_ptr = staging.data();
 
     for (const auto &generic_mesh : meshes) {
         auto mesh = static_cast<const MeshT *>(generic_mesh.get());
         VkDeviceSize vertex_bytes = sizeof(VertexType) * mesh->vertices.size();
         memcpy(cur_ptr, mesh->vertices.data(), vertex_bytes);
 
+        glm::vec3 aabb_min(FLT_MAX);
+        glm::vec3 aabb_max(-FLT_MAX);
+        for (const VertexType &vertex : mesh->vertices) {
+            aabb_min = glm::min(aabb_min, vertex.position);
+            aabb_max = glm::max(aabb_max, vertex.position);
+        }
+
+        glm::vec3 sphere_center = (aabb_min + aabb_max) / 2.f;
+        float sphere_radius2 = 0.f;
+        for (const VertexType &vertex : mesh->vertices) {
+            glm::vec3 offset = vertex.position - sphere_center;
+            sphere_radius2 = max(sphere_radius2, glm::dot(offset, offset));
+        }
+
         inline_meshes.emplace_back(InlineMesh {
             vertex_offset,
             0,
-            0
+            0,
+            aabb_min,
+            aabb_max,
+            glm::vec4(sphere_center, sqrtf(sphere_radius2))
         });
 
         cur_ptr += vertex_bytes;
@@ -135,20 +157,12 @@ static StagedScene stageScene(
         cur_mesh_index += mesh->indices.size();
     }
 
-    // Optionally copy material params
-    if (param_bytes.size() > 0) {
-        memcpy(staging_start + material_offset, param_bytes.data(),
-               param_bytes.size());
-    }
-
-    staging.flush(dev);
-
     return { 
         move(staging), 
         move(inline_meshes),
-        total_vertex_bytes,
-        material_offset,
-        total_bytes
+        vertex_offset,
+        cur_mesh_index,
+        total_vertex_bytes
     };
 }
 
@@ -225,6 +239,50 @@ static shared_ptr<Mesh> loadMesh(string_view geometry_path)
     }
 }
 
+// Wall time of each stage of a scene load, printed when V4R_LOAD_STATS
+// is set
+class LoadTimer {
+public:
+    LoadTimer(string_view scene_path)
+        : enabled_(getenv("V4R_LOAD_STATS") != nullptr),
+          scene_path_(scene_path),
+          stages_(),
+          stage_start_(Clock::now())
+    {}
+
+    void endStage(const char *name)
+    {
+        if (!enabled_) return;
+
+        Clock::time_point now = Clock::now();
+        stages_.emplace_back(name, now - stage_start_);
+        stage_start_ = now;
+    }
+
+    void report() const
+    {
+        if (!enabled_) return;
+
+        using Millis = chrono::duration<double, milli>;
+
+        Clock::duration total = Clock::duration::zero();
+        cerr << "Loaded " << scene_path_ << ":";
+        for (const auto &[name, duration] : stages_) {
+            cerr << " " << name << " " << Millis(duration).count() << " ms";
+            total += duration;
+        }
+        cerr << ", total " << Millis(total).count() << " ms" << endl;
+    }
+
+private:
+    using Clock = chrono::steady_clock;
+
+    bool enabled_;
+    string scene_path_;
+    vector<pair<const char *, Clock::duration>> stages_;
+    Clock::time_point stage_start_;
+};
+
 // FIXME remove
 static void deleter_hack(void *ptr)
 {
@@ -233,7 +291,9 @@ static void deleter_hack(void *ptr)
 
 template <typename VertexType, typename MaterialParamsType>
 static SceneDescription parseAssimpScene(string_view scene_path,
-                                         const glm::mat4 &coordinate_txfm)
+                                         const glm::mat4 &coordinate_txfm,
+                                         ThreadPool &load_pool,
+                                         LoadTimer &timer)
 {
     Assimp::Importer importer;
     int flags = aiProcess_JoinIdenticalVertices | aiProcess_Triangulate;
@@ -245,13 +305,14 @@ static SceneDescription parseAssimpScene(string_view scene_path,
         fatalExit();
     }
 
+    timer.endStage("read");
+
     constexpr bool need_materials = !is_same_v<MaterialParamsType,
                                                NoMaterial>;
 
     vector<shared_ptr<Material>> materials;
-    vector<shared_ptr<Mesh>> geometry;
+    vector<shared_ptr<Mesh>> geometry(raw_scene->mNumMeshes);
     vector<uint32_t> mesh_materials;
-    geometry.reserve(raw_scene->mNumMeshes);
 
     if constexpr (need_materials) {
         // FIXME remove
@@ -268,42 +329,52 @@ static SceneDescription parseAssimpScene(string_view scene_path,
         default_diffuse->raw_image[3] = 127;
 
         materials = assimpParseMaterials<MaterialParamsType>(
-                raw_scene, default_diffuse);
+                raw_scene, default_diffuse, load_pool);
 
         mesh_materials.reserve(raw_scene->mNumMeshes);
+        for (uint32_t mesh_idx = 0; mesh_idx < raw_scene->mNumMeshes;
+             mesh_idx++) {
+            mesh_materials.push_back(
+                raw_scene->mMeshes[mesh_idx]->mMaterialIndex);
+        }
     }
 
-    for (uint32_t mesh_idx = 0; mesh_idx < raw_scene->mNumMeshes; mesh_idx++) {
-        aiMesh *raw_mesh = raw_scene->mMeshes[mesh_idx];
+    timer.endStage("textures");
 
-        if constexpr (need_materials) {
-            mesh_materials.push_back(raw_mesh->mMaterialIndex);
-        }
+    load_pool.parallelFor(raw_scene->mNumMeshes, [&](uint32_t mesh_idx) {
+        const aiMesh *raw_mesh = raw_scene->mMeshes[mesh_idx];
 
         auto [vertices, indices] = assimpParseMesh<VertexType>(raw_mesh);
-        geometry.emplace_back(makeSharedMesh(move(vertices), move(indices)));
-    }
+        geometry[mesh_idx] = makeSharedMesh(move(vertices), move(indices));
+    });
+
+    timer.endStage("meshes");
 
     SceneDescription scene_desc(move(geometry), move(materials));
 
     assimpParseInstances(scene_desc, raw_scene, mesh_materials,
                          coordinate_txfm);
 
+    timer.endStage("instances");
+
     return scene_desc;
 }
 
 template <typename VertexType, typename MaterialParamsType>
 static SceneDescription parseGLTFScene(string_view scene_path,
-                                       const glm::mat4 &coordinate_txfm)
+                                       const glm::mat4 &coordinate_txfm,
+                                       ThreadPool &load_pool,
+                                       LoadTimer &timer)
 {
     auto raw_scene = gltfLoad(scene_path);
 
+    timer.endStage("read");
+
     constexpr bool need_materials = !is_same_v<MaterialParamsType,
                                                NoMaterial>;
 
     vector<shared_ptr<Material>> materials;
-    vector<shared_ptr<Mesh>> geometry;
-    geometry.reserve(raw_scene.meshes.size());
+    vector<shared_ptr<Mesh>> geometry(raw_scene.meshes.size());
 
     if constexpr (need_materials) {
         // FIXME remove
@@ -320,69 +391,605 @@ static SceneDescription parseGLTFScene(string_view scene_path,
         default_diffuse->raw_image[3] = 127;
 
         materials = gltfParseMaterials<MaterialParamsType>(
-                raw_scene, default_diffuse);
+                raw_scene, default_diffuse, load_pool);
     }
 
-    for (uint32_t mesh_idx = 0; mesh_idx < raw_scene.meshes.size();
-         mesh_idx++) {
+    timer.endStage("textures");
+
+    // Each mesh lands at its own index, so the order doesn't depend on
+    // which thread finishes first
+    load_pool.parallelFor(raw_scene.meshes.size(), [&](uint32_t mesh_idx) {
         auto [vertices, indices] =
             gltfParseMesh<VertexType>(raw_scene, mesh_idx);
-        geometry.emplace_back(makeSharedMesh(move(vertices), move(indices)));
-    }
+        geometry[mesh_idx] = makeSharedMesh(move(vertices), move(indices));
+    });
+
+    timer.endStage("meshes");
 
     SceneDescription scene_desc(move(geometry), move(materials));
 
     gltfParseInstances(scene_desc, raw_scene, coordinate_txfm);
 
+    timer.endStage("instances");
+
     return scene_desc;
 }
 
 template <typename VertexType, typename MaterialParamsType>
 static SceneDescription parseScene(string_view scene_path,
-                                   const glm::mat4 &coordinate_txfm)
+                                   const glm::mat4 &coordinate_txfm,
+                                   ThreadPool &load_pool,
+                                   LoadTimer &timer)
 {
     if (isGLTF(scene_path)) {
         return parseGLTFScene<VertexType, MaterialParamsType>(
-                scene_path, coordinate_txfm);
+                scene_path, coordinate_txfm, load_pool, timer);
     } else {
         return parseAssimpScene<VertexType, MaterialParamsType>(
-                scene_path, coordinate_txfm);
+                scene_path, coordinate_txfm, load_pool, timer);
     }
 }
 
 
+template <typename MaterialParamsType>
+static uint32_t getMaterialParamBytes()
+{
+    if constexpr (is_same_v<MaterialParamsType, NoMaterial>) {
+        return 0;
+    } else {
+        return MaterialImpl<MaterialParamsType>::make(
+            MaterialParamsType {})->paramBytes.size();
+    }
+}
+
 template <typename VertexType, typename MaterialParamsType>
 LoaderImpl LoaderImpl::create()
 {
     return {
         v4r::stageScene<VertexType>,
         v4r::parseScene<VertexType, MaterialParamsType>,
-        v4r::loadMesh<VertexType>
+        v4r::loadMesh<VertexType>,
+        getMaterialParamBytes<MaterialParamsType>()
+    };
+}
+
+RangeAllocator::RangeAllocator(uint32_t num_slots)
+    : free_ranges_({{ 0, num_slots }})
+{}
+
+optional<uint32_t> RangeAllocator::allocate(uint32_t num_slots)
+{
+    // First fit
+    for (auto iter = free_ranges_.begin(); iter != free_ranges_.end();
+         iter++) {
+        auto &[offset, count] = *iter;
+        if (count < num_slots) continue;
+
+        uint32_t base = offset;
+        offset += num_slots;
+        count -= num_slots;
+
+        if (count == 0) {
+            free_ranges_.erase(iter);
+        }
+
+        return base;
+    }
+
+    return optional<uint32_t>();
+}
+
+void RangeAllocator::release(uint32_t base, uint32_t num_slots)
+{
+    auto next = lower_bound(free_ranges_.begin(), free_ranges_.end(),
+                            make_pair(base, 0u));
+    auto cur = free_ranges_.emplace(next, base, num_slots);
+
+    // Merge with the neighbouring free ranges
+    auto after = cur + 1;
+    if (after != free_ranges_.end() &&
+        cur->first + cur->second == after->first) {
+        cur->second += after->second;
+        free_ranges_.erase(after);
+    }
+
+    if (cur != free_ranges_.begin()) {
+        auto before = cur - 1;
+        if (before->first + before->second == cur->first) {
+            before->second += cur->second;
+            free_ranges_.erase(cur);
+        }
+    }
+}
+
+MaterialTable::MaterialTable(const DeviceState &d,
+                             MemoryAllocator &alloc,
+                             VkDescriptorSetLayout layout,
+                             DescriptorManager::MakePoolType make_pool,
+                             uint32_t param_binding,
+                             uint32_t param_bytes_per_material)
+    : dev(d),
+      pool_(VK_NULL_HANDLE),
+      set_(VK_NULL_HANDLE),
+      param_buffer_(),
+      param_bytes_(param_bytes_per_material),
+      lock_(),
+      slots_(VulkanConfig::max_materials)
+{
+    if (layout == VK_NULL_HANDLE) return;
+
+    pool_ = make_pool(dev, 1);
+    set_ = makeDescriptorSet(dev, pool_, layout);
+
+    if (param_bytes_ == 0) return;
+
+    param_buffer_.emplace(alloc.makeLocalBuffer(
+            VkDeviceSize(param_bytes_) * VulkanConfig::max_materials));
+
+    VkDescriptorBufferInfo param_info;
+    param_info.buffer = param_buffer_->buffer;
+    param_info.offset = 0;
+    param_info.range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet desc_update;
+    desc_update.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    desc_update.pNext = nullptr;
+    desc_update.dstSet = set_;
+    desc_update.dstBinding = param_binding;
+    desc_update.dstArrayElement = 0;
+    desc_update.descriptorCount = 1;
+    desc_update.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    desc_update.pImageInfo = nullptr;
+    desc_update.pBufferInfo = &param_info;
+    desc_update.pTexelBufferView = nullptr;
+
+    dev.dt.updateDescriptorSets(dev.hdl, 1, &desc_update, 0, nullptr);
+}
+
+MaterialTable::~MaterialTable()
+{
+    if (pool_ == VK_NULL_HANDLE) return;
+
+    dev.dt.destroyDescriptorPool(dev.hdl, pool_, nullptr);
+}
+
+uint32_t MaterialTable::allocate(uint32_t num_materials)
+{
+    if (num_materials == 0) return 0;
+
+    scoped_lock lock(lock_);
+
+    optional<uint32_t> base = slots_.allocate(num_materials);
+    if (!base) {
+        cerr << "Loaded scenes exceed " << VulkanConfig::max_materials <<
+            " materials" << endl;
+        fatalExit();
+    }
+
+    return *base;
+}
+
+void MaterialTable::release(uint32_t base, uint32_t num_materials)
+{
+    if (num_materials == 0) return;
+
+    scoped_lock lock(lock_);
+    slots_.release(base, num_materials);
+}
+
+void MaterialTable::writeDescriptors(
+        const vector<VkWriteDescriptorSet> &writes)
+{
+    scoped_lock lock(lock_);
+
+    dev.dt.updateDescriptorSets(dev.hdl, writes.size(), writes.data(),
+                                0, nullptr);
+}
+
+MaterialRange::MaterialRange(MaterialTable &t, uint32_t num_materials)
+    : table(&t),
+      base(t.allocate(num_materials)),
+      count(num_materials)
+{}
+
+MaterialRange::MaterialRange(MaterialRange &&o)
+    : table(o.table),
+      base(o.base),
+      count(o.count)
+{
+    o.table = nullptr;
+}
+
+MaterialRange::~MaterialRange()
+{
+    if (table == nullptr) return;
+    table->release(base, count);
+}
+
+GeometryHeap::GeometryHeap(MemoryAllocator &alloc,
+                           uint32_t vertex_stride,
+                           VkDeviceSize block_bytes)
+    : alloc_(alloc),
+      vertex_stride_(vertex_stride),
+      // Smallest size holding a whole number of both
+      granule_bytes_(lcm(vertex_stride, uint32_t(sizeof(uint32_t)))),
+      block_granules_(static_cast<uint32_t>(block_bytes / granule_bytes_)),
+      lock_(),
+      blocks_()
+{}
+
+GeometryHeap::Allocation GeometryHeap::allocate(uint32_t num_granules)
+{
+    if (num_granules == 0) {
+        return { 0, 0, VK_NULL_HANDLE };
+    }
+
+    scoped_lock lock(lock_);
+
+    for (uint32_t block_idx = 0; block_idx < blocks_.size(); block_idx++) {
+        Block &block = blocks_[block_idx];
+
+        optional<uint32_t> base = block.granules.allocate(num_granules);
+        if (base) {
+            return { block_idx, *base, block.buffer.buffer };
+        }
+    }
+
+    // Scenes larger than a block get a block of their own
+    uint32_t new_granules = max(block_granules_, num_granules);
+    blocks_.push_back(Block {
+        alloc_.makeGeometryBuffer(VkDeviceSize(new_granules) *
+                                  granule_bytes_),
+        RangeAllocator(new_granules)
+    });
+
+    Block &block = blocks_.back();
+    uint32_t base = *block.granules.allocate(num_granules);
+
+    return {
+        static_cast<uint32_t>(blocks_.size() - 1),
+        base,
+        block.buffer.buffer
+    };
+}
+
+void GeometryHeap::release(uint32_t block, uint32_t base,
+                           uint32_t num_granules)
+{
+    if (num_granules == 0) return;
+
+    scoped_lock lock(lock_);
+    blocks_[block].granules.release(base, num_granules);
+}
+
+static uint32_t divideRoundUp(VkDeviceSize a, uint32_t b)
+{
+    return static_cast<uint32_t>((a + b - 1) / b);
+}
+
+GeometryRange::GeometryRange(GeometryHeap &h, uint32_t num_vertices,
+                             uint32_t num_indices)
+    : heap(&h)
+{
+    const uint32_t granule_bytes = h.getGranuleBytes();
+    const uint32_t vertex_stride = h.getVertexStride();
+
+    // Indices start on a granule so their offset is exact
+    uint32_t vertex_granules = divideRoundUp(
+        VkDeviceSize(num_vertices) * vertex_stride, granule_bytes);
+    uint32_t index_granules = divideRoundUp(
+        VkDeviceSize(num_indices) * sizeof(uint32_t), granule_bytes);
+
+    numGranules = vertex_granules + index_granules;
+
+    GeometryHeap::Allocation allocation = h.allocate(numGranules);
+    block = allocation.block;
+    baseGranule = allocation.baseGranule;
+    buffer = allocation.buffer;
+
+    byteOffset = VkDeviceSize(baseGranule) * granule_bytes;
+    indexByteOffset =
+        byteOffset + VkDeviceSize(vertex_granules) * granule_bytes;
+    numBytes = VkDeviceSize(numGranules) * granule_bytes;
+
+    vertexBase = byteOffset / vertex_stride;
+    indexBase = indexByteOffset / sizeof(uint32_t);
+}
+
+GeometryRange::GeometryRange(GeometryRange &&o)
+    : heap(o.heap),
+      block(o.block),
+      baseGranule(o.baseGranule),
+      numGranules(o.numGranules),
+      buffer(o.buffer),
+      vertexBase(o.vertexBase),
+      indexBase(o.indexBase),
+      byteOffset(o.byteOffset),
+      indexByteOffset(o.indexByteOffset),
+      numBytes(o.numBytes)
+{
+    o.heap = nullptr;
+}
+
+GeometryRange::~GeometryRange()
+{
+    if (heap == nullptr) return;
+    heap->release(block, baseGranule, numGranules);
+}
+
+UploadCompletion::UploadCompletion(const DeviceState &d, VkSemaphore sema,
+                                   uint64_t v)
+    : dev(&d),
+      semaphore(sema),
+      value(v)
+{}
+
+UploadCompletion::UploadCompletion(UploadCompletion &&o)
+    : dev(o.dev),
+      semaphore(o.semaphore),
+      value(o.value)
+{
+    o.dev = nullptr;
+}
+
+UploadCompletion::~UploadCompletion()
+{
+    if (dev == nullptr) return;
+
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &semaphore;
+    wait_info.pValues = &value;
+
+    REQ_VK(dev->dt.waitSemaphores(dev->hdl, &wait_info, UINT64_MAX));
+}
+
+StagingArena::StagingArena(const DeviceState &d,
+                           MemoryAllocator &alloc,
+                           const QueueState &queue,
+                           VkCommandPool pool,
+                           VkDeviceSize max_bytes)
+    : dev(d),
+      alloc_(alloc),
+      queue_(queue),
+      max_bytes_(max_bytes),
+      buffer_(),
+      half_bytes_(0),
+      halves_ {{
+          { makeCmdBuffer(dev, pool), makeFence(dev), false },
+          { makeCmdBuffer(dev, pool), makeFence(dev), false }
+      }},
+      cur_half_(0),
+      cur_offset_(0),
+      load_bytes_(0)
+{
+    resize(max_bytes_ / 8);
+}
+
+// Halves start at multiples of this, which suits any copy's buffer offset
+static constexpr VkDeviceSize staging_half_alignment = 256;
+
+void StagingArena::resize(VkDeviceSize num_bytes)
+{
+    half_bytes_ = num_bytes / 2 / staging_half_alignment *
+        staging_half_alignment;
+    if (half_bytes_ == 0) {
+        cerr << "Loader staging memory too small" << endl;
+        fatalExit();
+    }
+
+    buffer_.emplace(alloc_.makeStagingBuffer(half_bytes_ * 2));
+}
+
+void StagingArena::begin()
+{
+    // The previous load's semaphore was waited on, so its halves are done
+    for (Half &half : halves_) {
+        waitHalf(half);
+    }
+
+    VkDeviceSize capacity = half_bytes_ * 2;
+    if (load_bytes_ > capacity && capacity < max_bytes_) {
+        VkDeviceSize new_capacity = capacity;
+        while (new_capacity < load_bytes_) {
+            new_capacity *= 2;
+        }
+
+        resize(min(new_capacity, max_bytes_));
+    }
+
+    cur_half_ = 0;
+    cur_offset_ = 0;
+    load_bytes_ = 0;
+
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    REQ_VK(dev.dt.beginCommandBuffer(halves_[cur_half_].cmd, &begin_info));
+}
+
+void StagingArena::uploadBuffer(const void *src, VkDeviceSize num_bytes,
+                                VkBuffer dst, VkDeviceSize dst_offset)
+{
+    const uint8_t *src_ptr = static_cast<const uint8_t *>(src);
+    uint8_t *staging_ptr = static_cast<uint8_t *>(buffer_->ptr);
+
+    while (num_bytes > 0) {
+        auto [offset, num_free] = reserve(1, sizeof(uint32_t));
+        VkDeviceSize num_copy_bytes = min(num_bytes, num_free);
+
+        memcpy(staging_ptr + offset, src_ptr, num_copy_bytes);
+
+        VkBufferCopy copy {
+            offset,
+            dst_offset,
+            num_copy_bytes
+        };
+
+        dev.dt.cmdCopyBuffer(getCommands(), buffer_->buffer, dst,
+                             1, &copy);
+
+        cur_offset_ += num_copy_bytes;
+        load_bytes_ += num_copy_bytes;
+        src_ptr += num_copy_bytes;
+        dst_offset += num_copy_bytes;
+        num_bytes -= num_copy_bytes;
+    }
+}
+
+void StagingArena::uploadImage(const void *src, uint32_t width,
+                               uint32_t height, uint32_t texel_bytes,
+                               VkImage dst)
+{
+    const uint8_t *src_ptr = static_cast<const uint8_t *>(src);
+    uint8_t *staging_ptr = static_cast<uint8_t *>(buffer_->ptr);
+
+    VkDeviceSize row_bytes = VkDeviceSize(width) * texel_bytes;
+    if (row_bytes > half_bytes_) {
+        cerr << "Texture rows exceed loader staging memory" << endl;
+        fatalExit();
+    }
+
+    // Copies are split on whole rows
+    uint32_t cur_row = 0;
+    while (cur_row < height) {
+        auto [offset, num_free] =
+            reserve(row_bytes, lcm(texel_bytes, uint32_t(4)));
+        uint32_t num_rows = static_cast<uint32_t>(
+            min<VkDeviceSize>(height - cur_row, num_free / row_bytes));
+        VkDeviceSize num_copy_bytes = num_rows * row_bytes;
+
+        memcpy(staging_ptr + offset, src_ptr + cur_row * row_bytes,
+               num_copy_bytes);
+
+        VkBufferImageCopy copy_spec {};
+        copy_spec.bufferOffset = offset;
+        copy_spec.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        copy_spec.imageSubresource.mipLevel = 0;
+        copy_spec.imageSubresource.baseArrayLayer = 0;
+        copy_spec.imageSubresource.layerCount = 1;
+        copy_spec.imageOffset = { 0, static_cast<int32_t>(cur_row), 0 };
+        copy_spec.imageExtent = { width, num_rows, 1 };
+
+        dev.dt.cmdCopyBufferToImage(getCommands(), buffer_->buffer, dst,
+                                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                    1, &copy_spec);
+
+        cur_offset_ += num_copy_bytes;
+        load_bytes_ += num_copy_bytes;
+        cur_row += num_rows;
+    }
+}
+
+void StagingArena::submit(VkSemaphore semaphore)
+{
+    submitHalf(semaphore);
+}
+
+pair<VkDeviceSize, VkDeviceSize> StagingArena::reserve(
+        VkDeviceSize min_bytes, VkDeviceSize alignment)
+{
+    cur_offset_ = (cur_offset_ + alignment - 1) / alignment * alignment;
+
+    if (cur_offset_ + min_bytes > half_bytes_) {
+        submitHalf(VK_NULL_HANDLE);
+
+        cur_half_ ^= 1;
+        cur_offset_ = 0;
+
+        // Still copying out of this half from earlier in the load
+        waitHalf(halves_[cur_half_]);
+
+        VkCommandBufferBeginInfo begin_info {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        REQ_VK(dev.dt.beginCommandBuffer(halves_[cur_half_].cmd,
+                                         &begin_info));
+    }
+
+    return {
+        cur_half_ * half_bytes_ + cur_offset_,
+        half_bytes_ - cur_offset_
     };
 }
 
+void StagingArena::submitHalf(VkSemaphore semaphore)
+{
+    Half &half = halves_[cur_half_];
+
+    if (cur_offset_ > 0) {
+        buffer_->flush(dev, cur_half_ * half_bytes_, cur_offset_);
+    }
+
+    REQ_VK(dev.dt.endCommandBuffer(half.cmd));
+
+    VkSubmitInfo submit {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &half.cmd;
+    if (semaphore != VK_NULL_HANDLE) {
+        submit.signalSemaphoreCount = 1;
+        submit.pSignalSemaphores = &semaphore;
+    }
+
+    queue_.submit(dev, 1, &submit, half.fence);
+    half.pending = true;
+}
+
+void StagingArena::waitHalf(Half &half)
+{
+    if (!half.pending) return;
+
+    waitForFenceInfinitely(dev, half.fence);
+    resetFence(dev, half.fence);
+    half.pending = false;
+}
+
 LoaderState::LoaderState(const DeviceState &d,
                          const LoaderImpl &impl,
-                         const VkDescriptorSetLayout &scene_set_layout,
-                         DescriptorManager::MakePoolType make_scene_pool,
+                         MaterialTable &material_table,
+                         GeometryHeap &geometry_heap,
+                         ThreadPool &load_pool,
                          MemoryAllocator &alc,
                          QueueManager &queue_manager,
-                         const glm::mat4 &coordinate_transform)
+                         const glm::mat4 &coordinate_transform,
+                         VkDeviceSize staging_bytes)
     : dev(d),
       gfxPool(makeCmdPool(dev, dev.gfxQF)),
       gfxQueue(queue_manager.allocateGraphicsQueue()),
       gfxCopyCommand(makeCmdBuffer(dev, gfxPool)),
       transferPool(makeCmdPool(dev, dev.transferQF)),
       transferQueue(queue_manager.allocateTransferQueue()),
-      transferStageCommand(makeCmdBuffer(dev, transferPool)),
+      stagingArena(dev, alc, transferQueue, transferPool, staging_bytes),
       semaphore(makeBinarySemaphore(dev)),
-      fence(makeFence(dev)),
+      timeline(makeTimelineSemaphore(dev)),
       alloc(alc),
-      descriptorManager(dev, scene_set_layout, make_scene_pool),
+      materialTable(material_table),
+      geometryHeap(geometry_heap),
+      loadPool(load_pool),
       coordinateTransform(coordinate_transform),
-      impl_(impl)
+      impl_(impl),
+      upload_lock_(),
+      num_uploads_(0),
+      async_lock_(),
+      async_cv_(),
+      async_loads_(),
+      async_exit_(false),
+      async_worker_()
 {}
 
+LoaderState::~LoaderState()
+{
+    {
+        lock_guard<mutex> guard(async_lock_);
+        async_exit_ = true;
+    }
+    async_cv_.notify_one();
+
+    if (async_worker_.joinable()) {
+        async_worker_.join();
+    }
+}
+
 static uint32_t getMipLevels(const Texture &texture)
 {
     return static_cast<uint32_t>(
@@ -460,10 +1067,63 @@ static void generateMips(const DeviceState &dev,
 
 shared_ptr<Scene> LoaderState::loadScene(string_view scene_path)
 {
+    LoadTimer timer(scene_path);
+
     SceneDescription desc = impl_.parseScene(scene_path,
-                                             coordinateTransform);
+                                             coordinateTransform,
+                                             loadPool, timer);
+
+    shared_ptr<Scene> scene = makeScene(desc);
 
-    return makeScene(desc);
+    // Only covers staging and submitting the copies on the CPU, the GPU
+    // finishes them asynchronously
+    timer.endStage("staging");
+    timer.report();
+
+    return scene;
+}
+
+future<shared_ptr<Scene>> LoaderState::loadSceneAsync(string_view scene_path)
+{
+    promise<shared_ptr<Scene>> scene_promise;
+    future<shared_ptr<Scene>> scene_future = scene_promise.get_future();
+
+    {
+        lock_guard<mutex> guard(async_lock_);
+        async_loads_.emplace_back(string(scene_path), move(scene_promise));
+
+        if (!async_worker_.joinable()) {
+            async_worker_ = thread([this]() { asyncLoop(); });
+        }
+    }
+    async_cv_.notify_one();
+
+    return scene_future;
+}
+
+void LoaderState::asyncLoop()
+{
+    while (true) {
+        string scene_path;
+        promise<shared_ptr<Scene>> scene_promise;
+        {
+            unique_lock<mutex> guard(async_lock_);
+            async_cv_.wait(guard, [this]() {
+                return async_exit_ || !async_loads_.empty();
+            });
+
+            // Queued loads still finish when the loader is destroyed
+            if (async_loads_.empty()) {
+                return;
+            }
+
+            scene_path = move(async_loads_.front().first);
+            scene_promise = move(async_loads_.front().second);
+            async_loads_.pop_front();
+        }
+
+        scene_promise.set_value(loadScene(scene_path));
+    }
 }
 
 struct MaterialsInfo {
@@ -509,12 +1169,30 @@ static MaterialsInfo finalizeMaterials(
     return { textures, packed_params, texture_tracker, param_offsets };
 }
 
+static void printMemoryStats(const MemoryStats &stats)
+{
+    constexpr double mib = 1024 * 1024;
+
+    for (const MemoryPoolStats &pool : stats.pools) {
+        cerr << "Memory pool " << pool.name << ": " <<
+            pool.numAllocations << " allocations in " <<
+            pool.numBlocks << " blocks, " <<
+            pool.requestedBytes / mib << " / " <<
+            pool.allocatedBytes / mib << " / " <<
+            pool.reservedBytes / mib << " MiB requested / allocated / " <<
+            "reserved, largest free " << pool.largestFreeRange / mib <<
+            " MiB" << endl;
+    }
+
+    cerr << "Dedicated memory: " << stats.numDedicated <<
+        " allocations, " << stats.dedicatedBytes / mib << " MiB" << endl;
+}
+
 shared_ptr<Scene> LoaderState::makeScene(
         const SceneDescription &scene_desc)
 {
     const auto &materials = scene_desc.getMaterials();
 
-    vector<HostBuffer> texture_stagings;
     vector<LocalImage> gpu_textures;
 
     auto [cpu_textures, material_params, texture_indices, material_offsets] =
@@ -522,38 +1200,28 @@ shared_ptr<Scene> LoaderState::makeScene(
 
     // FIXME pack textures
     for (const shared_ptr<Texture> &texture : cpu_textures) {
-        uint64_t texture_bytes = texture->width * texture->height *
-            texture->num_channels * sizeof(uint8_t);
-
-        HostBuffer texture_staging = alloc.makeStagingBuffer(texture_bytes);
-        memcpy(texture_staging.ptr, texture->raw_image.data(), texture_bytes);
-        texture_staging.flush(dev);
-
-        texture_stagings.emplace_back(move(texture_staging));
-
         uint32_t mip_levels = getMipLevels(*texture);
         gpu_textures.emplace_back(alloc.makeTexture(texture->width,
                                                     texture->height,
                                                     mip_levels));
     }
 
-    // Copy all geometry into single buffer
     const auto &cpu_meshes = scene_desc.getMeshes();
     
-    auto staged = impl_.stageScene(cpu_meshes, material_params, dev, alloc);
+    auto staged = impl_.stageScene(cpu_meshes);
 
-    LocalBuffer data = alloc.makeLocalBuffer(staged.totalBytes);
+    GeometryRange geometry(geometryHeap, staged.numVertices,
+                           staged.numIndices);
+    VkBuffer geometry_buffer = geometry.buffer;
 
-    // Start recording for transfer queue
-    VkCommandBufferBeginInfo begin_info {};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    REQ_VK(dev.dt.beginCommandBuffer(transferStageCommand, &begin_info));
+    MaterialRange material_range(materialTable,
+        materialTable.getSet() != VK_NULL_HANDLE ? materials.size() : 0);
 
-    // Copy vertex/index buffer onto GPU
-    VkBufferCopy copy_settings {};
-    copy_settings.size = staged.totalBytes;
-    dev.dt.cmdCopyBuffer(transferStageCommand, staged.buffer.buffer,
-                         data.buffer, 1, &copy_settings);
+    // Loads through this loader share its command buffers
+    lock_guard<mutex> upload_lock(upload_lock_);
+
+    // Start recording for transfer queue
+    stagingArena.begin();
 
     // Set initial texture layouts
     DynArray<VkImageMemoryBarrier> barriers(gpu_textures.size());
@@ -577,42 +1245,28 @@ shared_ptr<Scene> LoaderState::makeScene(
     }
 
     if (gpu_textures.size() > 0) {
-        dev.dt.cmdPipelineBarrier(transferStageCommand,
+        dev.dt.cmdPipelineBarrier(stagingArena.getCommands(),
                                   VK_PIPELINE_STAGE_TRANSFER_BIT,
                                   VK_PIPELINE_STAGE_TRANSFER_BIT,
                                   0, 0, nullptr, 0, nullptr,
                                   barriers.size(), barriers.data());
-
-        for (size_t i = 0; i < gpu_textures.size(); i++) {
-            const HostBuffer &stage_buffer = texture_stagings[i];
-            const LocalImage &gpu_texture = gpu_textures[i];
-            VkBufferImageCopy copy_spec {};
-            copy_spec.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            copy_spec.imageSubresource.mipLevel = 0;
-            copy_spec.imageSubresource.baseArrayLayer = 0;
-            copy_spec.imageSubresource.layerCount = 1;
-            copy_spec.imageExtent =
-                { gpu_texture.width, gpu_texture.height, 1 };
-
-            dev.dt.cmdCopyBufferToImage(transferStageCommand,
-                                        stage_buffer.buffer,
-                                        gpu_texture.image,
-                                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                        1, &copy_spec);
-        }
-
-        // Transfer queue relinquish mip level 0
-        for (VkImageMemoryBarrier &barrier : barriers) {
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = 0;
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;;
-            barrier.srcQueueFamilyIndex = dev.transferQF;
-            barrier.dstQueueFamilyIndex = dev.gfxQF;
-        }
     }
 
-    // Transfer queue relinquish geometry (also barrier on geometry write)
+    // Copy vertex/index buffer onto GPU
+    stagingArena.uploadBuffer(staged.geometry.data(),
+                              staged.indexBufferOffset,
+                              geometry_buffer, geometry.byteOffset);
+    stagingArena.uploadBuffer(
+        staged.geometry.data() + staged.indexBufferOffset,
+        VkDeviceSize(staged.numIndices) * sizeof(uint32_t),
+        geometry_buffer, geometry.indexByteOffset);
+
+    // Transfer queue relinquish geometry (also barrier on geometry write).
+    // Only this scene's range changes hands, the rest of the block stays
+    // in use by the graphics queue. Material params are handed over the
+    // same way.
+    vector<VkBufferMemoryBarrier> buffer_barriers;
+
     VkBufferMemoryBarrier geometry_barrier;
     geometry_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
     geometry_barrier.pNext = nullptr;
@@ -620,43 +1274,96 @@ shared_ptr<Scene> LoaderState::makeScene(
     geometry_barrier.dstAccessMask = 0;
     geometry_barrier.srcQueueFamilyIndex = dev.transferQF;
     geometry_barrier.dstQueueFamilyIndex = dev.gfxQF;
-    geometry_barrier.buffer = data.buffer;
-    geometry_barrier.offset = 0;
-    geometry_barrier.size = staged.totalBytes;
+    geometry_barrier.buffer = geometry_buffer;
+    geometry_barrier.offset = geometry.byteOffset;
+    geometry_barrier.size = geometry.numBytes;
+    buffer_barriers.push_back(geometry_barrier);
+
+    if (material_range.count > 0 && material_params.size() > 0) {
+        VkDeviceSize param_stride = materialTable.getParamBytesPerMaterial();
+        assert(material_params.size() == param_stride * materials.size());
+
+        VkDeviceSize param_offset = param_stride * material_range.base;
+        stagingArena.uploadBuffer(material_params.data(),
+                                  material_params.size(),
+                                  materialTable.getParamBuffer(),
+                                  param_offset);
+
+        VkBufferMemoryBarrier param_barrier = geometry_barrier;
+        param_barrier.buffer = materialTable.getParamBuffer();
+        param_barrier.offset = param_offset;
+        param_barrier.size = material_params.size();
+        buffer_barriers.push_back(param_barrier);
+    }
+
+    for (size_t i = 0; i < gpu_textures.size(); i++) {
+        const Texture &texture = *cpu_textures[i];
+
+        stagingArena.uploadImage(texture.raw_image.data(),
+                                 texture.width, texture.height,
+                                 texture.num_channels * sizeof(uint8_t),
+                                 gpu_textures[i].image);
+    }
 
-    // Geometry & texture barrier execute.
-    dev.dt.cmdPipelineBarrier(transferStageCommand,
+    // Transfer queue relinquish mip level 0
+    for (VkImageMemoryBarrier &barrier : barriers) {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;;
+        barrier.srcQueueFamilyIndex = dev.transferQF;
+        barrier.dstQueueFamilyIndex = dev.gfxQF;
+    }
+
+    // Geometry, param & texture barrier execute.
+    dev.dt.cmdPipelineBarrier(stagingArena.getCommands(),
                               VK_PIPELINE_STAGE_TRANSFER_BIT,
                               VK_PIPELINE_STAGE_TRANSFER_BIT,
                               0, 0, nullptr,
-                              1, &geometry_barrier,
+                              buffer_barriers.size(), buffer_barriers.data(),
                               barriers.size(), barriers.data());
 
-    REQ_VK(dev.dt.endCommandBuffer(transferStageCommand));
+    stagingArena.submit(semaphore);
 
-    VkSubmitInfo copy_submit{};
-    copy_submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    copy_submit.commandBufferCount = 1;
-    copy_submit.pCommandBuffers = &transferStageCommand;
-    copy_submit.signalSemaphoreCount = 1;
-    copy_submit.pSignalSemaphores = &semaphore;
+    // The previous load's graphics commands may still be running
+    if (num_uploads_ > 0) {
+        VkSemaphoreWaitInfo wait_info {};
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &timeline;
+        wait_info.pValues = &num_uploads_;
 
-    transferQueue.submit(dev, 1, &copy_submit, VK_NULL_HANDLE);
+        REQ_VK(dev.dt.waitSemaphores(dev.hdl, &wait_info, UINT64_MAX));
+    }
 
     // Start recording for graphics queue
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     REQ_VK(dev.dt.beginCommandBuffer(gfxCopyCommand, &begin_info));
 
-    // Finish moving geometry onto graphics queue family
-    geometry_barrier.srcAccessMask = 0;
-    geometry_barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
-                                     VK_ACCESS_INDEX_READ_BIT;
+    // Finish moving geometry and params onto graphics queue family
+    buffer_barriers[0].srcAccessMask = 0;
+    buffer_barriers[0].dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                       VK_ACCESS_INDEX_READ_BIT;
     dev.dt.cmdPipelineBarrier(gfxCopyCommand,
                               VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
                               VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
                               0, 0, nullptr,
-                              1, &geometry_barrier,
+                              1, &buffer_barriers[0],
                               0, nullptr);
 
+    if (buffer_barriers.size() > 1) {
+        buffer_barriers[1].srcAccessMask = 0;
+        buffer_barriers[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        dev.dt.cmdPipelineBarrier(gfxCopyCommand,
+                                  VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                  VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                  0, 0, nullptr,
+                                  1, &buffer_barriers[1],
+                                  0, nullptr);
+    }
+
     if (gpu_textures.size() > 0)  {
         // Finish acquiring mip level 0 on graphics queue and transition layout
         for (VkImageMemoryBarrier &barrier : barriers) {
@@ -700,8 +1407,16 @@ shared_ptr<Scene> LoaderState::makeScene(
 
     REQ_VK(dev.dt.endCommandBuffer(gfxCopyCommand));
 
+    uint64_t ready_value = ++num_uploads_;
+
+    VkTimelineSemaphoreSubmitInfo timeline_info {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &ready_value;
+
     VkSubmitInfo gfx_submit{};
     gfx_submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    gfx_submit.pNext = &timeline_info;
     gfx_submit.waitSemaphoreCount = 1;
     gfx_submit.pWaitSemaphores = &semaphore;
     VkPipelineStageFlags sema_wait_mask = 
@@ -709,11 +1424,12 @@ shared_ptr<Scene> LoaderState::makeScene(
     gfx_submit.pWaitDstStageMask = &sema_wait_mask;
     gfx_submit.commandBufferCount = 1;
     gfx_submit.pCommandBuffers = &gfxCopyCommand;
+    gfx_submit.signalSemaphoreCount = 1;
+    gfx_submit.pSignalSemaphores = &timeline;
 
-    gfxQueue.submit(dev, 1, &gfx_submit, fence);
-
-    waitForFenceInfinitely(dev, fence);
-    resetFence(dev, fence);
+    // Not waited on, streams wait for the scene's ready value before
+    // rendering it, and the scene waits for it before being freed
+    gfxQueue.submit(dev, 1, &gfx_submit, VK_NULL_HANDLE);
 
     vector<VkImageView> texture_views;
     texture_views.reserve(gpu_textures.size());
@@ -741,21 +1457,16 @@ shared_ptr<Scene> LoaderState::makeScene(
         texture_views.push_back(view);
     }
 
-    assert(materials.size() <= VulkanConfig::max_materials);
-
-    DescriptorSet material_set = descriptorManager.makeSet();
-
-    // FIXME null descriptorManager feels a bit indirect
-    if (material_set.hdl != VK_NULL_HANDLE && materials.size() > 0) {
+    if (material_range.count > 0) {
         // If there are textures the layout is
         // 0: sampler
         // 1 .. # textures: texture arrays
-        // Final: material params
+        // Final: material params, written once by MaterialTable
         vector<VkDescriptorImageInfo> descriptor_views;
         const size_t textures_per_material = materials[0]->textures.size();
         descriptor_views.reserve(materials.size() * textures_per_material);
         vector<VkWriteDescriptorSet> desc_updates;
-        desc_updates.reserve(textures_per_material + 1);
+        desc_updates.reserve(textures_per_material);
 
         for (size_t material_texture_idx = 0;
              material_texture_idx < textures_per_material;
@@ -774,9 +1485,9 @@ shared_ptr<Scene> LoaderState::makeScene(
             VkWriteDescriptorSet desc_update;
             desc_update.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
             desc_update.pNext = nullptr;
-            desc_update.dstSet = material_set.hdl;
+            desc_update.dstSet = materialTable.getSet();
             desc_update.dstBinding = 1 + material_texture_idx;
-            desc_update.dstArrayElement = 0;
+            desc_update.dstArrayElement = material_range.base;
             desc_update.descriptorCount = materials.size();
             desc_update.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
             desc_update.pImageInfo = descriptor_views.data() +
@@ -787,46 +1498,41 @@ shared_ptr<Scene> LoaderState::makeScene(
             desc_updates.push_back(desc_update);
         }
 
-        if (material_params.size() > 0) {
-            uint32_t param_binding = 0;
-            if (textures_per_material > 0) {
-                param_binding = 1 + textures_per_material;
-            }
-
-            VkDescriptorBufferInfo material_buffer_info;
-            material_buffer_info.buffer = data.buffer;
-            material_buffer_info.offset = staged.paramBufferOffset;
-            material_buffer_info.range = material_params.size();
+        if (desc_updates.size() > 0) {
+            materialTable.writeDescriptors(desc_updates);
+        }
+    }
 
-            VkWriteDescriptorSet desc_update;
-            desc_update.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            desc_update.pNext = nullptr;
-            desc_update.dstSet = material_set.hdl;
-            desc_update.dstBinding = param_binding;
-            desc_update.dstArrayElement = 0;
-            desc_update.descriptorCount = 1;
-            desc_update.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            desc_update.pImageInfo = nullptr;
-            desc_update.pBufferInfo = &material_buffer_info;
-            desc_update.pTexelBufferView = nullptr;
+    EnvironmentInit env_defaults(scene_desc.getDefaultInstances(),
+                                 scene_desc.getDefaultLights(),
+                                 cpu_meshes.size());
 
-            desc_updates.push_back(desc_update);
+    // Instances index the whole table
+    for (vector<uint32_t> &mesh_materials : env_defaults.materials) {
+        for (uint32_t &material_idx : mesh_materials) {
+            material_idx += material_range.base;
         }
+    }
+
+    // Meshes index the whole block
+    for (InlineMesh &mesh : staged.meshPositions) {
+        mesh.vertexOffset += geometry.vertexBase;
+        mesh.startIndex += geometry.indexBase;
+    }
 
-        dev.dt.updateDescriptorSets(dev.hdl, desc_updates.size(),
-                                    desc_updates.data(), 0, nullptr);
+    // The staging arena persists across loads and is counted here too
+    if (getenv("V4R_MEMORY_STATS")) {
+        printMemoryStats(alloc.getStats());
     }
 
     return make_shared<Scene>(Scene {
         move(gpu_textures),
         move(texture_views),
-        move(material_set),
-        move(data),
-        staged.indexBufferOffset,
+        move(material_range),
+        move(geometry),
         move(staged.meshPositions),
-        EnvironmentInit(scene_desc.getDefaultInstances(),
-                        scene_desc.getDefaultLights(),
-                        cpu_meshes.size())
+        move(env_defaults),
+        UploadCompletion(dev, timeline, ready_value)
     });
 }
 
@@ -4,12 +4,21 @@
 #include <v4r/config.hpp>
 #include <v4r/assets.hpp>
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <list>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 
 #include "descriptors.hpp"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 #include "vulkan_handles.hpp"
 #include "vulkan_memory.hpp"
@@ -40,6 +49,11 @@ struct InlineMesh {
     uint32_t vertexOffset;
     uint32_t startIndex;
     uint32_t numIndices;
+
+    // Object space bounds, used for culling
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+    glm::vec4 boundingSphere; // center in xyz, radius in w
 };
 
 struct Texture {
@@ -100,14 +114,162 @@ struct EnvironmentInit {
     std::vector<uint32_t> lightReverseIDs;
 };
 
+// First fit allocator of contiguous ranges out of num_slots slots.
+// Not thread safe.
+class RangeAllocator {
+public:
+    RangeAllocator(uint32_t num_slots);
+
+    // Empty when no free range is large enough
+    std::optional<uint32_t> allocate(uint32_t num_slots);
+    void release(uint32_t base, uint32_t num_slots);
+
+private:
+    // Sorted by offset, (offset, count)
+    std::vector<std::pair<uint32_t, uint32_t>> free_ranges_;
+};
+
+// Every loaded scene's textures and material params in one bindless
+// descriptor set, so batches mixing scenes bind materials once. Each scene
+// owns a contiguous range of the table's slots, and instances refer to
+// their material by its index in the whole table.
+class MaterialTable {
+public:
+    MaterialTable(const DeviceState &dev,
+                  MemoryAllocator &alloc,
+                  VkDescriptorSetLayout layout,
+                  DescriptorManager::MakePoolType make_pool,
+                  uint32_t param_binding,
+                  uint32_t param_bytes_per_material);
+    MaterialTable(const MaterialTable &) = delete;
+    ~MaterialTable();
+
+    // VK_NULL_HANDLE if the pipeline doesn't use materials
+    VkDescriptorSet getSet() const { return set_; }
+
+    VkBuffer getParamBuffer() const { return param_buffer_->buffer; }
+    uint32_t getParamBytesPerMaterial() const { return param_bytes_; }
+
+    uint32_t allocate(uint32_t num_materials);
+    void release(uint32_t base, uint32_t num_materials);
+
+    // Updates can race with streams rendering other slots, but not with
+    // each other
+    void writeDescriptors(const std::vector<VkWriteDescriptorSet> &writes);
+
+private:
+    const DeviceState &dev;
+    VkDescriptorPool pool_;
+    VkDescriptorSet set_;
+    std::optional<LocalBuffer> param_buffer_;
+    uint32_t param_bytes_;
+
+    std::mutex lock_;
+    RangeAllocator slots_;
+};
+
+struct MaterialRange {
+    MaterialRange(MaterialTable &t, uint32_t num_materials);
+    MaterialRange(const MaterialRange &) = delete;
+    MaterialRange(MaterialRange &&o);
+    ~MaterialRange();
+
+    MaterialTable *table;
+    uint32_t base;
+    uint32_t count;
+};
+
+// Vertices and indices of every loaded scene, sub-allocated out of a few
+// large blocks so batches mixing scenes rarely rebind geometry. Blocks are
+// only added once the existing ones are full, so device memory grows with
+// the loaded scenes. Each scene lies within one block, which is bound at
+// offset 0 as both the vertex and index buffer, so InlineMesh offsets
+// index the whole block.
+class GeometryHeap {
+public:
+    GeometryHeap(MemoryAllocator &alloc,
+                 uint32_t vertex_stride,
+                 VkDeviceSize block_bytes);
+    GeometryHeap(const GeometryHeap &) = delete;
+
+    uint32_t getVertexStride() const { return vertex_stride_; }
+
+    // Allocations are in granules, which hold a whole number of vertices
+    // and of indices
+    uint32_t getGranuleBytes() const { return granule_bytes_; }
+
+    struct Allocation {
+        uint32_t block;
+        uint32_t baseGranule;
+        VkBuffer buffer;
+    };
+
+    Allocation allocate(uint32_t num_granules);
+    void release(uint32_t block, uint32_t base, uint32_t num_granules);
+
+private:
+    struct Block {
+        LocalBuffer buffer;
+        RangeAllocator granules;
+    };
+
+    MemoryAllocator &alloc_;
+    uint32_t vertex_stride_;
+    uint32_t granule_bytes_;
+    uint32_t block_granules_;
+
+    std::mutex lock_;
+    // Blocks are never freed, so their indices stay valid
+    std::deque<Block> blocks_;
+};
+
+// A scene's vertices followed by its indices
+struct GeometryRange {
+    GeometryRange(GeometryHeap &h, uint32_t num_vertices,
+                  uint32_t num_indices);
+    GeometryRange(const GeometryRange &) = delete;
+    GeometryRange(GeometryRange &&o);
+    ~GeometryRange();
+
+    GeometryHeap *heap;
+    uint32_t block;
+    uint32_t baseGranule;
+    uint32_t numGranules;
+    // VK_NULL_HANDLE if the scene has no geometry
+    VkBuffer buffer;
+
+    // First vertex and index in the whole block
+    uint32_t vertexBase;
+    uint32_t indexBase;
+
+    VkDeviceSize byteOffset;
+    VkDeviceSize indexByteOffset;
+    VkDeviceSize numBytes;
+};
+
+// A scene's uploads are still in flight until semaphore reaches value.
+// Destruction waits for them, so the scene's resources outlive the
+// commands writing them.
+struct UploadCompletion {
+    UploadCompletion(const DeviceState &d, VkSemaphore sema, uint64_t v);
+    UploadCompletion(const UploadCompletion &) = delete;
+    UploadCompletion(UploadCompletion &&o);
+    ~UploadCompletion();
+
+    const DeviceState *dev;
+    VkSemaphore semaphore;
+    uint64_t value;
+};
+
 struct Scene {
     std::vector<LocalImage> textures;
     std::vector<VkImageView> texture_views;
-    DescriptorSet materialSet;
-    LocalBuffer data;
-    VkDeviceSize indexOffset;
+    MaterialRange materials;
+    GeometryRange geometry;
     std::vector<InlineMesh> meshes;
     EnvironmentInit envDefaults;
+    // Last, so it's destroyed before anything the uploads use
+    UploadCompletion ready;
 };
 
 class EnvironmentState {
@@ -124,32 +286,115 @@ public:
     std::vector<uint32_t> freeLightIDs;
     std::vector<uint32_t> lightIDs;
     std::vector<uint32_t> lightReverseIDs;
+
+    // Stream and batch slot the env was last uploaded from. uploadID is
+    // unique across every env in the process and replaced whenever the env
+    // moves, so copies left in its old slots, or by an env that used to
+    // live at the same address, are known to be stale.
+    const void *uploadStream;
+    uint32_t uploadSlot;
+    uint64_t uploadID;
+
+    static uint64_t makeUploadID();
 };
 
+// All vertices followed by all indices, ready to be uploaded
 struct StagedScene {
-    HostBuffer buffer;
+    std::vector<uint8_t> geometry;
     std::vector<InlineMesh> meshPositions;
+    uint32_t numVertices;
+    uint32_t numIndices;
     VkDeviceSize indexBufferOffset;
-    VkDeviceSize paramBufferOffset;
-    VkDeviceSize totalBytes;
 };
 
+// Staging memory a loader streams every upload through on the transfer
+// queue, kept for the loader's lifetime. It's used as a ring of two
+// halves: one is filled while the other's copies run. Uploads that don't
+// fit in what's left of a half continue in the other, so scenes of any
+// size load without allocating staging memory. The arena starts at an
+// eighth of max_bytes and grows towards it when a load had to wait on
+// the ring.
+class StagingArena {
+public:
+    StagingArena(const DeviceState &dev,
+                 MemoryAllocator &alloc,
+                 const QueueState &queue,
+                 VkCommandPool pool,
+                 VkDeviceSize max_bytes);
+    StagingArena(const StagingArena &) = delete;
+    StagingArena(StagingArena &&) = default;
+
+    // Starts recording a load's uploads. Everything submitted by the
+    // previous load must have completed.
+    void begin();
+
+    // Commands recorded here are ordered after every upload so far
+    VkCommandBuffer getCommands() const
+    {
+        return halves_[cur_half_].cmd;
+    }
+
+    void uploadBuffer(const void *src, VkDeviceSize num_bytes,
+                      VkBuffer dst, VkDeviceSize dst_offset);
+
+    // Writes tightly packed rows into mip level 0 of dst, which must be
+    // in TRANSFER_DST_OPTIMAL
+    void uploadImage(const void *src, uint32_t width, uint32_t height,
+                     uint32_t texel_bytes, VkImage dst);
+
+    // Submits the remaining uploads, signaling semaphore once every
+    // upload of the load has completed
+    void submit(VkSemaphore semaphore);
+
+private:
+    struct Half {
+        VkCommandBuffer cmd;
+        VkFence fence;
+        bool pending;
+    };
+
+    void resize(VkDeviceSize num_bytes);
+
+    // Aligns the current half's free space and returns its offset in the
+    // buffer and size, moving to the other half if less than min_bytes
+    // is left
+    std::pair<VkDeviceSize, VkDeviceSize> reserve(VkDeviceSize min_bytes,
+                                                  VkDeviceSize alignment);
+    void submitHalf(VkSemaphore semaphore);
+    void waitHalf(Half &half);
+
+    const DeviceState &dev;
+    MemoryAllocator &alloc_;
+    const QueueState &queue_;
+    VkDeviceSize max_bytes_;
+
+    std::optional<HostBuffer> buffer_;
+    VkDeviceSize half_bytes_;
+    std::array<Half, 2> halves_;
+    uint32_t cur_half_;
+    VkDeviceSize cur_offset_;
+    // Bytes staged by the current load, which the arena grows to fit
+    VkDeviceSize load_bytes_;
+};
+
+class LoadTimer;
+
 struct LoaderImpl {
     std::add_pointer_t<
-        StagedScene(const std::vector<std::shared_ptr<Mesh>> &,
-                    const std::vector<uint8_t> &param_bytes,
-                    const DeviceState &,
-                    MemoryAllocator &)>
+        StagedScene(const std::vector<std::shared_ptr<Mesh>> &)>
             stageScene;
 
     std::add_pointer_t<
-        SceneDescription(std::string_view, const glm::mat4 &)>
+        SceneDescription(std::string_view, const glm::mat4 &,
+                         ThreadPool &, LoadTimer &)>
             parseScene;
 
     std::add_pointer_t<
         std::shared_ptr<Mesh>(std::string_view)>
             loadMesh;
 
+    uint32_t materialParamBytes;
+
     template <typename VertexType, typename MaterialParamsType>
     static LoaderImpl create();
 };
@@ -158,15 +403,25 @@ class LoaderState {
 public:
     LoaderState(const DeviceState &dev,
                 const LoaderImpl &impl,
-                const VkDescriptorSetLayout &scene_set_layout,
-                DescriptorManager::MakePoolType make_scene_pool,
+                MaterialTable &material_table,
+                GeometryHeap &geometry_heap,
+                ThreadPool &load_pool,
                 MemoryAllocator &alc,
                 QueueManager &queue_manager,
-                const glm::mat4 &coordinateTransform);
-
+                const glm::mat4 &coordinateTransform,
+                VkDeviceSize staging_bytes);
+    LoaderState(const LoaderState &) = delete;
+    // Finishes any queued async loads
+    ~LoaderState();
 
     std::shared_ptr<Scene> loadScene(std::string_view scene_path);
 
+    // Queues the load on the loader's worker thread, which runs async
+    // loads one at a time in order. Uploads are serialized with every
+    // other load through this loader.
+    std::future<std::shared_ptr<Scene>> loadSceneAsync(
+            std::string_view scene_path);
+
     std::shared_ptr<Scene> makeScene(
             const SceneDescription &scene_desc);
 
@@ -190,18 +445,35 @@ public:
 
     const VkCommandPool transferPool;
     const QueueState &transferQueue;
-    const VkCommandBuffer transferStageCommand;
+    StagingArena stagingArena;
 
     const VkSemaphore semaphore;
-    const VkFence fence;
+    // Signaled with a scene's ready.value once its upload completes
+    const VkSemaphore timeline;
 
     MemoryAllocator &alloc;
-    DescriptorManager descriptorManager;
+    MaterialTable &materialTable;
+    GeometryHeap &geometryHeap;
+    // Shared by every loader for decoding textures and meshes
+    ThreadPool &loadPool;
 
     glm::mat4 coordinateTransform;
 
 private:
     const LoaderImpl impl_;
+
+    void asyncLoop();
+
+    std::mutex upload_lock_;
+    uint64_t num_uploads_;
+
+    std::mutex async_lock_;
+    std::condition_variable async_cv_;
+    std::deque<std::pair<std::string,
+                         std::promise<std::shared_ptr<Scene>>>> async_loads_;
+    bool async_exit_;
+    // Started by the first loadSceneAsync
+    std::thread async_worker_;
 };
 
 }
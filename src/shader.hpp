@@ -14,12 +14,22 @@ using uint = uint32_t;
 
 using Shader::ViewInfo;
 using Shader::RenderPushConstant;
+using Shader::CullingInfo;
+using Shader::DrawCullInfo;
+using Shader::LightTile;
+using Shader::PackPushConstant;
 
 namespace VulkanConfig {
 
 constexpr uint32_t max_materials = MAX_MATERIALS;
 constexpr uint32_t max_lights = MAX_LIGHTS;
+constexpr uint32_t max_light_indices = MAX_LIGHT_INDICES;
+constexpr uint32_t light_tile_dim = LIGHT_TILE_DIM;
+constexpr uint32_t light_tiles_per_env = LIGHT_TILES_PER_ENV;
 constexpr uint32_t max_instances = 100000;
+constexpr uint32_t max_draws = 500000;
+constexpr uint32_t cull_workgroup_size = CULL_WORKGROUP_SIZE;
+constexpr uint32_t pack_workgroup_size = PACK_WORKGROUP_SIZE;
 
 }
 
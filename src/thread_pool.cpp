@@ -0,0 +1,109 @@
+#include "thread_pool.hpp"
+
+using namespace std;
+
+namespace v4r {
+
+ThreadPool::ThreadPool(uint32_t num_threads)
+    : lock_(),
+      cv_(),
+      tasks_(),
+      exit_(false),
+      workers_()
+{
+    workers_.reserve(num_threads);
+    for (uint32_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(lock_);
+        exit_ = true;
+    }
+    cv_.notify_all();
+
+    for (thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> guard(lock_);
+            cv_.wait(guard, [this]() { return exit_ || !tasks_.empty(); });
+
+            if (tasks_.empty()) {
+                return;
+            }
+
+            task = move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        task();
+    }
+}
+
+bool ThreadPool::runQueuedTask()
+{
+    function<void()> task;
+    {
+        lock_guard<mutex> guard(lock_);
+        if (tasks_.empty()) {
+            return false;
+        }
+
+        task = move(tasks_.front());
+        tasks_.pop_front();
+    }
+
+    task();
+
+    return true;
+}
+
+void ThreadPool::parallelFor(uint32_t num_tasks,
+                             const function<void(uint32_t)> &fn)
+{
+    if (num_tasks == 0) return;
+
+    mutex done_lock;
+    condition_variable done_cv;
+    uint32_t num_remaining = num_tasks - 1;
+
+    if (num_remaining > 0) {
+        {
+            lock_guard<mutex> guard(lock_);
+            for (uint32_t task_idx = 1; task_idx < num_tasks; task_idx++) {
+                tasks_.emplace_back([&, task_idx]() {
+                    fn(task_idx);
+
+                    // Notify under the lock so the waiting thread can't
+                    // destroy done_cv before notify_one returns
+                    lock_guard<mutex> done_guard(done_lock);
+                    if (--num_remaining == 0) {
+                        done_cv.notify_one();
+                    }
+                });
+            }
+        }
+        cv_.notify_all();
+    }
+
+    fn(0);
+
+    // Help drain the queue rather than idling. This may run tasks queued
+    // by other callers, which is fine since tasks never block on each other
+    while (runQueuedTask()) {}
+
+    unique_lock<mutex> done_guard(done_lock);
+    done_cv.wait(done_guard, [&]() { return num_remaining == 0; });
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef THREAD_POOL_HPP_INCLUDED
+#define THREAD_POOL_HPP_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace v4r {
+
+class ThreadPool {
+public:
+    ThreadPool(uint32_t num_threads);
+    ThreadPool(const ThreadPool &) = delete;
+    ~ThreadPool();
+
+    uint32_t numThreads() const
+    {
+        return static_cast<uint32_t>(workers_.size());
+    }
+
+    // Runs fn(task_idx) for every task_idx in [0, num_tasks) and blocks
+    // until all of them have finished. The calling thread runs task 0
+    // itself, then keeps running queued tasks until the queue is empty.
+    // Safe to call from multiple threads at once, but not from inside a
+    // task.
+    void parallelFor(uint32_t num_tasks,
+                     const std::function<void(uint32_t)> &fn);
+
+private:
+    void workerLoop();
+    bool runQueuedTask();
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool exit_;
+
+    std::vector<std::thread> workers_;
+};
+
+}
+
+#endif
@@ -89,12 +89,118 @@ shared_ptr<Scene> AssetLoader::loadScene(
     return state_->loadScene(scene_path);
 }
 
+future<shared_ptr<Scene>> AssetLoader::loadSceneAsync(
+        string_view scene_path)
+{
+    return state_->loadSceneAsync(scene_path);
+}
+
 void CommandStream::waitForFrame(uint32_t frame_id)
 {
     VkFence fence = state_->getFence(frame_id);
     assert(fence != VK_NULL_HANDLE);
     waitForFenceInfinitely(state_->dev, fence);
     resetFence(state_->dev, fence);
+
+    state_->copyStagedOutputs(frame_id);
+}
+
+FrameTicket CommandStream::getTicket(uint32_t frame_id) const
+{
+    return FrameTicket {
+        state_->getTicket(frame_id),
+        frame_id
+    };
+}
+
+bool CommandStream::isFrameReady(const FrameTicket &ticket) const
+{
+    return state_->isTicketComplete(ticket.id);
+}
+
+bool CommandStream::waitForFrame(const FrameTicket &ticket,
+                                 uint64_t timeout) const
+{
+    if (!state_->waitForTicket(ticket.id, timeout)) {
+        return false;
+    }
+
+    // A newer batch may already be rendering into the frame, in which
+    // case its staging buffers are still being written
+    if (state_->getTicket(ticket.frameID) == ticket.id) {
+        state_->copyStagedOutputs(ticket.frameID);
+    }
+
+    return true;
+}
+
+int32_t CommandStream::waitAny(const vector<const CommandStream *> &streams,
+                               const vector<FrameTicket> &tickets,
+                               uint64_t timeout)
+{
+    assert(streams.size() == tickets.size());
+    if (streams.empty()) {
+        return -1;
+    }
+
+    const DeviceState &dev = streams[0]->state_->dev;
+
+    DynArray<VkSemaphore> timelines(streams.size());
+    DynArray<uint64_t> values(streams.size());
+    for (uint32_t idx = 0; idx < streams.size(); idx++) {
+        timelines[idx] = streams[idx]->state_->getTimeline();
+        values[idx] = tickets[idx].id;
+    }
+
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.flags = VK_SEMAPHORE_WAIT_ANY_BIT;
+    wait_info.semaphoreCount = static_cast<uint32_t>(timelines.size());
+    wait_info.pSemaphores = timelines.data();
+    wait_info.pValues = values.data();
+
+    VkResult res = dev.dt.waitSemaphores(dev.hdl, &wait_info, timeout);
+    if (res == VK_TIMEOUT) {
+        return -1;
+    }
+
+    REQ_VK(res);
+
+    // The wait doesn't report which semaphore was signaled
+    for (uint32_t idx = 0; idx < streams.size(); idx++) {
+        if (streams[idx]->isFrameReady(tickets[idx])) {
+            return static_cast<int32_t>(idx);
+        }
+    }
+
+    return -1;
+}
+
+uint8_t * CommandStream::getColorHostPtr(uint32_t frame_id) const
+{
+    return state_->getColorHostPtr(frame_id);
+}
+
+float * CommandStream::getDepthHostPtr(uint32_t frame_id) const
+{
+    return state_->getDepthHostPtr(frame_id);
+}
+
+uint32_t CommandStream::getNumFrames() const
+{
+    return state_->getNumFrames();
+}
+
+void CommandStream::setColorOutputMemory(uint32_t frame_id, void *ptr,
+                                         size_t num_bytes)
+{
+    state_->setColorOutput(frame_id, ptr, num_bytes);
+}
+
+void CommandStream::setDepthOutputMemory(uint32_t frame_id, void *ptr,
+                                         size_t num_bytes)
+{
+    state_->setDepthOutput(frame_id, ptr, num_bytes);
 }
 
 CommandStream::CommandStream(Handle<CommandStreamState> &&state,
@@ -132,17 +238,25 @@ BatchRenderer::BatchRenderer(Handle<VulkanState> &&vk_state)
     : state_(move(vk_state))
 {}
 
+template <typename PipelineType>
+uint32_t BatchRenderer::addPipeline(
+        const RenderConfig &cfg,
+        const RenderFeatures<PipelineType> &features)
+{
+    return state_->addVariant(cfg, features);
+}
+
 AssetLoader BatchRenderer::makeLoader()
 {
-    return AssetLoader(make_handle<LoaderState>(
-            state_->makeLoader()));
+    return AssetLoader(state_->makeLoader());
 }
 
-CommandStream BatchRenderer::makeCommandStream()
+CommandStream BatchRenderer::makeCommandStream(uint32_t pipeline_idx)
 {
-    auto stream_state = make_handle<CommandStreamState>(state_->makeStream());
+    auto stream_state = make_handle<CommandStreamState>(
+            state_->makeStream(pipeline_idx));
 
-    glm::u32vec2 img_dim = state_->getImageDimensions();
+    glm::u32vec2 img_dim = state_->getImageDimensions(pipeline_idx);
 
     return CommandStream(move(stream_state),
                          img_dim.x, img_dim.y);
@@ -153,15 +267,18 @@ Environment::Environment(Handle<EnvironmentState> &&state)
       view_(),
       index_map_(state_->scene->envDefaults.indexMap),
       transforms_(state_->scene->envDefaults.transforms),
-      materials_(state_->scene->envDefaults.materials)
+      materials_(state_->scene->envDefaults.materials),
+      material_base_(state_->scene->materials.base),
+      dirty_ranges_(transforms_.size(), { ~0u, 0 })
 {}
 
 uint32_t Environment::addInstance(uint32_t model_idx, uint32_t material_idx,
                                   const glm::mat4x3 &model_matrix)
 {
     transforms_[model_idx].emplace_back(model_matrix);
-    materials_[model_idx].emplace_back(material_idx);
+    materials_[model_idx].emplace_back(material_base_ + material_idx);
     uint32_t instance_idx = transforms_[model_idx].size() - 1;
+    markDirty(model_idx, instance_idx);
 
     uint32_t outer_id;
     if (state_->freeIDs.size() > 0) {
@@ -198,6 +315,7 @@ void Environment::deleteInstance(uint32_t inst_id)
         materials[instance_idx] = materials.back();
         reverse_ids[instance_idx] = reverse_ids.back();
         index_map_[reverse_ids[instance_idx]] = { model_idx, instance_idx };
+        markDirty(model_idx, instance_idx);
 
         transforms.pop_back();
         materials.pop_back();
@@ -208,10 +326,11 @@ void Environment::deleteInstance(uint32_t inst_id)
 }
 
 uint32_t Environment::addLight(const glm::vec3 &position,
-                               const glm::vec3 &color)
+                               const glm::vec3 &color,
+                               float radius)
 {
     state_->lights.push_back({
-        glm::vec4(position, 1.f),
+        glm::vec4(position, radius),
         glm::vec4(color, 1.f)
     });
 
@@ -10,89 +10,67 @@ using namespace std;
 
 namespace v4r {
 
+// Exported binary semaphores, one per frame in flight
 struct SyncState {
-    SyncState(const DeviceState &d)
+    SyncState(const DeviceState &d, uint32_t num_frames)
         : dev(d),
-          extSemaphore(makeBinaryExternalSemaphore(dev)),
-          fd(exportBinarySemaphore(dev, extSemaphore))
-    {}
+          extSemaphores(num_frames),
+          fds(num_frames)
+    {
+        for (uint32_t frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+            extSemaphores[frame_idx] = makeBinaryExternalSemaphore(dev);
+            fds[frame_idx] = exportBinarySemaphore(dev,
+                                                   extSemaphores[frame_idx]);
+        }
+    }
 
     ~SyncState() 
     {
-        close(fd);
-        dev.dt.destroySemaphore(dev.hdl, extSemaphore, nullptr);
+        for (uint32_t frame_idx = 0; frame_idx < fds.size(); frame_idx++) {
+            close(fds[frame_idx]);
+            dev.dt.destroySemaphore(dev.hdl, extSemaphores[frame_idx],
+                                    nullptr);
+        }
     }
 
     const DeviceState &dev;
-    VkSemaphore extSemaphore;
-    int fd;
+    DynArray<VkSemaphore> extSemaphores;
+    DynArray<int> fds;
 };
 
 template struct HandleDeleter<CudaState>;
 template struct HandleDeleter<CudaStreamState[]>;
-template struct HandleDeleter<SyncState[]>;
-
-static SyncState *makeExportableSemaphores(
-        const DeviceState &dev,
-        bool double_buffered)
-{
-    if (double_buffered) {
-        return new SyncState[2] {
-            SyncState(dev),
-            SyncState(dev)
-        };
-    } else {
-        return new SyncState[1] {
-            SyncState(dev)
-        };
-    }
-}
+template struct HandleDeleter<SyncState>;
 
 static CudaStreamState * makeCudaStreamStates(
         const CommandStreamState &cmd_stream,
-        const SyncState *syncs,
+        const SyncState &syncs,
         const CudaState &cuda_global,
-        bool double_buffered)
+        uint32_t num_frames)
 {
     cuda_global.setActiveDevice();
 
-    if (double_buffered) {
-        return new CudaStreamState[2] {
-            CudaStreamState {
-                (uint8_t *)cuda_global.getPointer(
-                        cmd_stream.getColorOffset(0)),
-                (float *)cuda_global.getPointer(
-                        cmd_stream.getDepthOffset(0)),
-                syncs[0].fd
-            },
-            CudaStreamState {
-                (uint8_t *)cuda_global.getPointer(
-                        cmd_stream.getColorOffset(1)),
-                (float *)cuda_global.getPointer(
-                        cmd_stream.getDepthOffset(1)),
-                syncs[1].fd
-            }
-        };
-    } else {
-        return new CudaStreamState[1] {
-            CudaStreamState {
-                (uint8_t *)cuda_global.getPointer(
-                        cmd_stream.getColorOffset(0)),
-                (float *)cuda_global.getPointer(
-                        cmd_stream.getDepthOffset(0)),
-                syncs[0].fd
-            }
+    CudaStreamState *states = new CudaStreamState[num_frames];
+    for (uint32_t frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+        states[frame_idx] = CudaStreamState {
+            (uint8_t *)cuda_global.getPointer(
+                    cmd_stream.getColorOffset(frame_idx)),
+            (float *)cuda_global.getPointer(
+                    cmd_stream.getDepthOffset(frame_idx)),
+            syncs.fds[frame_idx]
         };
     }
+
+    return states;
 }
 
 CommandStreamCUDA::CommandStreamCUDA(CommandStream &&base,
                                      const CudaState &cuda_global,
-                                     bool double_buffered)
+                                     uint32_t num_frames)
     : CommandStream(move(base)),
-      syncs_(makeExportableSemaphores(state_->dev, double_buffered)),
-      cuda_(makeCudaStreamStates(*state_, syncs_.get(), cuda_global,
-                                 double_buffered))
+      syncs_(new SyncState(state_->dev, num_frames)),
+      cuda_(makeCudaStreamStates(*state_, *syncs_, cuda_global,
+                                 num_frames))
 {}
 
 uint32_t CommandStreamCUDA::render(const vector<Environment> &envs)
@@ -107,7 +85,7 @@ uint32_t CommandStreamCUDA::render(const vector<Environment> &envs)
             nullptr,
             0, nullptr, nullptr,
             num_commands, commands,
-            1, &syncs_[frame_id].extSemaphore
+            1, &syncs_->extSemaphores[frame_id]
         };
 
         state_->gfxQueue.submit(state_->dev, 1, &gfx_submit, fence);
@@ -147,7 +125,7 @@ BatchRendererCUDA::BatchRendererCUDA(BatchRenderer &&base,
 CommandStreamCUDA BatchRendererCUDA::makeCommandStream()
 {
     return CommandStreamCUDA(BatchRenderer::makeCommandStream(),
-                             *cuda_, state_->isDoubleBuffered());
+                             *cuda_, state_->getNumFramesInFlight());
 }
 
 }
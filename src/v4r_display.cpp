@@ -336,9 +336,12 @@ uint32_t PresentCommandStream::render(const vector<Environment> &elems)
         glm::u32vec2 render_extent = state_->getFrameExtent();
         VkImage render_img = state_->getColorImage(frame_idx);
 
+        // With layered output only the first env of the batch is shown
+        uint32_t fb_layer = state_->getFBLayer(frame_idx);
+
         VkImageBlit blit_region {
             { VK_IMAGE_ASPECT_COLOR_BIT,
-              0, 0, 1 },
+              0, fb_layer, 1 },
             {
                 { 
                     static_cast<int32_t>(
@@ -439,12 +442,14 @@ uint32_t PresentCommandStream::render(const vector<Environment> &elems)
 }
 
 CoreVulkanHandles makeCoreHandles(const RenderConfig &config,
+                                  RenderOptions opts,
                                   const DeviceUUID &dev_id) {
     InstanceState inst_state(true, getGLFWPresentationExtensions());
 
     DeviceState dev_state = inst_state.makeDevice(
         dev_id, config.numStreams + config.numLoaders,
-        1, config.numLoaders, presentationSupportWrapper);
+        1, config.numLoaders, getDeviceFeatures(opts),
+        presentationSupportWrapper);
 
     return CoreVulkanHandles {
         move(inst_state),
@@ -458,10 +463,10 @@ BatchPresentRenderer::BatchPresentRenderer(
         const RenderFeatures<PipelineType> &features,
         bool benchmark_mode)
     : BatchRenderer(make_handle<VulkanState>(cfg, features, makeCoreHandles(
-            cfg, getUUIDFromCudaID(cfg.gpuID)))),
+            cfg, features.options, getUUIDFromCudaID(cfg.gpuID)))),
       benchmark_mode_(benchmark_mode)
 {
-    assert(benchmark_mode || state_->fbCfg.colorOutput);
+    assert(benchmark_mode || state_->getVariant(0).fbCfg.colorOutput);
 }
 
 PresentCommandStream BatchPresentRenderer::makeCommandStream(
@@ -473,8 +478,8 @@ PresentCommandStream BatchPresentRenderer::makeCommandStream(
 
 glm::u32vec2 BatchPresentRenderer::getFrameDimensions() const
 {
-    return glm::u32vec2(state_->fbCfg.frameWidth,
-                        state_->fbCfg.frameHeight);
+    const FramebufferConfig &fb_cfg = state_->getVariant(0).fbCfg;
+    return glm::u32vec2(fb_cfg.frameWidth, fb_cfg.frameHeight);
 }
 
 }
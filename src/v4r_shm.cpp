@@ -0,0 +1,420 @@
+#include <v4r/shm.hpp>
+
+#include "vulkan_state.hpp"
+#include "utils.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace v4r {
+
+static_assert(atomic<uint32_t>::is_always_lock_free &&
+              sizeof(atomic<uint32_t>) == sizeof(uint32_t),
+              "Futex words must be plain 32 bit integers");
+static_assert(atomic<uint64_t>::is_always_lock_free,
+              "Shared tickets can't rely on process local locks");
+
+static uint64_t alignBytes(uint64_t num_bytes, uint64_t alignment)
+{
+    return (num_bytes + alignment - 1) / alignment * alignment;
+}
+
+// Futexes aren't private, since the waiters live in other processes
+static uint32_t *getFutexWord(const atomic<uint32_t> &word)
+{
+    return reinterpret_cast<uint32_t *>(
+        const_cast<atomic<uint32_t> *>(&word));
+}
+
+static void futexWakeAll(const atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, getFutexWord(word), FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+}
+
+static void futexWait(const atomic<uint32_t> &word, uint32_t expected,
+                      const timespec *timeout)
+{
+    // Spurious wakeups, EAGAIN and timeouts are all handled by the caller
+    // rechecking its condition
+    syscall(SYS_futex, getFutexWord(word), FUTEX_WAIT, expected,
+            timeout, nullptr, 0);
+}
+
+[[noreturn]] static void shmError(const char *what)
+{
+    cerr << what << ": " << strerror(errno) << endl;
+    fatalExit();
+}
+
+struct ShmStreamState {
+    ShmStreamState(const char *shm_name, uint32_t num_frames,
+                   uint64_t color_bytes, uint64_t depth_bytes,
+                   uint64_t alignment)
+        : name(shm_name ? shm_name : ""),
+          fd(shm_name ?
+              shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0600) :
+              memfd_create("v4r_frames", MFD_CLOEXEC)),
+          header(nullptr),
+          numBytes(0),
+          published(num_frames)
+    {
+        if (fd == -1) {
+            shmError("Failed to create shared frame memory");
+        }
+
+        // Every frame starts on an import granule so it can be written
+        // by the GPU in place
+        uint64_t frame_offset = alignBytes(
+            sizeof(ShmHeader) + num_frames * sizeof(ShmFrameSlot), alignment);
+        uint64_t depth_offset = alignBytes(color_bytes, alignment);
+        uint64_t frame_stride =
+            alignBytes(depth_offset + depth_bytes, alignment);
+
+        numBytes = frame_offset + frame_stride * num_frames;
+
+        if (ftruncate(fd, numBytes) == -1) {
+            shmError("Failed to size shared frame memory");
+        }
+
+        void *ptr = mmap(nullptr, numBytes, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            shmError("Failed to map shared frame memory");
+        }
+
+        // The region is zero filled, so no frame starts out ready
+        header = new (ptr) ShmHeader;
+        header->numFrames = num_frames;
+        header->frameOffset = frame_offset;
+        header->frameStride = frame_stride;
+        header->colorBytes = color_bytes;
+        header->depthOffset = depth_offset;
+        header->depthBytes = depth_bytes;
+        header->totalBytes = numBytes;
+
+        ShmFrameSlot *slots = header->getSlots();
+        for (uint32_t frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+            new (&slots[frame_idx]) ShmFrameSlot;
+            published[frame_idx] = 0;
+        }
+
+        // Readers validate the magic, so it's written last
+        atomic_thread_fence(memory_order_release);
+        header->magic = ShmHeader::magic_value;
+    }
+
+    ShmStreamState(const ShmStreamState &) = delete;
+
+    ~ShmStreamState()
+    {
+        munmap(header, numBytes);
+        close(fd);
+
+        if (!name.empty()) {
+            shm_unlink(name.c_str());
+        }
+    }
+
+    uint8_t *getFramePtr(uint32_t frame_idx) const
+    {
+        return reinterpret_cast<uint8_t *>(header) + header->frameOffset +
+            frame_idx * header->frameStride;
+    }
+
+    void markRendering(uint32_t frame_idx)
+    {
+        header->getSlots()[frame_idx].ready.store(0, memory_order_release);
+        published[frame_idx] = 0;
+    }
+
+    bool isPublished(uint32_t frame_idx, uint64_t ticket) const
+    {
+        return published[frame_idx] == ticket;
+    }
+
+    void publish(uint32_t frame_idx, uint64_t ticket)
+    {
+        if (isPublished(frame_idx, ticket)) return;
+
+        ShmFrameSlot &slot = header->getSlots()[frame_idx];
+        slot.ticket.store(ticket, memory_order_relaxed);
+        slot.ready.store(1, memory_order_release);
+
+        published[frame_idx] = ticket;
+
+        header->publishCount.fetch_add(1, memory_order_release);
+        futexWakeAll(header->publishCount);
+    }
+
+    const string name;
+    const int fd;
+    ShmHeader *header;
+    uint64_t numBytes;
+
+    // Renderer side copy of the last ticket published for each frame
+    DynArray<uint64_t> published;
+};
+
+template struct HandleDeleter<ShmStreamState>;
+
+CommandStreamShm::CommandStreamShm(CommandStream &&base,
+                                   const char *shm_name)
+    : CommandStream(move(base)),
+      shm_(make_handle<ShmStreamState>(shm_name,
+          state_->getNumFrames(),
+          state_->getColorBytesPerFrame(),
+          state_->getDepthBytesPerFrame(),
+          max<uint64_t>(sysconf(_SC_PAGESIZE),
+                        state_->alloc.getHostImportAlignment())))
+{
+    const ShmHeader &header = *shm_->header;
+
+    for (uint32_t frame_idx = 0; frame_idx < header.numFrames;
+         frame_idx++) {
+        uint8_t *frame_ptr = shm_->getFramePtr(frame_idx);
+
+        if (header.colorBytes > 0) {
+            state_->setColorOutput(frame_idx, frame_ptr, header.depthOffset);
+        }
+
+        if (header.depthBytes > 0) {
+            state_->setDepthOutput(frame_idx, frame_ptr + header.depthOffset,
+                                   header.frameStride - header.depthOffset);
+        }
+    }
+}
+
+CommandStreamShm::~CommandStreamShm()
+{
+    if (!shm_) return;
+
+    // Imported memory must be released before the mapping goes away
+    const ShmHeader &header = *shm_->header;
+    for (uint32_t frame_idx = 0; frame_idx < header.numFrames;
+         frame_idx++) {
+        if (header.colorBytes > 0) {
+            state_->setColorOutput(frame_idx, nullptr, 0);
+        }
+
+        if (header.depthBytes > 0) {
+            state_->setDepthOutput(frame_idx, nullptr, 0);
+        }
+    }
+}
+
+uint32_t CommandStreamShm::render(const vector<Environment> &envs)
+{
+    shm_->markRendering(state_->getCurrentFrame());
+
+    return CommandStream::render(envs);
+}
+
+void CommandStreamShm::waitForFrame(uint32_t frame_id)
+{
+    CommandStream::waitForFrame(frame_id);
+
+    shm_->publish(frame_id, state_->getTicket(frame_id));
+}
+
+bool CommandStreamShm::waitForFrame(const FrameTicket &ticket,
+                                    uint64_t timeout) const
+{
+    if (!CommandStream::waitForFrame(ticket, timeout)) {
+        return false;
+    }
+
+    // A newer batch may already be rendering into the frame
+    if (state_->getTicket(ticket.frameID) == ticket.id) {
+        shm_->publish(ticket.frameID, ticket.id);
+    }
+
+    return true;
+}
+
+void CommandStreamShm::publishReadyFrames() const
+{
+    for (uint32_t frame_idx = 0; frame_idx < state_->getNumFrames();
+         frame_idx++) {
+        uint64_t ticket = state_->getTicket(frame_idx);
+
+        if (ticket == 0 || shm_->isPublished(frame_idx, ticket) ||
+            !state_->isTicketComplete(ticket)) {
+            continue;
+        }
+
+        state_->copyStagedOutputs(frame_idx);
+        shm_->publish(frame_idx, ticket);
+    }
+}
+
+int CommandStreamShm::getFD() const
+{
+    return shm_->fd;
+}
+
+uint64_t CommandStreamShm::getNumBytes() const
+{
+    return shm_->numBytes;
+}
+
+CommandStreamShm BatchRendererShm::makeCommandStream(const char *shm_name,
+                                                    uint32_t pipeline_idx)
+{
+    return CommandStreamShm(BatchRenderer::makeCommandStream(pipeline_idx),
+                            shm_name);
+}
+
+static void mapShmRegion(int fd, ShmHeader *&header, uint64_t &num_bytes)
+{
+    struct stat shm_stat;
+    if (fstat(fd, &shm_stat) == -1) {
+        shmError("Failed to query shared frame memory");
+    }
+
+    num_bytes = shm_stat.st_size;
+
+    if (num_bytes < sizeof(ShmHeader)) {
+        cerr << "Shared frame memory is too small" << endl;
+        fatalExit();
+    }
+
+    void *ptr = mmap(nullptr, num_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        shmError("Failed to map shared frame memory");
+    }
+
+    header = reinterpret_cast<ShmHeader *>(ptr);
+
+    if (header->magic != ShmHeader::magic_value ||
+        header->totalBytes > num_bytes) {
+        cerr << "Shared memory doesn't hold v4r frames" << endl;
+        fatalExit();
+    }
+    atomic_thread_fence(memory_order_acquire);
+}
+
+ShmFrameReader::ShmFrameReader(const char *shm_name)
+    : header_(nullptr),
+      num_bytes_(0)
+{
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1) {
+        shmError("Failed to open shared frame memory");
+    }
+
+    mapShmRegion(fd, header_, num_bytes_);
+
+    close(fd);
+}
+
+ShmFrameReader::ShmFrameReader(int fd)
+    : header_(nullptr),
+      num_bytes_(0)
+{
+    mapShmRegion(fd, header_, num_bytes_);
+}
+
+ShmFrameReader::ShmFrameReader(ShmFrameReader &&o)
+    : header_(o.header_),
+      num_bytes_(o.num_bytes_)
+{
+    o.header_ = nullptr;
+}
+
+ShmFrameReader::~ShmFrameReader()
+{
+    if (!header_) return;
+
+    munmap(header_, num_bytes_);
+}
+
+const uint8_t * ShmFrameReader::getColorPtr(uint32_t frame_id) const
+{
+    return reinterpret_cast<const uint8_t *>(header_) +
+        header_->frameOffset + frame_id * header_->frameStride;
+}
+
+const void * ShmFrameReader::getDepthPtr(uint32_t frame_id) const
+{
+    return getColorPtr(frame_id) + header_->depthOffset;
+}
+
+uint64_t ShmFrameReader::getReadyTicket(uint32_t frame_id) const
+{
+    const ShmFrameSlot &slot = header_->getSlots()[frame_id];
+
+    if (!slot.ready.load(memory_order_acquire)) {
+        return 0;
+    }
+
+    return slot.ticket.load(memory_order_acquire);
+}
+
+uint64_t ShmFrameReader::waitForFrame(uint32_t frame_id,
+                                      uint64_t min_ticket,
+                                      uint64_t timeout) const
+{
+    using namespace chrono;
+
+    auto deadline = steady_clock::time_point::max();
+    if (timeout != UINT64_MAX) {
+        // Clamped so the deadline can't overflow
+        deadline = steady_clock::now() + nanoseconds(
+            static_cast<int64_t>(min<uint64_t>(timeout, INT64_MAX / 2)));
+    }
+
+    while (true) {
+        // Read before the ticket, so a publish in between makes the
+        // futex wait return immediately
+        uint32_t publish_count =
+            header_->publishCount.load(memory_order_acquire);
+
+        uint64_t ticket = getReadyTicket(frame_id);
+        if (ticket != 0 && ticket >= min_ticket) {
+            return ticket;
+        }
+
+        if (deadline == steady_clock::time_point::max()) {
+            futexWait(header_->publishCount, publish_count, nullptr);
+            continue;
+        }
+
+        auto remaining = deadline - steady_clock::now();
+        if (remaining <= nanoseconds::zero()) {
+            return 0;
+        }
+
+        auto remaining_ns = duration_cast<nanoseconds>(remaining).count();
+        timespec wait_time {
+            static_cast<time_t>(remaining_ns / 1000000000),
+            static_cast<long>(remaining_ns % 1000000000)
+        };
+
+        futexWait(header_->publishCount, publish_count, &wait_time);
+    }
+}
+
+bool ShmFrameReader::isStillReady(uint32_t frame_id, uint64_t ticket) const
+{
+    // Orders the caller's reads of the frame before the recheck
+    atomic_thread_fence(memory_order_acquire);
+
+    return getReadyTicket(frame_id) == ticket;
+}
+
+}
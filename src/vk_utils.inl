@@ -134,6 +134,25 @@ VkSemaphore makeBinaryExternalSemaphore(const DeviceState &dev)
     return sema;
 }
 
+VkSemaphore makeTimelineSemaphore(const DeviceState &dev)
+{
+    VkSemaphoreTypeCreateInfo type_info;
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.pNext = nullptr;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo sema_info;
+    sema_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    sema_info.pNext = &type_info;
+    sema_info.flags = 0;
+
+    VkSemaphore sema;
+    REQ_VK(dev.dt.createSemaphore(dev.hdl, &sema_info, nullptr, &sema));
+
+    return sema;
+}
+
 VkFence makeFence(const DeviceState &dev, bool pre_signal)
 {
     VkFenceCreateInfo fence_info;
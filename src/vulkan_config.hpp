@@ -11,6 +11,15 @@ constexpr float gfx_priority = 1.0;
 constexpr float compute_priority = 1.0;
 constexpr float transfer_priority = 1.0;
 constexpr uint32_t descriptor_pool_size = 10;
+constexpr uint64_t default_geometry_block_bytes = 64ull << 20;
+constexpr uint64_t default_loader_staging_bytes = 128ull << 20;
+
+// Sizes of the blocks MemoryAllocator sub-allocates from, powers of two.
+// Resources over a quarter of a block get their own allocation.
+constexpr uint64_t staging_memory_block_bytes = 64ull << 20;
+constexpr uint64_t host_memory_block_bytes = 16ull << 20;
+constexpr uint64_t local_memory_block_bytes = 64ull << 20;
+constexpr uint64_t texture_memory_block_bytes = 128ull << 20;
 
 }
 
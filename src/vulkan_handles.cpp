@@ -5,6 +5,7 @@
 #include "vk_utils.hpp"
 
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <optional>
 #include <vector>
@@ -182,6 +183,7 @@ DeviceState InstanceState::makeDevice(
         uint32_t desired_gfx_queues,
         uint32_t desired_compute_queues,
         uint32_t desired_transfer_queues,
+        const DeviceFeatures &optional_features,
         add_pointer_t<VkBool32(VkInstance,
                                VkPhysicalDevice,
                                uint32_t)> present_check) const
@@ -200,11 +202,76 @@ DeviceState InstanceState::makeDevice(
 
     VkPhysicalDevice phy = findPhysicalDevice(uuid);
 
+    // Optional, rendering into caller memory falls back to staging
+    // copies without it
+    bool host_memory_import = false;
+    bool viewport_index_layer = false;
+    {
+        uint32_t num_exts;
+        REQ_VK(dt.enumerateDeviceExtensionProperties(phy, nullptr,
+                                                     &num_exts, nullptr));
+
+        DynArray<VkExtensionProperties> exts(num_exts);
+        REQ_VK(dt.enumerateDeviceExtensionProperties(phy, nullptr,
+                                                     &num_exts, exts.data()));
+
+        for (const VkExtensionProperties &ext : exts) {
+            if (!strcmp(ext.extensionName,
+                        VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+                host_memory_import = true;
+                extensions.push_back(
+                    VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+            } else if (!strcmp(ext.extensionName,
+                    VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME)) {
+                viewport_index_layer = true;
+            }
+        }
+    }
+
+    if (optional_features.viewportIndexLayer) {
+        if (!viewport_index_layer) {
+            cerr << "GPU does not support " <<
+                VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME <<
+                ", which RenderOptions::LayeredOutput needs" << endl;
+            fatalExit();
+        }
+
+        extensions.push_back(
+            VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME);
+    }
+
+    VkPhysicalDeviceVulkan12Features vk12_feats {};
+    vk12_feats.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
     VkPhysicalDeviceFeatures2 feats;
     feats.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
-    feats.pNext = nullptr;
+    feats.pNext = &vk12_feats;
     dt.getPhysicalDeviceFeatures2(phy, &feats);
 
+    // Indirect batches are drawn with one multi draw, and instances are
+    // found through firstInstance
+    if (optional_features.multiDrawIndirect &&
+        (!feats.features.multiDrawIndirect ||
+         !feats.features.drawIndirectFirstInstance)) {
+        cerr << "GPU does not support multiDrawIndirect and " <<
+            "drawIndirectFirstInstance, which RenderOptions::IndirectDraw " <<
+            "and RenderOptions::GpuCulling need" << endl;
+        fatalExit();
+    }
+
+    // Culled batches take their draw counts from the culling pass
+    if (optional_features.drawIndirectCount &&
+        !vk12_feats.drawIndirectCount) {
+        cerr << "GPU does not support drawIndirectCount, which " <<
+            "RenderOptions::GpuCulling needs" << endl;
+        fatalExit();
+    }
+
+    // Optional, only pipelines with textures need them
+    bool texture_update_after_bind =
+        vk12_feats.descriptorBindingSampledImageUpdateAfterBind &&
+        vk12_feats.descriptorBindingUpdateUnusedWhilePending;
+
     uint32_t num_queue_families;
     dt.getPhysicalDeviceQueueFamilyProperties2(phy, &num_queue_families,
                                                   nullptr);
@@ -293,18 +360,28 @@ DeviceState InstanceState::makeDevice(
 
     dev_create_info.pEnabledFeatures = nullptr;
 
-    VkPhysicalDeviceDescriptorIndexingFeatures desc_idx_features {};
-    desc_idx_features.sType =
-        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
-    desc_idx_features.runtimeDescriptorArray = true;
-    desc_idx_features.shaderStorageBufferArrayNonUniformIndexing = true;
-    desc_idx_features.shaderSampledImageArrayNonUniformIndexing = true;
-    desc_idx_features.descriptorBindingPartiallyBound = true;
+    VkPhysicalDeviceVulkan12Features vk12_features {};
+    vk12_features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vk12_features.runtimeDescriptorArray = true;
+    vk12_features.shaderStorageBufferArrayNonUniformIndexing = true;
+    vk12_features.shaderSampledImageArrayNonUniformIndexing = true;
+    vk12_features.descriptorBindingPartiallyBound = true;
+    vk12_features.descriptorBindingSampledImageUpdateAfterBind =
+        texture_update_after_bind;
+    vk12_features.descriptorBindingUpdateUnusedWhilePending =
+        texture_update_after_bind;
+    vk12_features.drawIndirectCount = optional_features.drawIndirectCount;
+    vk12_features.timelineSemaphore = true;
 
     VkPhysicalDeviceFeatures2 requested_features {};
     requested_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
-    requested_features.pNext = &desc_idx_features;
+    requested_features.pNext = &vk12_features;
     requested_features.features.samplerAnisotropy = false;
+    requested_features.features.multiDrawIndirect =
+        optional_features.multiDrawIndirect;
+    requested_features.features.drawIndirectFirstInstance =
+        optional_features.multiDrawIndirect;
     dev_create_info.pNext = &requested_features;
 
     VkDevice dev;
@@ -317,9 +394,12 @@ DeviceState InstanceState::makeDevice(
         num_gfx_queues,
         num_compute_queues,
         num_transfer_queues,
+        host_memory_import,
+        texture_update_after_bind,
+        optional_features,
         phy,
         dev,
-        DeviceDispatch(dev, need_present)
+        DeviceDispatch(dev, need_present, host_memory_import)
     };
 }
 
@@ -13,6 +13,19 @@ namespace v4r {
 
 using DeviceUUID = std::array<uint8_t, VK_UUID_SIZE>;
 
+// Device features only some RenderOptions need, which are only enabled
+// when requested
+struct DeviceFeatures {
+    // multiDrawIndirect and drawIndirectFirstInstance, for IndirectDraw
+    // and GpuCulling
+    bool multiDrawIndirect;
+    // drawIndirectCount, for GpuCulling
+    bool drawIndirectCount;
+    // VK_EXT_shader_viewport_index_layer, for LayeredOutput to write
+    // gl_Layer from the vertex shader
+    bool viewportIndexLayer;
+};
+
 struct DeviceState {
 public:
     uint32_t gfxQF;
@@ -23,6 +36,18 @@ public:
     uint32_t numComputeQueues;
     uint32_t numTransferQueues;
 
+    // VK_EXT_external_memory_host is available, so caller owned host
+    // memory can be imported
+    bool hostMemoryImport;
+
+    // descriptorBindingSampledImageUpdateAfterBind and
+    // descriptorBindingUpdateUnusedWhilePending are available, so textures
+    // can be written into the material table while streams render
+    bool textureUpdateAfterBind;
+
+    // The optional features the device was created with
+    DeviceFeatures features;
+
     const VkPhysicalDevice phy;
     const VkDevice hdl;
     const DeviceDispatch dt;
@@ -46,6 +71,7 @@ public:
                            uint32_t desired_gfx_queues,
                            uint32_t desired_compute_queues,
                            uint32_t desired_transfer_queues,
+                           const DeviceFeatures &optional_features,
                            std::add_pointer_t<
                                VkBool32(VkInstance,
                                         VkPhysicalDevice,
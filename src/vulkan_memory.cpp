@@ -1,7 +1,10 @@
 #include "vulkan_memory.hpp"
 
 #include "vk_utils.hpp"
+#include "vulkan_config.hpp"
 
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <iostream>
 
@@ -18,7 +21,10 @@ namespace BufferFlags {
         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
     static constexpr VkBufferUsageFlags hostGenericUsage =
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | shaderUsage;
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+        shaderUsage;
 
     static constexpr VkBufferUsageFlags geometryUsage =
         VK_BUFFER_USAGE_TRANSFER_DST_BIT |
@@ -26,11 +32,17 @@ namespace BufferFlags {
         VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
 
     static constexpr VkBufferUsageFlags localGenericUsage =
-        geometryUsage | shaderUsage;
+        geometryUsage | shaderUsage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
 
+    // Written by the output packing pass as a storage buffer
     static constexpr VkBufferUsageFlags dedicatedUsage =
         VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+    static constexpr VkBufferUsageFlags readbackUsage =
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 };
 
 namespace ImageFlags {
@@ -50,11 +62,13 @@ namespace ImageFlags {
 
     static constexpr VkImageUsageFlags colorAttachmentUsage = 
         VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
-        VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+        VK_IMAGE_USAGE_SAMPLED_BIT;
 
     static constexpr VkFormatFeatureFlags colorAttachmentReqs =
         VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT |
-        VK_FORMAT_FEATURE_TRANSFER_SRC_BIT;
+        VK_FORMAT_FEATURE_TRANSFER_SRC_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
 
     static constexpr VkImageUsageFlags depthAttachmentUsage = 
         VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
@@ -65,44 +79,43 @@ namespace ImageFlags {
         VK_FORMAT_FEATURE_TRANSFER_SRC_BIT;
 };
 
-template<bool host_mapped>
-void AllocDeleter<host_mapped>::operator()(VkBuffer buffer) const
+static VkDeviceSize alignOffset(VkDeviceSize offset, VkDeviceSize alignment)
 {
-    if (mem_ == VK_NULL_HANDLE) return;
-
-    const DeviceState &dev = alloc_.dev;
+    return ((offset + alignment - 1) / alignment) * alignment;
+}
 
-    if constexpr(host_mapped) {
-        dev.dt.unmapMemory(dev.hdl, mem_);
-    }
+void AllocDeleter::operator()(VkBuffer buffer) const
+{
+    if (allocation_.mem == VK_NULL_HANDLE) return;
 
-    dev.dt.freeMemory(dev.hdl, mem_, nullptr);
+    const DeviceState &dev = alloc_.dev;
 
     dev.dt.destroyBuffer(dev.hdl, buffer, nullptr);
+    alloc_.free(allocation_);
 }
 
-template<>
-void AllocDeleter<false>::operator()(VkImage image) const
+void AllocDeleter::operator()(VkImage image) const
 {
-    if (mem_ == VK_NULL_HANDLE) return;
+    if (allocation_.mem == VK_NULL_HANDLE) return;
 
     const DeviceState &dev = alloc_.dev;
 
-    dev.dt.freeMemory(dev.hdl, mem_, nullptr);
     dev.dt.destroyImage(dev.hdl, image, nullptr);
+    alloc_.free(allocation_);
 }
 
-template<bool host_mapped>
-void AllocDeleter<host_mapped>::clear()
+void AllocDeleter::clear()
 {
-    mem_ = VK_NULL_HANDLE;
+    allocation_.mem = VK_NULL_HANDLE;
 }
 
 HostBuffer::HostBuffer(VkBuffer buf, void *p,
                        VkMappedMemoryRange mem_range,
-                       AllocDeleter<true> deleter)
+                       VkDeviceSize flush_alignment,
+                       AllocDeleter deleter)
     : buffer(buf), ptr(p),
       mem_range_(mem_range),
+      flush_alignment_(flush_alignment),
       deleter_(deleter)
 {}
 
@@ -110,6 +123,7 @@ HostBuffer::HostBuffer(HostBuffer &&o)
     : buffer(o.buffer),
       ptr(o.ptr),
       mem_range_(o.mem_range_),
+      flush_alignment_(o.flush_alignment_),
       deleter_(o.deleter_)
 {
     o.deleter_.clear();
@@ -129,14 +143,34 @@ void HostBuffer::flush(const DeviceState &dev,
                        VkDeviceSize offset,
                        VkDeviceSize num_bytes)
 {
-    VkMappedMemoryRange sub_range = mem_range_;
-    sub_range.offset = offset;
-    sub_range.size = num_bytes;
+    VkMappedMemoryRange sub_range = alignedRange(offset, num_bytes);
     dev.dt.flushMappedMemoryRanges(dev.hdl, 1, &sub_range);
 }
 
+void HostBuffer::invalidate(const DeviceState &dev,
+                            VkDeviceSize offset,
+                            VkDeviceSize num_bytes) const
+{
+    VkMappedMemoryRange sub_range = alignedRange(offset, num_bytes);
+    REQ_VK(dev.dt.invalidateMappedMemoryRanges(dev.hdl, 1, &sub_range));
+}
+
+VkMappedMemoryRange HostBuffer::alignedRange(VkDeviceSize offset,
+                                             VkDeviceSize num_bytes) const
+{
+    VkDeviceSize start = (offset / flush_alignment_) * flush_alignment_;
+    VkDeviceSize end = ((offset + num_bytes + flush_alignment_ - 1) /
+        flush_alignment_) * flush_alignment_;
+
+    VkMappedMemoryRange sub_range = mem_range_;
+    sub_range.offset += start;
+    sub_range.size = min(end, mem_range_.size) - start;
+
+    return sub_range;
+}
+
 LocalBuffer::LocalBuffer(VkBuffer buf,
-                         AllocDeleter<false> deleter)
+                         AllocDeleter deleter)
     : buffer(buf),
       deleter_(deleter)
 {}
@@ -154,7 +188,7 @@ LocalBuffer::~LocalBuffer()
 }
 
 LocalImage::LocalImage(uint32_t w, uint32_t h, uint32_t mip_levels,
-                       VkImage img, AllocDeleter<false> deleter)
+                       VkImage img, AllocDeleter deleter)
     : width(w), height(h), mipLevels(mip_levels),
       image(img),
       deleter_(deleter)
@@ -224,7 +258,7 @@ pair<VkBuffer, VkMemoryRequirements> makeUnboundBuffer(const DeviceState &dev,
 
 pair<VkImage, VkMemoryRequirements> makeUnboundImage(const DeviceState &dev,
         uint32_t width, uint32_t height, uint32_t mip_levels,
-        VkFormat format, VkImageUsageFlags usage)
+        VkFormat format, VkImageUsageFlags usage, uint32_t array_layers = 1)
 {
     VkImageCreateInfo img_info;
     img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -234,7 +268,7 @@ pair<VkImage, VkMemoryRequirements> makeUnboundImage(const DeviceState &dev,
     img_info.format = format;
     img_info.extent = { width, height, 1 };
     img_info.mipLevels = mip_levels;
-    img_info.arrayLayers = 1;
+    img_info.arrayLayers = array_layers;
     img_info.samples = VK_SAMPLE_COUNT_1_BIT;
     img_info.tiling = VK_IMAGE_TILING_OPTIMAL;
     img_info.usage = usage;
@@ -354,6 +388,16 @@ static MemoryTypeIndices findTypeIndices(const DeviceState &dev,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
             dev_mem_props);
 
+    // Read by the CPU, so prefer memory that is cached on the host
+    VkMemoryRequirements readback_reqs =
+        getBufferMemReqs(dev, BufferFlags::readbackUsage);
+
+    uint32_t readback_type_idx = findMemoryTypeIndex(
+            readback_reqs.memoryTypeBits,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+            dev_mem_props);
+
     VkMemoryRequirements texture_precomp_mip_reqs =
         getImageMemReqs(dev, formats.hdrTexture,
                         ImageFlags::precomputedMipmapTextureUsage);
@@ -397,6 +441,7 @@ static MemoryTypeIndices findTypeIndices(const DeviceState &dev,
         geometry_type_idx,
         local_generic_type_idx,
         dedicated_type_idx,
+        readback_type_idx,
         texture_precomp_idx,
         texture_runtime_idx,
         color_attachment_idx,
@@ -405,18 +450,310 @@ static MemoryTypeIndices findTypeIndices(const DeviceState &dev,
 }
 
 static Alignments getMemoryAlignments(const InstanceState &inst,
-                                      VkPhysicalDevice phy)
+                                      const DeviceState &dev)
 {
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props {};
+    host_props.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+
     VkPhysicalDeviceProperties2 props {};
     props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
-    inst.dt.getPhysicalDeviceProperties2(phy, &props);
+    if (dev.hostMemoryImport) {
+        props.pNext = &host_props;
+    }
+    inst.dt.getPhysicalDeviceProperties2(dev.phy, &props);
 
     return Alignments {
         props.properties.limits.minUniformBufferOffsetAlignment,
-        props.properties.limits.minStorageBufferOffsetAlignment
+        props.properties.limits.minStorageBufferOffsetAlignment,
+        props.properties.limits.nonCoherentAtomSize,
+        host_props.minImportedHostPointerAlignment
     };
 }
 
+static uint32_t getHostCoherentTypes(const InstanceState &inst,
+                                     VkPhysicalDevice phy)
+{
+    VkPhysicalDeviceMemoryProperties2 dev_mem_props;
+    dev_mem_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    dev_mem_props.pNext = nullptr;
+    inst.dt.getPhysicalDeviceMemoryProperties2(phy, &dev_mem_props);
+
+    uint32_t type_bits = 0;
+    for (uint32_t idx = 0;
+         idx < dev_mem_props.memoryProperties.memoryTypeCount; idx++) {
+        if (dev_mem_props.memoryProperties.memoryTypes[idx].propertyFlags &
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+            type_bits |= 1 << idx;
+        }
+    }
+
+    return type_bits;
+}
+
+static uint32_t getBuddyOrder(VkDeviceSize num_bytes)
+{
+    uint32_t order = 0;
+    while ((MemoryPool::min_buddy_bytes << order) < num_bytes) {
+        order++;
+    }
+
+    return order;
+}
+
+MemoryPool::MemoryPool(const char *name, Kind kind, uint32_t type_idx,
+                       VkDeviceSize block_size, bool host_mapped)
+    : name_(name),
+      kind_(kind),
+      type_idx_(type_idx),
+      block_size_(block_size),
+      max_order_(getBuddyOrder(block_size)),
+      host_mapped_(host_mapped),
+      lock_(),
+      blocks_(),
+      num_allocations_(0),
+      allocated_bytes_(0),
+      requested_bytes_(0)
+{
+    assert((min_buddy_bytes << max_order_) == block_size_);
+}
+
+optional<MemoryAllocation> MemoryPool::allocate(const DeviceState &dev,
+                                                VkDeviceSize num_bytes,
+                                                VkDeviceSize alignment)
+{
+    // Large resources would waste most of a block
+    if (num_bytes > block_size_ / 4 || alignment > block_size_) {
+        return optional<MemoryAllocation>();
+    }
+
+    scoped_lock lock(lock_);
+
+    MemoryBlock *block = nullptr;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size;
+
+    if (kind_ == Kind::Buddy) {
+        // Buddy ranges are aligned to their own size
+        uint32_t order = getBuddyOrder(max(num_bytes, alignment));
+        size = min_buddy_bytes << order;
+
+        for (auto &cur_block : blocks_) {
+            optional<VkDeviceSize> cur_offset =
+                allocateBuddy(*cur_block, order);
+            if (cur_offset) {
+                block = cur_block.get();
+                offset = *cur_offset;
+                break;
+            }
+        }
+
+        if (!block) {
+            block = &addBlock(dev);
+            offset = *allocateBuddy(*block, order);
+        }
+    } else {
+        for (auto &cur_block : blocks_) {
+            VkDeviceSize start = alignOffset(cur_block->top, alignment);
+            if (start + num_bytes <= cur_block->size) {
+                block = cur_block.get();
+                offset = start;
+                break;
+            }
+        }
+
+        if (!block) {
+            block = &addBlock(dev);
+        }
+
+        // Alignment padding is only reclaimed when the block empties
+        size = offset + num_bytes - block->top;
+        block->top = offset + num_bytes;
+    }
+
+    block->numAllocations++;
+    num_allocations_++;
+    allocated_bytes_ += size;
+    requested_bytes_ += num_bytes;
+
+    return MemoryAllocation {
+        block->mem,
+        offset,
+        size,
+        num_bytes,
+        block->ptr ? static_cast<uint8_t *>(block->ptr) + offset : nullptr,
+        this,
+        block
+    };
+}
+
+void MemoryPool::free(const DeviceState &dev,
+                      const MemoryAllocation &allocation)
+{
+    scoped_lock lock(lock_);
+
+    MemoryBlock &block = *allocation.block;
+
+    if (kind_ == Kind::Buddy) {
+        freeBuddy(block, allocation.offset, getBuddyOrder(allocation.size));
+    }
+
+    block.numAllocations--;
+    num_allocations_--;
+    allocated_bytes_ -= allocation.size;
+    requested_bytes_ -= allocation.requestedSize;
+
+    if (block.numAllocations > 0) return;
+
+    if (kind_ == Kind::Linear) {
+        block.top = 0;
+    }
+
+    // One empty block is kept so repeated loads don't reallocate it
+    uint32_t num_empty = count_if(blocks_.begin(), blocks_.end(),
+        [](const auto &cur_block) {
+            return cur_block->numAllocations == 0;
+        });
+
+    if (num_empty > 1) {
+        freeBlock(dev, block);
+    }
+}
+
+void MemoryPool::clear(const DeviceState &dev)
+{
+    scoped_lock lock(lock_);
+
+    while (!blocks_.empty()) {
+        assert(blocks_.back()->numAllocations == 0);
+        freeBlock(dev, *blocks_.back());
+    }
+}
+
+MemoryPoolStats MemoryPool::getStats() const
+{
+    scoped_lock lock(lock_);
+
+    VkDeviceSize largest_free = 0;
+    for (const auto &block : blocks_) {
+        if (kind_ == Kind::Buddy) {
+            for (uint32_t order = max_order_ + 1; order > 0; order--) {
+                if (!block->freeLists[order - 1].empty()) {
+                    largest_free = max(largest_free,
+                                       min_buddy_bytes << (order - 1));
+                    break;
+                }
+            }
+        } else {
+            largest_free = max(largest_free, block->size - block->top);
+        }
+    }
+
+    return MemoryPoolStats {
+        name_,
+        static_cast<uint32_t>(blocks_.size()),
+        num_allocations_,
+        blocks_.size() * block_size_,
+        allocated_bytes_,
+        requested_bytes_,
+        largest_free
+    };
+}
+
+MemoryBlock &MemoryPool::addBlock(const DeviceState &dev)
+{
+    VkMemoryAllocateInfo alloc;
+    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc.pNext = nullptr;
+    alloc.allocationSize = block_size_;
+    alloc.memoryTypeIndex = type_idx_;
+
+    VkDeviceMemory memory;
+    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
+
+    // Mapped once for the block's lifetime, memory can't be mapped twice
+    void *mapped_ptr = nullptr;
+    if (host_mapped_) {
+        REQ_VK(dev.dt.mapMemory(dev.hdl, memory, 0, VK_WHOLE_SIZE, 0,
+                                &mapped_ptr));
+    }
+
+    blocks_.emplace_back(new MemoryBlock {
+        memory,
+        mapped_ptr,
+        block_size_,
+        0,
+        {},
+        0
+    });
+
+    MemoryBlock &block = *blocks_.back();
+    if (kind_ == Kind::Buddy) {
+        block.freeLists.resize(max_order_ + 1);
+        block.freeLists[max_order_].insert(0);
+    }
+
+    return block;
+}
+
+void MemoryPool::freeBlock(const DeviceState &dev, MemoryBlock &block)
+{
+    if (block.ptr) {
+        dev.dt.unmapMemory(dev.hdl, block.mem);
+    }
+    dev.dt.freeMemory(dev.hdl, block.mem, nullptr);
+
+    blocks_.erase(find_if(blocks_.begin(), blocks_.end(),
+        [&block](const auto &cur_block) {
+            return cur_block.get() == &block;
+        }));
+}
+
+optional<VkDeviceSize> MemoryPool::allocateBuddy(MemoryBlock &block,
+                                                 uint32_t order)
+{
+    uint32_t cur_order = order;
+    while (cur_order <= max_order_ && block.freeLists[cur_order].empty()) {
+        cur_order++;
+    }
+
+    if (cur_order > max_order_) {
+        return optional<VkDeviceSize>();
+    }
+
+    auto &free_list = block.freeLists[cur_order];
+    VkDeviceSize offset = *free_list.begin();
+    free_list.erase(free_list.begin());
+
+    // Split down to the requested order, freeing the upper halves
+    while (cur_order > order) {
+        cur_order--;
+        block.freeLists[cur_order].insert(
+            offset + (min_buddy_bytes << cur_order));
+    }
+
+    return offset;
+}
+
+void MemoryPool::freeBuddy(MemoryBlock &block, VkDeviceSize offset,
+                           uint32_t order)
+{
+    // Merge with free buddies as far up as possible
+    while (order < max_order_) {
+        VkDeviceSize buddy = offset ^ (min_buddy_bytes << order);
+        auto &free_list = block.freeLists[order];
+
+        auto iter = free_list.find(buddy);
+        if (iter == free_list.end()) break;
+
+        free_list.erase(iter);
+        offset = min(offset, buddy);
+        order++;
+    }
+
+    block.freeLists[order].insert(offset);
+}
+
 MemoryAllocator::MemoryAllocator(const DeviceState &d,
                                  const InstanceState &inst)
     : dev(d),
@@ -439,88 +776,206 @@ MemoryAllocator::MemoryAllocator(const DeviceState &d,
                        array { VK_FORMAT_R32_SFLOAT })
       },
       type_indices_(findTypeIndices(dev, inst, formats_)),
-      alignments_(getMemoryAlignments(inst, dev.phy))
+      alignments_(getMemoryAlignments(inst, dev)),
+      host_coherent_types_(getHostCoherentTypes(inst, dev.phy)),
+      staging_pool_(new MemoryPool("staging", MemoryPool::Kind::Linear,
+          type_indices_.stageBuffer,
+          VulkanConfig::staging_memory_block_bytes, true)),
+      shader_pool_(new MemoryPool("shader", MemoryPool::Kind::Buddy,
+          type_indices_.shaderBuffer,
+          VulkanConfig::host_memory_block_bytes, true)),
+      host_pool_(new MemoryPool("host", MemoryPool::Kind::Buddy,
+          type_indices_.hostGenericBuffer,
+          VulkanConfig::host_memory_block_bytes, true)),
+      geometry_pool_(new MemoryPool("geometry", MemoryPool::Kind::Buddy,
+          type_indices_.localGeometryBuffer,
+          VulkanConfig::local_memory_block_bytes, false)),
+      local_pool_(new MemoryPool("local", MemoryPool::Kind::Buddy,
+          type_indices_.localGenericBuffer,
+          VulkanConfig::local_memory_block_bytes, false)),
+      precomputed_texture_pool_(new MemoryPool("precomputed texture",
+          MemoryPool::Kind::Buddy,
+          type_indices_.precomputedMipmapTexture,
+          VulkanConfig::texture_memory_block_bytes, false)),
+      runtime_texture_pool_(new MemoryPool("runtime texture",
+          MemoryPool::Kind::Buddy,
+          type_indices_.runtimeMipmapTexture,
+          VulkanConfig::texture_memory_block_bytes, false)),
+      dedicated_lock_(),
+      num_dedicated_(0),
+      dedicated_bytes_(0)
 {}
 
-HostBuffer MemoryAllocator::makeHostBuffer(VkDeviceSize num_bytes,
-                                           VkBufferUsageFlags usage,
-                                           uint32_t mem_idx)
+MemoryAllocator::~MemoryAllocator()
 {
-    auto [buffer, reqs] = makeUnboundBuffer(dev, num_bytes, usage);
+    staging_pool_->clear(dev);
+    shader_pool_->clear(dev);
+    host_pool_->clear(dev);
+    geometry_pool_->clear(dev);
+    local_pool_->clear(dev);
+    precomputed_texture_pool_->clear(dev);
+    runtime_texture_pool_->clear(dev);
+}
+
+MemoryAllocation MemoryAllocator::allocate(MemoryPool *pool,
+                                           const VkMemoryRequirements &reqs,
+                                           uint32_t type_idx,
+                                           bool host_mapped)
+{
+    VkDeviceSize num_bytes = reqs.size;
+    VkDeviceSize alignment = reqs.alignment;
+    if (host_mapped) {
+        // Flushes and invalidates cover whole atoms
+        num_bytes = alignOffset(num_bytes, alignments_.nonCoherentAtom);
+        alignment = max(alignment, alignments_.nonCoherentAtom);
+    }
+
+    if (pool) {
+        optional<MemoryAllocation> sub_alloc =
+            pool->allocate(dev, num_bytes, alignment);
+
+        if (sub_alloc) {
+            return *sub_alloc;
+        }
+    }
 
     VkMemoryAllocateInfo alloc;
     alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
     alloc.pNext = nullptr;
-    alloc.allocationSize = reqs.size;
-    alloc.memoryTypeIndex = mem_idx;
+    alloc.allocationSize = num_bytes;
+    alloc.memoryTypeIndex = type_idx;
+
+    return allocateDedicated(alloc, host_mapped);
+}
 
+MemoryAllocation MemoryAllocator::allocateDedicated(
+        const VkMemoryAllocateInfo &info,
+        bool host_mapped)
+{
     VkDeviceMemory memory;
-    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
-    REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, memory, 0));
+    REQ_VK(dev.dt.allocateMemory(dev.hdl, &info, nullptr, &memory));
 
-    void *mapped_ptr;
-    REQ_VK(dev.dt.mapMemory(dev.hdl, memory, 0, num_bytes, 0, &mapped_ptr));
+    void *mapped_ptr = nullptr;
+    if (host_mapped) {
+        REQ_VK(dev.dt.mapMemory(dev.hdl, memory, 0, VK_WHOLE_SIZE, 0,
+                                &mapped_ptr));
+    }
+
+    return trackDedicated(memory, info.allocationSize, mapped_ptr);
+}
+
+MemoryAllocation MemoryAllocator::trackDedicated(VkDeviceMemory mem,
+                                                 VkDeviceSize num_bytes,
+                                                 void *ptr)
+{
+    scoped_lock lock(dedicated_lock_);
+    num_dedicated_++;
+    dedicated_bytes_ += num_bytes;
+
+    return MemoryAllocation {
+        mem,
+        0,
+        num_bytes,
+        num_bytes,
+        ptr,
+        nullptr,
+        nullptr
+    };
+}
+
+void MemoryAllocator::free(const MemoryAllocation &allocation)
+{
+    if (allocation.pool) {
+        allocation.pool->free(dev, allocation);
+        return;
+    }
+
+    if (allocation.ptr) {
+        dev.dt.unmapMemory(dev.hdl, allocation.mem);
+    }
+    dev.dt.freeMemory(dev.hdl, allocation.mem, nullptr);
+
+    scoped_lock lock(dedicated_lock_);
+    num_dedicated_--;
+    dedicated_bytes_ -= allocation.size;
+}
+
+HostBuffer MemoryAllocator::makeHostBuffer(VkDeviceSize num_bytes,
+                                           VkBufferUsageFlags usage,
+                                           uint32_t mem_idx,
+                                           MemoryPool *pool)
+{
+    auto [buffer, reqs] = makeUnboundBuffer(dev, num_bytes, usage);
+
+    MemoryAllocation allocation = allocate(pool, reqs, mem_idx, true);
+    REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, allocation.mem,
+                                   allocation.offset));
 
     VkMappedMemoryRange range;
     range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
     range.pNext = nullptr;
-    range.memory = memory,
-    range.offset = 0;
-    range.size = VK_WHOLE_SIZE;
+    range.memory = allocation.mem,
+    range.offset = allocation.offset;
+    range.size = allocation.requestedSize;
 
-    return HostBuffer(buffer, mapped_ptr, range,
-                      AllocDeleter<true>(memory, *this));
+    return HostBuffer(buffer, allocation.ptr, range,
+                      alignments_.nonCoherentAtom,
+                      AllocDeleter(allocation, *this));
 }
 
 
 HostBuffer MemoryAllocator::makeStagingBuffer(VkDeviceSize num_bytes)
 {
     return makeHostBuffer(num_bytes, BufferFlags::stageUsage,
-                          type_indices_.stageBuffer);
+                          type_indices_.stageBuffer, staging_pool_.get());
 }
 
 HostBuffer MemoryAllocator::makeShaderBuffer(VkDeviceSize num_bytes)
 {
     return makeHostBuffer(num_bytes, BufferFlags::shaderUsage, 
-                          type_indices_.shaderBuffer);
+                          type_indices_.shaderBuffer, shader_pool_.get());
 }
 
 HostBuffer MemoryAllocator::makeHostBuffer(VkDeviceSize num_bytes)
 {
     return makeHostBuffer(num_bytes, BufferFlags::hostGenericUsage,
-                          type_indices_.hostGenericBuffer);
+                          type_indices_.hostGenericBuffer, host_pool_.get());
+}
+
+// Readback buffers hold whole batches of outputs, so aren't pooled
+HostBuffer MemoryAllocator::makeReadbackBuffer(VkDeviceSize num_bytes)
+{
+    return makeHostBuffer(num_bytes, BufferFlags::readbackUsage,
+                          type_indices_.readbackBuffer, nullptr);
 }
 
 LocalBuffer MemoryAllocator::makeLocalBuffer(VkDeviceSize num_bytes,
                                              VkBufferUsageFlags usage,
-                                             uint32_t mem_idx)
+                                             uint32_t mem_idx,
+                                             MemoryPool *pool)
 {
     auto [buffer, reqs] = makeUnboundBuffer(dev, num_bytes,
                                             usage);
 
-    VkMemoryAllocateInfo alloc;
-    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc.pNext = nullptr;
-    alloc.allocationSize = reqs.size;
-    alloc.memoryTypeIndex = mem_idx;
+    MemoryAllocation allocation = allocate(pool, reqs, mem_idx, false);
+    REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, allocation.mem,
+                                   allocation.offset));
 
-    VkDeviceMemory memory;
-    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
-    REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, memory, 0));
-
-    return LocalBuffer(buffer, AllocDeleter<false>(memory, *this));
+    return LocalBuffer(buffer, AllocDeleter(allocation, *this));
 }
 
 LocalBuffer MemoryAllocator::makeLocalBuffer(VkDeviceSize num_bytes)
 {
     return makeLocalBuffer(num_bytes, BufferFlags::localGenericUsage,
-                           type_indices_.localGenericBuffer);
+                           type_indices_.localGenericBuffer,
+                           local_pool_.get());
 }
 
 LocalBuffer MemoryAllocator::makeGeometryBuffer(VkDeviceSize num_bytes)
 {
     return makeLocalBuffer(num_bytes, BufferFlags::geometryUsage,
-                           type_indices_.localGeometryBuffer);
+                           type_indices_.localGeometryBuffer,
+                           geometry_pool_.get());
 }
 
 pair<LocalBuffer, VkDeviceMemory> MemoryAllocator::makeDedicatedBuffer(
@@ -540,12 +995,89 @@ pair<LocalBuffer, VkDeviceMemory> MemoryAllocator::makeDedicatedBuffer(
     alloc.allocationSize = reqs.size;
     alloc.memoryTypeIndex = type_indices_.dedicatedBuffer;
 
+    MemoryAllocation allocation = allocateDedicated(alloc, false);
+    REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, allocation.mem, 0));
+
+    return pair(LocalBuffer(buffer, AllocDeleter(allocation, *this)),
+                allocation.mem);
+}
+
+optional<LocalBuffer> MemoryAllocator::importHostBuffer(void *ptr,
+        VkDeviceSize num_bytes)
+{
+    VkDeviceSize alignment = alignments_.importedHostPointer;
+    if (alignment == 0 || num_bytes == 0 ||
+        reinterpret_cast<uintptr_t>(ptr) % alignment != 0 ||
+        num_bytes % alignment != 0) {
+        return optional<LocalBuffer>();
+    }
+
+    VkMemoryHostPointerPropertiesEXT host_props;
+    host_props.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    host_props.pNext = nullptr;
+    VkResult res = dev.dt.getMemoryHostPointerPropertiesEXT(dev.hdl,
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+        ptr, &host_props);
+    if (res != VK_SUCCESS) {
+        return optional<LocalBuffer>();
+    }
+
+    VkExternalMemoryBufferCreateInfo ext_info;
+    ext_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    ext_info.pNext = nullptr;
+    ext_info.handleTypes =
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+    VkBufferCreateInfo buffer_info;
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.pNext = &ext_info;
+    buffer_info.flags = 0;
+    buffer_info.size = num_bytes;
+    buffer_info.usage = BufferFlags::readbackUsage;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer buffer;
+    REQ_VK(dev.dt.createBuffer(dev.hdl, &buffer_info, nullptr, &buffer));
+
+    VkMemoryRequirements reqs;
+    dev.dt.getBufferMemoryRequirements(dev.hdl, buffer, &reqs);
+
+    uint32_t allowed_types = reqs.memoryTypeBits &
+        host_props.memoryTypeBits & host_coherent_types_;
+    if (allowed_types == 0 || reqs.size > num_bytes) {
+        dev.dt.destroyBuffer(dev.hdl, buffer, nullptr);
+        return optional<LocalBuffer>();
+    }
+
+    uint32_t type_idx = 0;
+    while (!(allowed_types & (1 << type_idx))) {
+        type_idx++;
+    }
+
+    VkImportMemoryHostPointerInfoEXT import_info;
+    import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    import_info.pNext = nullptr;
+    import_info.handleType =
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    import_info.pHostPointer = ptr;
+
+    VkMemoryAllocateInfo alloc;
+    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc.pNext = &import_info;
+    // The import covers the whole range, not just what the buffer needs
+    alloc.allocationSize = num_bytes;
+    alloc.memoryTypeIndex = type_idx;
+
     VkDeviceMemory memory;
-    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
+    res = dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory);
+    if (res != VK_SUCCESS) {
+        dev.dt.destroyBuffer(dev.hdl, buffer, nullptr);
+        return optional<LocalBuffer>();
+    }
     REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, memory, 0));
 
-    return pair(LocalBuffer(buffer, AllocDeleter<false>(memory, *this)),
-                memory);
+    return LocalBuffer(buffer,
+        AllocDeleter(trackDedicated(memory, num_bytes, nullptr), *this));
 }
 
 LocalImage MemoryAllocator::makeTexture(uint32_t width, uint32_t height,
@@ -557,33 +1089,29 @@ LocalImage MemoryAllocator::makeTexture(uint32_t width, uint32_t height,
             precomputed_mipmaps ? ImageFlags::precomputedMipmapTextureUsage :
                 ImageFlags::runtimeMipmapTextureUsage);
 
-    VkMemoryAllocateInfo alloc;
-    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc.pNext = nullptr;
-    alloc.allocationSize = reqs.size;
-    if (precomputed_mipmaps) {
-        alloc.memoryTypeIndex = type_indices_.precomputedMipmapTexture;
-    } else {
-        alloc.memoryTypeIndex = type_indices_.runtimeMipmapTexture;
-    }
+    MemoryAllocation allocation = precomputed_mipmaps ?
+        allocate(precomputed_texture_pool_.get(), reqs,
+                 type_indices_.precomputedMipmapTexture, false) :
+        allocate(runtime_texture_pool_.get(), reqs,
+                 type_indices_.runtimeMipmapTexture, false);
 
-    VkDeviceMemory memory;
-    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
-    REQ_VK(dev.dt.bindImageMemory(dev.hdl, texture_img, memory, 0));
+    REQ_VK(dev.dt.bindImageMemory(dev.hdl, texture_img, allocation.mem,
+                                  allocation.offset));
 
     return LocalImage(width, height,
                       mip_levels, texture_img,
-                      AllocDeleter<false>(memory, *this));
+                      AllocDeleter(allocation, *this));
 }
 
 LocalImage MemoryAllocator::makeDedicatedImage(uint32_t width, uint32_t height,
                                                uint32_t mip_levels,
                                                VkFormat format,
                                                VkImageUsageFlags usage,
-                                               uint32_t type_idx)
+                                               uint32_t type_idx,
+                                               uint32_t array_layers)
 {
     auto [img, reqs] = makeUnboundImage(dev, width, height, mip_levels,
-                                        format, usage);
+                                        format, usage, array_layers);
     
     VkMemoryDedicatedAllocateInfo dedicated;
     dedicated.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
@@ -596,41 +1124,38 @@ LocalImage MemoryAllocator::makeDedicatedImage(uint32_t width, uint32_t height,
     alloc.allocationSize = reqs.size;
     alloc.memoryTypeIndex = type_idx;
 
-    VkDeviceMemory memory;
-    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
-    REQ_VK(dev.dt.bindImageMemory(dev.hdl, img, memory, 0));
+    MemoryAllocation allocation = allocateDedicated(alloc, false);
+    REQ_VK(dev.dt.bindImageMemory(dev.hdl, img, allocation.mem, 0));
 
     return LocalImage(width, height, mip_levels, img,
-                      AllocDeleter<false>(memory, *this));
+                      AllocDeleter(allocation, *this));
 }
 
 LocalImage MemoryAllocator::makeColorAttachment(uint32_t width,
-                                                uint32_t height)
+                                                uint32_t height,
+                                                uint32_t array_layers)
 {
     return makeDedicatedImage(width, height, 1, formats_.colorAttachment,
                               ImageFlags::colorAttachmentUsage,
-                              type_indices_.colorAttachment);
+                              type_indices_.colorAttachment, array_layers);
 }
 
 LocalImage MemoryAllocator::makeDepthAttachment(uint32_t width,
-                                                uint32_t height)
+                                                uint32_t height,
+                                                uint32_t array_layers)
 {
     return makeDedicatedImage(width, height, 1, formats_.depthAttachment,
                               ImageFlags::depthAttachmentUsage,
-                              type_indices_.depthAttachment);
+                              type_indices_.depthAttachment, array_layers);
 }
 
 LocalImage MemoryAllocator::makeLinearDepthAttachment(uint32_t width,
-                                                      uint32_t height)
+                                                      uint32_t height,
+                                                      uint32_t array_layers)
 {
     return makeDedicatedImage(width, height, 1, formats_.linearDepthAttachment,
                               ImageFlags::colorAttachmentUsage,
-                              type_indices_.colorAttachment);
-}
-
-static VkDeviceSize alignOffset(VkDeviceSize offset, VkDeviceSize alignment)
-{
-    return ((offset + alignment - 1) / alignment) * alignment;
+                              type_indices_.colorAttachment, array_layers);
 }
 
 VkDeviceSize MemoryAllocator::alignUniformBufferOffset(
@@ -645,4 +1170,29 @@ VkDeviceSize MemoryAllocator::alignStorageBufferOffset(
     return alignOffset(offset, alignments_.storageBuffer);
 }
 
+VkDeviceSize MemoryAllocator::getHostImportAlignment() const
+{
+    return alignments_.importedHostPointer;
+}
+
+MemoryStats MemoryAllocator::getStats() const
+{
+    MemoryStats stats;
+    for (const MemoryPool *pool : { staging_pool_.get(),
+                                    shader_pool_.get(),
+                                    host_pool_.get(),
+                                    geometry_pool_.get(),
+                                    local_pool_.get(),
+                                    precomputed_texture_pool_.get(),
+                                    runtime_texture_pool_.get() }) {
+        stats.pools.push_back(pool->getStats());
+    }
+
+    scoped_lock lock(dedicated_lock_);
+    stats.numDedicated = num_dedicated_;
+    stats.dedicatedBytes = dedicated_bytes_;
+
+    return stats;
+}
+
 }
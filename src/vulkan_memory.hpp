@@ -1,19 +1,39 @@
 #ifndef VULKAN_MEMORY_HPP_INCLUDED
 #define VULKAN_MEMORY_HPP_INCLUDED
 
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <utility>
+#include <vector>
 
 #include "vulkan_handles.hpp"
 
 namespace v4r {
 
 class MemoryAllocator;
+class MemoryPool;
+struct MemoryBlock;
+
+// A range of device memory, either part of a pool's block or a whole
+// dedicated allocation when pool is nullptr
+struct MemoryAllocation {
+    VkDeviceMemory mem;
+    VkDeviceSize offset;
+    // Bytes reserved, including rounding
+    VkDeviceSize size;
+    VkDeviceSize requestedSize;
+    // Host mapping of offset, nullptr if the memory isn't mapped
+    void *ptr;
+    MemoryPool *pool;
+    MemoryBlock *block;
+};
 
-template<bool host_mapped>
 class AllocDeleter {
 public:
-    AllocDeleter(VkDeviceMemory mem, MemoryAllocator &alloc)
-        : mem_(mem), alloc_(alloc)
+    AllocDeleter(const MemoryAllocation &allocation, MemoryAllocator &alloc)
+        : allocation_(allocation), alloc_(alloc)
     {}
 
     void operator()(VkBuffer buffer) const;
@@ -22,7 +42,7 @@ public:
     void clear();
 
 private:
-    VkDeviceMemory mem_;
+    MemoryAllocation allocation_;
 
     MemoryAllocator &alloc_;
 };
@@ -34,19 +54,32 @@ public:
     ~HostBuffer();
 
     void flush(const DeviceState &dev);
+
+    // Range is expanded to the device's nonCoherentAtomSize as needed
     void flush(const DeviceState &dev, VkDeviceSize offset,
                VkDeviceSize num_bytes);
 
+    // Makes device writes to the range visible through ptr, expanded the
+    // same way as flush
+    void invalidate(const DeviceState &dev, VkDeviceSize offset,
+                    VkDeviceSize num_bytes) const;
+
     VkBuffer buffer;
     void *ptr;
 private:
     HostBuffer(VkBuffer buf, void *p,
                VkMappedMemoryRange mem_range,
-               AllocDeleter<true> deleter);
+               VkDeviceSize flush_alignment,
+               AllocDeleter deleter);
 
+    VkMappedMemoryRange alignedRange(VkDeviceSize offset,
+                                     VkDeviceSize num_bytes) const;
+
+    // Covers whole atoms
     const VkMappedMemoryRange mem_range_;
+    const VkDeviceSize flush_alignment_;
 
-    AllocDeleter<true> deleter_;
+    AllocDeleter deleter_;
     friend class MemoryAllocator;
 };
 
@@ -58,9 +91,9 @@ public:
 
     VkBuffer buffer;
 private:
-    LocalBuffer(VkBuffer buf, AllocDeleter<false> deleter);
+    LocalBuffer(VkBuffer buf, AllocDeleter deleter);
 
-    AllocDeleter<false> deleter_;
+    AllocDeleter deleter_;
     friend class MemoryAllocator;
 };
 
@@ -76,9 +109,9 @@ public:
     VkImage image;
 private:
     LocalImage(uint32_t width, uint32_t height, uint32_t mip_levels,
-               VkImage image, AllocDeleter<false> deleter);
+               VkImage image, AllocDeleter deleter);
 
-    AllocDeleter<false> deleter_;
+    AllocDeleter deleter_;
     friend class MemoryAllocator;
 };
 
@@ -89,6 +122,7 @@ struct MemoryTypeIndices {
     uint32_t localGeometryBuffer;
     uint32_t localGenericBuffer;
     uint32_t dedicatedBuffer;
+    uint32_t readbackBuffer;
     uint32_t precomputedMipmapTexture;
     uint32_t runtimeMipmapTexture;
     uint32_t colorAttachment;
@@ -103,20 +137,111 @@ struct ResourceFormats {
     VkFormat linearDepthAttachment;
 };
 
+struct MemoryBlock {
+    VkDeviceMemory mem;
+    void *ptr;
+    VkDeviceSize size;
+    uint32_t numAllocations;
+
+    // Buddy pools: free offsets of each order, order 0 being
+    // MemoryPool::min_buddy_bytes
+    std::vector<std::set<VkDeviceSize>> freeLists;
+    // Linear pools: next free offset
+    VkDeviceSize top;
+};
+
+struct MemoryPoolStats {
+    const char *name;
+    uint32_t numBlocks;
+    uint32_t numAllocations;
+    // Bytes held in blocks, handed out (including rounding) and asked for.
+    // allocated - requested is lost to rounding, and a largest free range
+    // well below reserved - allocated means free space is fragmented.
+    VkDeviceSize reservedBytes;
+    VkDeviceSize allocatedBytes;
+    VkDeviceSize requestedBytes;
+    VkDeviceSize largestFreeRange;
+};
+
+struct MemoryStats {
+    std::vector<MemoryPoolStats> pools;
+    uint32_t numDedicated;
+    VkDeviceSize dedicatedBytes;
+};
+
+// Sub-allocates resources of one MemoryTypeIndices entry out of large
+// blocks, so loading a scene doesn't cost an allocation per resource.
+// Buddy pools suit long lived resources. Linear pools bump allocate and
+// only reuse a block once everything in it is freed, which suits
+// staging buffers that are dropped together after an upload. Resources
+// of different entries never share a block, so buffers and optimal
+// images never need bufferImageGranularity padding.
+class MemoryPool {
+public:
+    enum class Kind {
+        Buddy,
+        Linear
+    };
+
+    static constexpr VkDeviceSize min_buddy_bytes = 256;
+
+    MemoryPool(const char *name, Kind kind, uint32_t type_idx,
+               VkDeviceSize block_size, bool host_mapped);
+    MemoryPool(const MemoryPool &) = delete;
+
+    // Empty if the allocation should get its own memory instead
+    std::optional<MemoryAllocation> allocate(const DeviceState &dev,
+                                             VkDeviceSize num_bytes,
+                                             VkDeviceSize alignment);
+    void free(const DeviceState &dev, const MemoryAllocation &allocation);
+
+    // Releases every block, all allocations must have been freed
+    void clear(const DeviceState &dev);
+
+    MemoryPoolStats getStats() const;
+
+private:
+    MemoryBlock &addBlock(const DeviceState &dev);
+    void freeBlock(const DeviceState &dev, MemoryBlock &block);
+
+    std::optional<VkDeviceSize> allocateBuddy(MemoryBlock &block,
+                                              uint32_t order);
+    void freeBuddy(MemoryBlock &block, VkDeviceSize offset,
+                   uint32_t order);
+
+    const char *name_;
+    Kind kind_;
+    uint32_t type_idx_;
+    VkDeviceSize block_size_;
+    uint32_t max_order_;
+    bool host_mapped_;
+
+    mutable std::mutex lock_;
+    std::vector<std::unique_ptr<MemoryBlock>> blocks_;
+    uint32_t num_allocations_;
+    VkDeviceSize allocated_bytes_;
+    VkDeviceSize requested_bytes_;
+};
+
 struct Alignments {
     VkDeviceSize uniformBuffer;
     VkDeviceSize storageBuffer;
+    VkDeviceSize nonCoherentAtom;
+    // 0 when host memory can't be imported
+    VkDeviceSize importedHostPointer;
 };
 
 class MemoryAllocator {
 public:
     MemoryAllocator(const DeviceState &dev, const InstanceState &inst);
     MemoryAllocator(const MemoryAllocator &) = delete;
-    MemoryAllocator(MemoryAllocator &&) = default;
+    // Frees the pools' blocks, every resource must have been destroyed
+    ~MemoryAllocator();
 
     HostBuffer makeStagingBuffer(VkDeviceSize num_bytes);
     HostBuffer makeShaderBuffer(VkDeviceSize num_bytes);
     HostBuffer makeHostBuffer(VkDeviceSize num_bytes);
+    HostBuffer makeReadbackBuffer(VkDeviceSize num_bytes);
 
     LocalBuffer makeGeometryBuffer(VkDeviceSize num_bytes);
     LocalBuffer makeLocalBuffer(VkDeviceSize num_bytes);
@@ -124,38 +249,81 @@ public:
     std::pair<LocalBuffer, VkDeviceMemory> makeDedicatedBuffer(
             VkDeviceSize num_bytes);
 
+    // Wraps caller owned host memory as a transfer / storage destination.
+    // Returns nullopt if the device can't import ptr, for instance because
+    // ptr or num_bytes aren't aligned to getHostImportAlignment().
+    // The memory must outlive the returned buffer.
+    std::optional<LocalBuffer> importHostBuffer(void *ptr,
+                                                VkDeviceSize num_bytes);
+
     LocalImage makeTexture(uint32_t width, uint32_t height,
                            uint32_t mip_levels,
                            bool precomputed_mipmaps=false);
 
-    LocalImage makeColorAttachment(uint32_t width, uint32_t height);
-    LocalImage makeDepthAttachment(uint32_t width, uint32_t height);
-    LocalImage makeLinearDepthAttachment(uint32_t width, uint32_t height);
+    LocalImage makeColorAttachment(uint32_t width, uint32_t height,
+                                   uint32_t array_layers = 1);
+    LocalImage makeDepthAttachment(uint32_t width, uint32_t height,
+                                   uint32_t array_layers = 1);
+    LocalImage makeLinearDepthAttachment(uint32_t width, uint32_t height,
+                                         uint32_t array_layers = 1);
 
     const ResourceFormats &getFormats() const { return formats_; }
 
     VkDeviceSize alignUniformBufferOffset(VkDeviceSize offset) const;
     VkDeviceSize alignStorageBufferOffset(VkDeviceSize offset) const;
+    VkDeviceSize getHostImportAlignment() const;
+
+    MemoryStats getStats() const;
 
 private:
+    // Falls back to a dedicated allocation when pool is nullptr or the
+    // resource is too large for it
+    MemoryAllocation allocate(MemoryPool *pool,
+                              const VkMemoryRequirements &reqs,
+                              uint32_t type_idx,
+                              bool host_mapped);
+    MemoryAllocation allocateDedicated(const VkMemoryAllocateInfo &info,
+                                       bool host_mapped);
+    MemoryAllocation trackDedicated(VkDeviceMemory mem,
+                                    VkDeviceSize num_bytes,
+                                    void *ptr);
+    void free(const MemoryAllocation &allocation);
+
     HostBuffer makeHostBuffer(VkDeviceSize num_bytes,
                               VkBufferUsageFlags usage,
-                              uint32_t mem_idx);
+                              uint32_t mem_idx,
+                              MemoryPool *pool);
 
     LocalBuffer makeLocalBuffer(VkDeviceSize num_bytes,
                                 VkBufferUsageFlags usage,
-                                uint32_t mem_idx);
+                                uint32_t mem_idx,
+                                MemoryPool *pool);
 
     LocalImage makeDedicatedImage(uint32_t width, uint32_t height,
                                   uint32_t mip_levels, VkFormat format,
-                                  VkImageUsageFlags usage, uint32_t type_idx);
+                                  VkImageUsageFlags usage, uint32_t type_idx,
+                                  uint32_t array_layers = 1);
 
     const DeviceState &dev;
     ResourceFormats formats_;
     MemoryTypeIndices type_indices_;
     Alignments alignments_;
-
-    template<bool> friend class AllocDeleter;
+    // Imported host memory is never explicitly invalidated
+    uint32_t host_coherent_types_;
+
+    std::unique_ptr<MemoryPool> staging_pool_;
+    std::unique_ptr<MemoryPool> shader_pool_;
+    std::unique_ptr<MemoryPool> host_pool_;
+    std::unique_ptr<MemoryPool> geometry_pool_;
+    std::unique_ptr<MemoryPool> local_pool_;
+    std::unique_ptr<MemoryPool> precomputed_texture_pool_;
+    std::unique_ptr<MemoryPool> runtime_texture_pool_;
+
+    mutable std::mutex dedicated_lock_;
+    uint32_t num_dedicated_;
+    VkDeviceSize dedicated_bytes_;
+
+    friend class AllocDeleter;
 };
 
 }
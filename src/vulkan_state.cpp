@@ -5,55 +5,109 @@
 #include "vk_utils.hpp"
 #include "vulkan_config.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <optional>
 #include <tuple>
+#include <typeindex>
 #include <vector>
 
+#include <unistd.h>
+
 #include <glm/gtx/string_cast.hpp>
 
 using namespace std;
 
 namespace v4r {
 
+static uint32_t getNumColorChannels(ColorFormat fmt)
+{
+    switch (fmt) {
+        case ColorFormat::RGB8:
+        case ColorFormat::RGB16F:
+            return 3;
+        case ColorFormat::R8:
+            return 1;
+        default:
+            return 4;
+    }
+}
+
+static bool isHalfFloat(ColorFormat fmt)
+{
+    return fmt == ColorFormat::RGBA16F || fmt == ColorFormat::RGB16F;
+}
+
 template <typename PipelineType>
 FramebufferConfig PipelineImpl<PipelineType>::getFramebufferConfig(
-    uint32_t batch_size, uint32_t img_width, uint32_t img_height,
-    uint32_t num_streams, const RenderOptions &opts)
+    const RenderConfig &cfg, uint32_t num_frames_per_stream,
+    const RenderOptions &opts)
 {
     using Props = PipelineProps<PipelineType>;
     constexpr bool need_color_output = Props::needColorOutput;
     constexpr bool need_depth_output = Props::needDepthOutput;
-    const bool is_double_buffered =
-        opts & RenderOptions::DoubleBuffered;
 
-    uint32_t num_frames_per_stream =
-        is_double_buffered ?
-            2 : 1;
+    const uint32_t batch_size = cfg.batchSize;
+    const uint32_t img_width = cfg.imgWidth;
+    const uint32_t img_height = cfg.imgHeight;
 
-    uint32_t batch_fb_images_wide = ceil(sqrt(batch_size));
-    while (batch_size % batch_fb_images_wide != 0) {
-        batch_fb_images_wide++;
-    }
+    const bool layered_output = opts & RenderOptions::LayeredOutput;
+    const bool host_readback = opts & RenderOptions::HostReadback;
+
+    // The framebuffer already holds interleaved RGBA8, anything else
+    // needs the packing pass
+    const bool pack_color = need_color_output &&
+        (cfg.colorFormat != ColorFormat::RGBA8 ||
+         cfg.colorLayout != ColorLayout::HWC);
+
+    const bool pack_depth = need_depth_output &&
+        cfg.depthFormat != DepthFormat::Float32;
+
+    uint32_t num_frames = cfg.numStreams * num_frames_per_stream;
 
-    uint32_t batch_fb_images_tall = (batch_size / batch_fb_images_wide);
-    assert(batch_fb_images_wide * batch_fb_images_tall == batch_size);
+    uint32_t batch_fb_images_wide = 1;
+    uint32_t batch_fb_images_tall = 1;
+    uint32_t total_fb_layers = 1;
+
+    if (layered_output) {
+        // Every env gets its own layer, so each frame is batch_size layers
+        total_fb_layers = batch_size * num_frames;
+    } else {
+        batch_fb_images_wide = ceil(sqrt(batch_size));
+        while (batch_size % batch_fb_images_wide != 0) {
+            batch_fb_images_wide++;
+        }
+
+        batch_fb_images_tall = (batch_size / batch_fb_images_wide);
+        assert(batch_fb_images_wide * batch_fb_images_tall == batch_size);
+    }
 
     uint32_t frame_fb_width = img_width * batch_fb_images_wide;
     uint32_t frame_fb_height = img_height * batch_fb_images_tall;
 
-    uint32_t total_fb_width = frame_fb_width * num_streams *
-        num_frames_per_stream;
+    uint32_t total_fb_width = layered_output ? frame_fb_width :
+        frame_fb_width * num_frames;
     uint32_t total_fb_height = frame_fb_height;
+
+    uint64_t frame_pixels = uint64_t(img_width) * img_height * batch_size;
     
     vector<VkClearValue> clear_vals;
 
     uint64_t frame_color_bytes = 0;
     if constexpr (need_color_output) {
-        frame_color_bytes = 
-            4 * sizeof(uint8_t) * frame_fb_width * frame_fb_height;
+        uint32_t channel_bytes =
+            isHalfFloat(cfg.colorFormat) ? sizeof(uint16_t) : sizeof(uint8_t);
+
+        frame_color_bytes = getNumColorChannels(cfg.colorFormat) *
+            channel_bytes * frame_pixels;
+
+        // The packing pass writes whole words, and depth follows color
+        frame_color_bytes = (frame_color_bytes + 3) & ~uint64_t(3);
 
         VkClearValue clear_val;
         clear_val.color = {{ 0.f, 0.f, 0.f, 1.f }};
@@ -63,8 +117,10 @@ FramebufferConfig PipelineImpl<PipelineType>::getFramebufferConfig(
 
     uint64_t frame_depth_bytes = 0;
     if constexpr (need_depth_output) {
-        frame_depth_bytes =
-            sizeof(float) * frame_fb_width * frame_fb_height;
+        frame_depth_bytes = (cfg.depthFormat == DepthFormat::Float32 ?
+            sizeof(float) : sizeof(uint16_t)) * frame_pixels;
+
+        frame_depth_bytes = (frame_depth_bytes + 3) & ~uint64_t(3);
 
         VkClearValue clear_val;
         clear_val.color = {{ 0.f, 0.f, 0.f, 0.f }};
@@ -90,12 +146,22 @@ FramebufferConfig PipelineImpl<PipelineType>::getFramebufferConfig(
         frame_fb_height,
         total_fb_width,
         total_fb_height,
+        total_fb_layers,
+        layered_output ? batch_size : 1,
         frame_color_bytes,
         frame_depth_bytes,
         frame_linear_bytes,
-        frame_linear_bytes * num_streams * num_frames_per_stream,
+        frame_linear_bytes * num_frames,
         need_color_output,
         need_depth_output,
+        layered_output,
+        host_readback,
+        cfg.colorFormat,
+        cfg.colorLayout,
+        pack_color,
+        cfg.depthFormat,
+        min(cfg.maxDepth, 65.535f),
+        pack_depth,
         move(clear_vals)
     };
 }
@@ -219,8 +285,8 @@ static VkSampler makeImmutableSampler(const DeviceState &dev)
 }
 
 static ParamBufferConfig computeParamBufferConfig(
-        bool need_materials, bool need_lighting,
-        uint32_t batch_size, const MemoryAllocator &alloc)
+        bool need_materials, bool need_lighting, bool need_draws,
+        bool need_culling, uint32_t batch_size, const MemoryAllocator &alloc)
 {
     ParamBufferConfig cfg {};
 
@@ -230,7 +296,8 @@ static ParamBufferConfig computeParamBufferConfig(
     VkDeviceSize cur_offset = cfg.totalTransformBytes;
 
     if (need_materials) {
-        cfg.materialIndicesOffset = cur_offset;
+        // Also bound as a storage buffer by the culling pass
+        cfg.materialIndicesOffset = alloc.alignStorageBufferOffset(cur_offset);
 
         cfg.totalMaterialIndexBytes = sizeof(uint32_t) *
             VulkanConfig::max_instances;
@@ -245,13 +312,45 @@ static ParamBufferConfig computeParamBufferConfig(
     cur_offset = cfg.viewOffset + cfg.totalViewBytes;
 
     if (need_lighting) {
-        cfg.lightsOffset = alloc.alignUniformBufferOffset(cur_offset);
-        cfg.totalLightParamBytes = sizeof(LightProperties) *
-            VulkanConfig::max_lights + sizeof(uint32_t);
+        cfg.lightsOffset = alloc.alignStorageBufferOffset(cur_offset);
+        cfg.lightIndicesOffset = cfg.lightsOffset +
+            sizeof(LightProperties) * VulkanConfig::max_lights;
+        cfg.lightTilesOffset = cfg.lightIndicesOffset +
+            sizeof(uint32_t) * VulkanConfig::max_light_indices;
+        cfg.totalLightParamBytes = cfg.lightTilesOffset - cfg.lightsOffset +
+            sizeof(LightTile) * VulkanConfig::light_tiles_per_env * batch_size;
 
         cur_offset = cfg.lightsOffset + cfg.totalLightParamBytes;
     }
 
+    if (need_draws) {
+        cfg.drawOffset = alloc.alignStorageBufferOffset(cur_offset);
+        cfg.totalDrawBytes = sizeof(VkDrawIndexedIndirectCommand) *
+            VulkanConfig::max_draws;
+
+        cur_offset = cfg.drawOffset + cfg.totalDrawBytes;
+    }
+
+    if (need_culling) {
+        VkDeviceSize cull_start = alloc.alignStorageBufferOffset(cur_offset);
+
+        cfg.cullInfoOffset = cull_start;
+        cur_offset = cfg.cullInfoOffset + sizeof(CullingInfo);
+
+        cfg.drawCountOffset = cur_offset;
+        cur_offset = cfg.drawCountOffset + sizeof(uint32_t) * batch_size;
+
+        cfg.drawCullOffset = alloc.alignStorageBufferOffset(cur_offset);
+        cur_offset = cfg.drawCullOffset +
+            sizeof(DrawCullInfo) * VulkanConfig::max_draws;
+
+        cfg.instanceDrawOffset = alloc.alignStorageBufferOffset(cur_offset);
+        cur_offset = cfg.instanceDrawOffset +
+            sizeof(uint32_t) * VulkanConfig::max_instances;
+
+        cfg.totalCullBytes = cur_offset - cull_start;
+    }
+
     // Ensure that full block is aligned to maximum requirement
     cfg.totalParamBytes = alloc.alignStorageBufferOffset(
         alloc.alignUniformBufferOffset(cur_offset));
@@ -259,16 +358,78 @@ static ParamBufferConfig computeParamBufferConfig(
     return  cfg;
 }
 
+static CullBufferConfig computeCullBufferConfig(
+        bool need_materials, const MemoryAllocator &alloc)
+{
+    CullBufferConfig cfg {};
+
+    cfg.transformOffset = 0;
+    VkDeviceSize cur_offset = sizeof(glm::mat4x3) *
+        VulkanConfig::max_instances;
+
+    if (need_materials) {
+        cfg.materialOffset = alloc.alignStorageBufferOffset(cur_offset);
+        cur_offset = cfg.materialOffset +
+            sizeof(uint32_t) * VulkanConfig::max_instances;
+    }
+
+    cfg.drawOffset = alloc.alignStorageBufferOffset(cur_offset);
+    cur_offset = cfg.drawOffset +
+        sizeof(VkDrawIndexedIndirectCommand) * VulkanConfig::max_draws;
+
+    cfg.totalBytes = alloc.alignStorageBufferOffset(cur_offset);
+
+    return cfg;
+}
+
+// Bindings 5 and 8 (material indices) are only written for pipelines
+// with materials
+using CullLayout = DescriptorLayout<
+    BindingConfig<0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT,
+                  VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT>,
+    BindingConfig<6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT,
+                  VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT>
+>;
+
+using PackLayout = DescriptorLayout<
+    BindingConfig<0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>,
+    BindingConfig<1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                  VK_SHADER_STAGE_COMPUTE_BIT>
+>;
+
 template <typename PipelineType>
 RenderState PipelineImpl<PipelineType>::makeRenderState(
-        const DeviceState &dev, uint32_t batch_size,
-        uint32_t num_streams, const RenderOptions &opts,
-        MemoryAllocator &alloc)
+        const DeviceState &dev, const FramebufferConfig &fb_cfg,
+        uint32_t batch_size,
+        uint32_t num_streams, uint32_t num_frames_per_stream,
+        const RenderOptions &opts, MemoryAllocator &alloc)
 {
     using Props = PipelineProps<PipelineType>;
 
+    const bool gpu_culling = opts & RenderOptions::GpuCulling;
+    const bool indirect_draw =
+        gpu_culling || (opts & RenderOptions::IndirectDraw);
+
     ParamBufferConfig param_positions = computeParamBufferConfig(
-            Props::needMaterial, Props::needLighting, batch_size, alloc);
+            Props::needMaterial, Props::needLighting,
+            indirect_draw, gpu_culling, batch_size, alloc);
 
     using FrameLayout = typename Props::PerFrameLayout;
     array<VkSampler *, FrameLayout::NumBindings> frame_layout_args;
@@ -278,11 +439,42 @@ RenderState PipelineImpl<PipelineType>::makeRenderState(
         return FrameLayout::makeSetLayout(dev, args...);
     }, frame_layout_args);
 
-    const uint32_t frames_per_stream =
-        (opts & RenderOptions::DoubleBuffered) ? 2 : 1;
-
     VkDescriptorPool frame_descriptor_pool = FrameLayout::makePool(
-            dev, num_streams * frames_per_stream);
+            dev, num_streams * num_frames_per_stream);
+
+    CullBufferConfig cull_positions {};
+    VkDescriptorSetLayout cull_descriptor_layout = VK_NULL_HANDLE;
+    VkDescriptorPool cull_descriptor_pool = VK_NULL_HANDLE;
+
+    if (gpu_culling) {
+        cull_positions = computeCullBufferConfig(Props::needMaterial, alloc);
+
+        array<VkSampler *, CullLayout::NumBindings> cull_layout_args;
+        cull_layout_args.fill(nullptr);
+
+        cull_descriptor_layout = apply([&](auto ...args) {
+            return CullLayout::makeSetLayout(dev, args...);
+        }, cull_layout_args);
+
+        cull_descriptor_pool = CullLayout::makePool(
+                dev, num_streams * num_frames_per_stream);
+    }
+
+    // Every frame is packed through one set per attachment, with its
+    // position in the framebuffer and result buffer passed as push
+    // constants
+    VkDescriptorSetLayout pack_descriptor_layout = VK_NULL_HANDLE;
+    VkDescriptorPool pack_descriptor_pool = VK_NULL_HANDLE;
+    VkSampler pack_sampler = VK_NULL_HANDLE;
+
+    if (fb_cfg.packColor || fb_cfg.packDepth) {
+        pack_sampler = makeImmutableSampler(dev);
+
+        pack_descriptor_layout =
+            PackLayout::makeSetLayout(dev, &pack_sampler, nullptr);
+
+        pack_descriptor_pool = PackLayout::makePool(dev, 2);
+    }
 
     VkSampler texture_sampler = VK_NULL_HANDLE;
     VkDescriptorSetLayout scene_descriptor_layout = VK_NULL_HANDLE;
@@ -309,8 +501,14 @@ RenderState PipelineImpl<PipelineType>::makeRenderState(
 
     return {
         param_positions,
+        cull_positions,
         frame_descriptor_layout,
         frame_descriptor_pool,
+        cull_descriptor_layout,
+        cull_descriptor_pool,
+        pack_descriptor_layout,
+        pack_descriptor_pool,
+        pack_sampler,
         scene_descriptor_layout,
         make_scene_pool,
         texture_sampler,
@@ -320,90 +518,232 @@ RenderState PipelineImpl<PipelineType>::makeRenderState(
     };
 }
 
-static FramebufferState makeFramebuffer(const DeviceState &dev,
+static void checkFramebufferLimits(const InstanceState &inst,
+                                   const DeviceState &dev,
+                                   const FramebufferConfig &fb_cfg)
+{
+    VkPhysicalDeviceProperties2 props {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    inst.dt.getPhysicalDeviceProperties2(dev.phy, &props);
+    const VkPhysicalDeviceLimits &limits = props.properties.limits;
+
+    if (fb_cfg.totalWidth > limits.maxFramebufferWidth ||
+        fb_cfg.totalHeight > limits.maxFramebufferHeight) {
+        cerr << "Framebuffer (" << fb_cfg.totalWidth << "x" <<
+            fb_cfg.totalHeight << ") exceeds device limits, " <<
+            "try RenderOptions::LayeredOutput" << endl;
+        fatalExit();
+    }
+
+    if (fb_cfg.layersPerFrame > limits.maxFramebufferLayers ||
+        fb_cfg.totalLayers > limits.maxImageArrayLayers) {
+        cerr << "Framebuffer layer count (" << fb_cfg.totalLayers <<
+            ") exceeds device limits" << endl;
+        fatalExit();
+    }
+}
+
+// The packing pass always samples through an array view, so the same
+// shader handles tiled and layered framebuffers
+static pair<VkImageView, VkDescriptorSet> makePackSet(
+        const DeviceState &dev,
+        const RenderState &render_state,
+        VkImage image,
+        VkFormat format,
+        uint32_t num_layers,
+        VkBuffer result_buffer)
+{
+    VkImageViewCreateInfo view_info {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    view_info.format = format;
+    view_info.subresourceRange = {
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        0, 1, 0, num_layers
+    };
+
+    VkImageView view;
+    REQ_VK(dev.dt.createImageView(dev.hdl, &view_info, nullptr, &view));
+
+    VkDescriptorSet pack_set =
+        makeDescriptorSet(dev, render_state.packDescriptorPool,
+                          render_state.packDescriptorLayout);
+
+    VkDescriptorImageInfo image_info {
+        VK_NULL_HANDLE,
+        view,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+
+    VkDescriptorBufferInfo result_info {
+        result_buffer,
+        0,
+        VK_WHOLE_SIZE
+    };
+
+    array<VkWriteDescriptorSet, PackLayout::NumBindings> pack_updates;
+    for (uint32_t binding_idx = 0; binding_idx < pack_updates.size();
+         binding_idx++) {
+        VkWriteDescriptorSet &binding_update = pack_updates[binding_idx];
+        binding_update.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        binding_update.pNext = nullptr;
+        binding_update.dstSet = pack_set;
+        binding_update.dstBinding = binding_idx;
+        binding_update.dstArrayElement = 0;
+        binding_update.descriptorCount = 1;
+        binding_update.pImageInfo = nullptr;
+        binding_update.pBufferInfo = nullptr;
+        binding_update.pTexelBufferView = nullptr;
+    }
+
+    pack_updates[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pack_updates[0].pImageInfo = &image_info;
+    pack_updates[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pack_updates[1].pBufferInfo = &result_info;
+
+    dev.dt.updateDescriptorSets(dev.hdl,
+            static_cast<uint32_t>(pack_updates.size()),
+            pack_updates.data(), 0, nullptr);
+
+    return { view, pack_set };
+}
+
+static FramebufferState makeFramebuffer(const InstanceState &inst,
+                                        const DeviceState &dev,
                                         MemoryAllocator &alloc,
                                         const FramebufferConfig &fb_cfg,
-                                        VkRenderPass render_pass)
+                                        const RenderState &render_state)
 {
+    checkFramebufferLimits(inst, dev, fb_cfg);
+
     vector<LocalImage> attachments;
-    vector<VkImageView> attachment_views;
+    vector<VkFormat> attachment_formats;
 
-    VkImageViewCreateInfo view_info {};
-    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    VkImageSubresourceRange &view_info_sr = view_info.subresourceRange;
-    view_info_sr.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    view_info_sr.baseMipLevel = 0;
-    view_info_sr.levelCount = 1;
-    view_info_sr.baseArrayLayer = 0;
-    view_info_sr.layerCount = 1;
+    const uint32_t num_layers = fb_cfg.totalLayers;
 
     if (fb_cfg.colorOutput) {
         attachments.emplace_back(
                 alloc.makeColorAttachment(fb_cfg.totalWidth,
-                                          fb_cfg.totalHeight));
-
-        VkImageView color_view;
-        view_info.image = attachments.back().image;
-        view_info.format = alloc.getFormats().colorAttachment;
-
-        REQ_VK(dev.dt.createImageView(dev.hdl, &view_info,
-                                      nullptr, &color_view));
-
-        attachment_views.push_back(color_view);
+                                          fb_cfg.totalHeight,
+                                          num_layers));
+        attachment_formats.push_back(alloc.getFormats().colorAttachment);
     }
 
     if (fb_cfg.depthOutput) {
         attachments.emplace_back(
             alloc.makeLinearDepthAttachment(fb_cfg.totalWidth,
-                                            fb_cfg.totalHeight));
-
-        VkImageView linear_depth_view;
-        view_info.image = attachments.back().image;
-        view_info.format = alloc.getFormats().linearDepthAttachment;
-
-        REQ_VK(dev.dt.createImageView(dev.hdl, &view_info,
-                                      nullptr, &linear_depth_view));
-
-        attachment_views.push_back(linear_depth_view);
+                                            fb_cfg.totalHeight,
+                                            num_layers));
+        attachment_formats.push_back(
+            alloc.getFormats().linearDepthAttachment);
     }
 
     attachments.emplace_back(
-            alloc.makeDepthAttachment(fb_cfg.totalWidth, fb_cfg.totalHeight));
+            alloc.makeDepthAttachment(fb_cfg.totalWidth, fb_cfg.totalHeight,
+                                      num_layers));
+    attachment_formats.push_back(alloc.getFormats().depthAttachment);
 
-    view_info.image = attachments.back().image;
-    view_info.format = alloc.getFormats().depthAttachment;
-    view_info_sr.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    const uint32_t num_fb_frames = num_layers / fb_cfg.layersPerFrame;
 
-    VkImageView depth_view;
-    REQ_VK(dev.dt.createImageView(dev.hdl, &view_info,
-                                  nullptr, &depth_view));
-
-    attachment_views.push_back(depth_view);
+    VkImageViewCreateInfo view_info {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.viewType = fb_cfg.layeredOutput ?
+        VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+    VkImageSubresourceRange &view_info_sr = view_info.subresourceRange;
+    view_info_sr.baseMipLevel = 0;
+    view_info_sr.levelCount = 1;
+    view_info_sr.layerCount = fb_cfg.layersPerFrame;
 
     VkFramebufferCreateInfo fb_info;
     fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     fb_info.pNext = nullptr;
     fb_info.flags = 0;
-    fb_info.renderPass = render_pass;
-    fb_info.attachmentCount = static_cast<uint32_t>(attachment_views.size());
-    fb_info.pAttachments = attachment_views.data();
+    fb_info.renderPass = render_state.renderPass;
+    fb_info.attachmentCount = static_cast<uint32_t>(attachments.size());
     fb_info.width = fb_cfg.totalWidth;
     fb_info.height = fb_cfg.totalHeight;
-    fb_info.layers = 1;
+    fb_info.layers = fb_cfg.layersPerFrame;
+
+    vector<VkImageView> attachment_views;
+    vector<VkFramebuffer> fb_handles;
+    attachment_views.reserve(num_fb_frames * attachments.size());
+    fb_handles.reserve(num_fb_frames);
+
+    for (uint32_t frame_idx = 0; frame_idx < num_fb_frames; frame_idx++) {
+        size_t frame_views_start = attachment_views.size();
+        view_info_sr.baseArrayLayer = frame_idx * fb_cfg.layersPerFrame;
+
+        for (size_t attach_idx = 0; attach_idx < attachments.size();
+             attach_idx++) {
+            bool is_depth = attach_idx == attachments.size() - 1;
+
+            view_info.image = attachments[attach_idx].image;
+            view_info.format = attachment_formats[attach_idx];
+            view_info_sr.aspectMask = is_depth ?
+                VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+
+            VkImageView view;
+            REQ_VK(dev.dt.createImageView(dev.hdl, &view_info,
+                                          nullptr, &view));
+
+            attachment_views.push_back(view);
+        }
 
-    VkFramebuffer fb_handle;
-    REQ_VK(dev.dt.createFramebuffer(dev.hdl, &fb_info, nullptr, &fb_handle));
+        fb_info.pAttachments = attachment_views.data() + frame_views_start;
 
-    auto [result_buffer, result_mem] =
-        alloc.makeDedicatedBuffer(fb_cfg.totalLinearBytes);
+        VkFramebuffer fb_handle;
+        REQ_VK(dev.dt.createFramebuffer(dev.hdl, &fb_info, nullptr,
+                                        &fb_handle));
+
+        fb_handles.push_back(fb_handle);
+    }
+
+    optional<LocalBuffer> result_buffer;
+    VkDeviceMemory result_mem = VK_NULL_HANDLE;
+    optional<HostBuffer> readback_buffer;
+    VkBuffer result_hdl;
+
+    if (fb_cfg.hostReadback) {
+        readback_buffer.emplace(
+            alloc.makeReadbackBuffer(fb_cfg.totalLinearBytes));
+        result_hdl = readback_buffer->buffer;
+    } else {
+        auto [dedicated_buffer, dedicated_mem] =
+            alloc.makeDedicatedBuffer(fb_cfg.totalLinearBytes);
+        result_buffer.emplace(move(dedicated_buffer));
+        result_mem = dedicated_mem;
+        result_hdl = result_buffer->buffer;
+    }
+
+    VkImageView color_pack_view = VK_NULL_HANDLE;
+    VkDescriptorSet color_pack_set = VK_NULL_HANDLE;
+    if (fb_cfg.packColor) {
+        tie(color_pack_view, color_pack_set) = makePackSet(dev, render_state,
+            attachments[0].image, alloc.getFormats().colorAttachment,
+            num_layers, result_hdl);
+    }
+
+    VkImageView depth_pack_view = VK_NULL_HANDLE;
+    VkDescriptorSet depth_pack_set = VK_NULL_HANDLE;
+    if (fb_cfg.packDepth) {
+        tie(depth_pack_view, depth_pack_set) = makePackSet(dev, render_state,
+            attachments[attachments.size() - 2].image,
+            alloc.getFormats().linearDepthAttachment,
+            num_layers, result_hdl);
+    }
 
     return FramebufferState {
         move(attachments),
-        attachment_views,
-        fb_handle,
+        move(attachment_views),
+        move(fb_handles),
         move(result_buffer),
-        result_mem
+        result_mem,
+        move(readback_buffer),
+        color_pack_view,
+        color_pack_set,
+        depth_pack_view,
+        depth_pack_set
     };
 }
 
@@ -442,11 +782,103 @@ static VkShaderModule loadShader(const DeviceState &dev,
     return shader_module;
 }
 
+static string getPipelineCachePath(const InstanceState &inst,
+                                   const DeviceState &dev,
+                                   const RenderConfig &cfg)
+{
+    const char *cache_dir = cfg.pipelineCacheDir;
+    if (cache_dir == nullptr) {
+        cache_dir = getenv("V4R_PIPELINE_CACHE_DIR");
+    }
+
+    if (cache_dir == nullptr || cache_dir[0] == '\0') {
+        return string();
+    }
+
+    VkPhysicalDeviceIDProperties dev_id {};
+    dev_id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+
+    VkPhysicalDeviceProperties2 props {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &dev_id;
+    inst.dt.getPhysicalDeviceProperties2(dev.phy, &props);
+
+    // The driver ignores cache data from another device or driver anyway,
+    // keying the file stops them from overwriting each other's caches
+    static const char hex_digits[] = "0123456789abcdef";
+    string uuid_str;
+    for (uint8_t byte : dev_id.deviceUUID) {
+        uuid_str += hex_digits[byte >> 4];
+        uuid_str += hex_digits[byte & 0xF];
+    }
+
+    return string(cache_dir) + "/v4r_pipelines_" + uuid_str + "_" +
+        to_string(props.properties.driverVersion) + ".bin";
+}
+
+static VkPipelineCache loadPipelineCache(const DeviceState &dev,
+                                         const string &cache_path)
+{
+    vector<char> cache_data;
+
+    if (!cache_path.empty()) {
+        ifstream cache_file(cache_path, ios::binary | ios::ate);
+
+        if (cache_file.is_open()) {
+            cache_data.resize(cache_file.tellg());
+            cache_file.seekg(0, ios::beg);
+
+            if (!cache_file.read(cache_data.data(), cache_data.size())) {
+                cache_data.clear();
+            }
+        }
+    }
+
+    VkPipelineCacheCreateInfo pcache_info {};
+    pcache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pcache_info.initialDataSize = cache_data.size();
+    pcache_info.pInitialData = cache_data.data();
+
+    VkPipelineCache pipeline_cache;
+    REQ_VK(dev.dt.createPipelineCache(dev.hdl, &pcache_info,
+                                      nullptr, &pipeline_cache));
+
+    return pipeline_cache;
+}
+
+static void savePipelineCache(const DeviceState &dev,
+                              VkPipelineCache pipeline_cache,
+                              const string &cache_path)
+{
+    size_t num_bytes;
+    REQ_VK(dev.dt.getPipelineCacheData(dev.hdl, pipeline_cache,
+                                       &num_bytes, nullptr));
+
+    DynArray<char> cache_data(num_bytes);
+    REQ_VK(dev.dt.getPipelineCacheData(dev.hdl, pipeline_cache,
+                                       &num_bytes, cache_data.data()));
+
+    // Every process writes its own temporary file and renames it over the
+    // cache, so concurrent readers never see a partially written cache
+    string tmp_path = cache_path + ".tmp" + to_string(getpid());
+
+    ofstream tmp_file(tmp_path, ios::binary | ios::trunc);
+    tmp_file.write(cache_data.data(), num_bytes);
+    tmp_file.close();
+
+    if (tmp_file.fail() || rename(tmp_path.c_str(), cache_path.c_str())) {
+        cerr << "Failed to write pipeline cache " << cache_path << endl;
+        remove(tmp_path.c_str());
+    }
+}
+
 template <typename PipelineType>
 PipelineState PipelineImpl<PipelineType>::makePipeline(
         const DeviceState &dev,
         const FramebufferConfig &fb_cfg,
-        const RenderState &render_state)
+        const RenderState &render_state,
+        VkPipelineCache pipeline_cache,
+        uint32_t vertex_stride)
 {
     using Props = PipelineProps<PipelineType>;
     using VertexType = typename PipelineType::Vertex;
@@ -455,8 +887,9 @@ PipelineState PipelineImpl<PipelineType>::makePipeline(
     constexpr size_t num_bindings = Props::needMaterial ? 3 : 2;
 
     array<VkVertexInputBindingDescription, num_bindings> input_bindings;
+    // Scene vertices may carry attributes this pipeline doesn't read
     input_bindings[0] = {
-        0, sizeof(VertexType), VK_VERTEX_INPUT_RATE_VERTEX
+        0, vertex_stride, VK_VERTEX_INPUT_RATE_VERTEX
     };
 
     input_bindings[1] = {
@@ -507,18 +940,12 @@ PipelineState PipelineImpl<PipelineType>::makePipeline(
         desc_layouts[1] = render_state.sceneDescriptorLayout;
     }
 
-    // Pipeline cache (FIXME)
-    VkPipelineCacheCreateInfo pcache_info {};
-    pcache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    VkPipelineCache pipeline_cache;
-    REQ_VK(dev.dt.createPipelineCache(dev.hdl, &pcache_info,
-                                      nullptr, &pipeline_cache));
-
     constexpr size_t num_shaders = 2;
 
     const array<pair<const char *, VkShaderStageFlagBits>,
                 num_shaders> shader_cfg {{
-        {Props::vertexShaderName, VK_SHADER_STAGE_VERTEX_BIT},
+        {fb_cfg.layeredOutput ? Props::layeredVertexShaderName :
+             Props::vertexShaderName, VK_SHADER_STAGE_VERTEX_BIT},
         {Props::fragmentShaderName, VK_SHADER_STAGE_FRAGMENT_BIT}
     }};
 
@@ -693,17 +1120,117 @@ PipelineState PipelineImpl<PipelineType>::makePipeline(
                                           &pipeline_info, nullptr,
                                           &pipeline));
 
+    VkPipelineLayout cull_layout = VK_NULL_HANDLE;
+    VkPipeline cull_pipeline = VK_NULL_HANDLE;
+
+    if (render_state.cullDescriptorLayout != VK_NULL_HANDLE) {
+        VkPipelineLayoutCreateInfo cull_layout_info {};
+        cull_layout_info.sType =
+            VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        cull_layout_info.setLayoutCount = 1;
+        cull_layout_info.pSetLayouts = &render_state.cullDescriptorLayout;
+
+        REQ_VK(dev.dt.createPipelineLayout(dev.hdl, &cull_layout_info,
+                                           nullptr, &cull_layout));
+
+        shader_modules.push_back(loadShader(dev, "cull.comp.spv"));
+
+        VkBool32 has_materials = Props::needMaterial;
+
+        VkSpecializationMapEntry spec_entry {
+            0, 0, sizeof(VkBool32)
+        };
+
+        VkSpecializationInfo spec_info {
+            1, &spec_entry,
+            sizeof(VkBool32), &has_materials
+        };
+
+        VkComputePipelineCreateInfo cull_info;
+        cull_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        cull_info.pNext = nullptr;
+        cull_info.flags = 0;
+        cull_info.stage = {
+            VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            nullptr,
+            0,
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            shader_modules.back(),
+            "main",
+            &spec_info
+        };
+        cull_info.layout = cull_layout;
+        cull_info.basePipelineHandle = VK_NULL_HANDLE;
+        cull_info.basePipelineIndex = -1;
+
+        REQ_VK(dev.dt.createComputePipelines(dev.hdl, pipeline_cache, 1,
+                                             &cull_info, nullptr,
+                                             &cull_pipeline));
+    }
+
+    VkPipelineLayout pack_layout = VK_NULL_HANDLE;
+    VkPipeline pack_pipeline = VK_NULL_HANDLE;
+
+    if (render_state.packDescriptorLayout != VK_NULL_HANDLE) {
+        VkPushConstantRange pack_push_const {
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            0,
+            sizeof(PackPushConstant)
+        };
+
+        VkPipelineLayoutCreateInfo pack_layout_info {};
+        pack_layout_info.sType =
+            VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pack_layout_info.setLayoutCount = 1;
+        pack_layout_info.pSetLayouts = &render_state.packDescriptorLayout;
+        pack_layout_info.pushConstantRangeCount = 1;
+        pack_layout_info.pPushConstantRanges = &pack_push_const;
+
+        REQ_VK(dev.dt.createPipelineLayout(dev.hdl, &pack_layout_info,
+                                           nullptr, &pack_layout));
+
+        shader_modules.push_back(loadShader(dev, "pack.comp.spv"));
+
+        VkComputePipelineCreateInfo pack_info;
+        pack_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pack_info.pNext = nullptr;
+        pack_info.flags = 0;
+        pack_info.stage = {
+            VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            nullptr,
+            0,
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            shader_modules.back(),
+            "main",
+            nullptr
+        };
+        pack_info.layout = pack_layout;
+        pack_info.basePipelineHandle = VK_NULL_HANDLE;
+        pack_info.basePipelineIndex = -1;
+
+        REQ_VK(dev.dt.createComputePipelines(dev.hdl, pipeline_cache, 1,
+                                             &pack_info, nullptr,
+                                             &pack_pipeline));
+    }
+
     return PipelineState {
         shader_modules,
-        pipeline_cache,
         pipeline_layout,
-        pipeline
+        pipeline,
+        cull_layout,
+        cull_pipeline,
+        pack_layout,
+        pack_pipeline
     };
 }
 
 static glm::u32vec2 computeFBPosition(uint32_t batch_idx,
                                       const FramebufferConfig &cfg)
 {
+    if (cfg.layeredOutput) {
+        return glm::u32vec2(0, 0);
+    }
+
     return glm::u32vec2((batch_idx % cfg.numImagesWidePerBatch) *
                         cfg.imgWidth,
                         (batch_idx / cfg.numImagesWidePerBatch) *
@@ -712,6 +1239,7 @@ static glm::u32vec2 computeFBPosition(uint32_t batch_idx,
 
 static PerFrameState makeFrameState(const DeviceState &dev,
                                     const FramebufferConfig &fb_cfg,
+                                    const FramebufferState &fb,
                                     const ParamBufferConfig &param_config,
                                     const HostBuffer &param_buffer,
                                     VkCommandPool gfx_pool,
@@ -727,10 +1255,18 @@ static PerFrameState makeFrameState(const DeviceState &dev,
     VkCommandBuffer copy_command = makeCmdBuffer(dev, gfx_pool);
 
     uint32_t global_frame_idx = stream_idx * num_frames_per_stream + frame_idx;
-
-    glm::u32vec2 base_fb_offset(
-            global_frame_idx * fb_cfg.numImagesWidePerBatch * fb_cfg.imgWidth,
-            0);
+    VkFramebuffer framebuffer = fb.getFrameHandle(global_frame_idx);
+
+    // Frames are either side by side in the framebuffer, or each have
+    // their own range of layers with every env at the origin
+    glm::u32vec2 base_fb_offset(0, 0);
+    uint32_t base_fb_layer = 0;
+    if (fb_cfg.layeredOutput) {
+        base_fb_layer = global_frame_idx * batch_size;
+    } else {
+        base_fb_offset.x =
+            global_frame_idx * fb_cfg.numImagesWidePerBatch * fb_cfg.imgWidth;
+    }
 
     DynArray<glm::u32vec2> batch_fb_offsets(batch_size);
     for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
@@ -746,6 +1282,7 @@ static PerFrameState makeFrameState(const DeviceState &dev,
 
     const bool use_materials = param_config.totalMaterialIndexBytes > 0;
     const bool use_lights = param_config.totalLightParamBytes > 0;
+    const bool use_draws = param_config.totalDrawBytes > 0;
 
     VkDescriptorSet frame_set = makeDescriptorSet(dev, frame_set_pool,
                                                   frame_set_layout);
@@ -756,8 +1293,8 @@ static PerFrameState makeFrameState(const DeviceState &dev,
     DynArray<VkBuffer> vertex_buffers(num_vertex_inputs);
     DynArray<VkDeviceSize> vertex_offsets(num_vertex_inputs);
 
-    // First vertex buffer is the actual vertex buffer, starts at 0, handle
-    // is set at render time
+    // First vertex buffer is the scene's geometry heap block, which is
+    // bound per scene by bindGeometry
     vertex_buffers[0] = VK_NULL_HANDLE;
     vertex_offsets[0] = 0;
 
@@ -795,7 +1332,8 @@ static PerFrameState makeFrameState(const DeviceState &dev,
 
     uint32_t *material_ptr = nullptr;
     LightProperties *light_ptr = nullptr;
-    uint32_t *num_lights_ptr = nullptr;
+    uint32_t *light_index_ptr = nullptr;
+    LightTile *light_tile_ptr = nullptr;
 
     if (use_materials) {
         material_ptr = reinterpret_cast<uint32_t *>(
@@ -810,8 +1348,11 @@ static PerFrameState makeFrameState(const DeviceState &dev,
         light_ptr = reinterpret_cast<LightProperties *>(
                 base_ptr + param_config.lightsOffset);
 
-        num_lights_ptr = reinterpret_cast<uint32_t *>(
-                light_ptr + VulkanConfig::max_lights);
+        light_index_ptr = reinterpret_cast<uint32_t *>(
+                base_ptr + param_config.lightIndicesOffset);
+
+        light_tile_ptr = reinterpret_cast<LightTile *>(
+                base_ptr + param_config.lightTilesOffset);
 
         light_info = {
             param_buffer.buffer,
@@ -820,7 +1361,7 @@ static PerFrameState makeFrameState(const DeviceState &dev,
         };
 
         binding_update.dstBinding = 1;
-        binding_update.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        binding_update.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
         binding_update.pBufferInfo = &light_info;
         frame_set_updates.push_back(binding_update);
     }
@@ -829,11 +1370,22 @@ static PerFrameState makeFrameState(const DeviceState &dev,
             static_cast<uint32_t>(frame_set_updates.size()),
             frame_set_updates.data(), 0, nullptr);
 
+    VkDeviceSize draw_buffer_offset = 0;
+    VkDrawIndexedIndirectCommand *draw_ptr = nullptr;
+    if (use_draws) {
+        draw_buffer_offset = base_offset + param_config.drawOffset;
+        draw_ptr = reinterpret_cast<VkDrawIndexedIndirectCommand *>(
+                base_ptr + param_config.drawOffset);
+    }
+
     return PerFrameState {
         cpu_sync ? makeFence(dev) : VK_NULL_HANDLE,
+        0,
         { render_command, copy_command },
         base_fb_offset,
         move(batch_fb_offsets),
+        base_fb_layer,
+        framebuffer,
         color_buffer_offset,
         depth_buffer_offset,
         frame_set,
@@ -843,14 +1395,207 @@ static PerFrameState makeFrameState(const DeviceState &dev,
         view_ptr,
         material_ptr,
         light_ptr,
-        num_lights_ptr
+        light_index_ptr,
+        light_tile_ptr,
+        draw_buffer_offset,
+        draw_ptr,
+        {},
+        {},
+        {},
+        {},
+        {},
+        {},
+        {}
+    };
+}
+
+// Points the culling pass's inputs at this frame's region of the param
+// buffer and its outputs at the frame's region of the cull buffer. The
+// render pass then sources instance data from the culled output.
+static void initFrameCullState(const DeviceState &dev,
+                               const ParamBufferConfig &param_config,
+                               const CullBufferConfig &cull_config,
+                               const HostBuffer &param_buffer,
+                               const LocalBuffer &cull_buffer,
+                               VkDescriptorPool cull_set_pool,
+                               VkDescriptorSetLayout cull_set_layout,
+                               uint32_t frame_idx,
+                               PerFrameState &frame_state)
+{
+    const bool use_materials = param_config.totalMaterialIndexBytes > 0;
+
+    VkDeviceSize param_base = frame_idx * param_config.totalParamBytes;
+    VkDeviceSize cull_base = frame_idx * cull_config.totalBytes;
+
+    uint8_t *base_ptr = reinterpret_cast<uint8_t *>(param_buffer.ptr) +
+        param_base;
+
+    PerFrameCullState &cull = frame_state.cull;
+    cull.descriptorSet = makeDescriptorSet(dev, cull_set_pool,
+                                           cull_set_layout);
+    cull.infoPtr = reinterpret_cast<CullingInfo *>(
+        base_ptr + param_config.cullInfoOffset);
+    cull.infoBufferOffset = param_base + param_config.cullInfoOffset;
+    cull.drawPtr = reinterpret_cast<DrawCullInfo *>(
+        base_ptr + param_config.drawCullOffset);
+    cull.instanceDrawPtr = reinterpret_cast<uint32_t *>(
+        base_ptr + param_config.instanceDrawOffset);
+    cull.drawCountPtr = reinterpret_cast<uint32_t *>(
+        base_ptr + param_config.drawCountOffset);
+    cull.drawCountBufferOffset = param_base + param_config.drawCountOffset;
+    cull.drawBufferOffset = cull_base + cull_config.drawOffset;
+
+    const VkDeviceSize instance_bytes =
+        sizeof(uint32_t) * VulkanConfig::max_instances;
+
+    array<VkDescriptorBufferInfo, CullLayout::NumBindings> buffer_infos {{
+        {
+            param_buffer.buffer,
+            param_base + param_config.cullInfoOffset,
+            sizeof(CullingInfo)
+        },
+        {
+            param_buffer.buffer,
+            param_base + param_config.viewOffset,
+            param_config.totalViewBytes
+        },
+        {
+            param_buffer.buffer,
+            param_base + param_config.drawCullOffset,
+            sizeof(DrawCullInfo) * VulkanConfig::max_draws
+        },
+        {
+            param_buffer.buffer,
+            param_base + param_config.instanceDrawOffset,
+            instance_bytes
+        },
+        {
+            param_buffer.buffer,
+            param_base,
+            param_config.totalTransformBytes
+        },
+        {
+            param_buffer.buffer,
+            param_base + param_config.materialIndicesOffset,
+            instance_bytes
+        },
+        {
+            cull_buffer.buffer,
+            cull.drawBufferOffset,
+            sizeof(VkDrawIndexedIndirectCommand) * VulkanConfig::max_draws
+        },
+        {
+            cull_buffer.buffer,
+            cull_base + cull_config.transformOffset,
+            sizeof(glm::mat4x3) * VulkanConfig::max_instances
+        },
+        {
+            cull_buffer.buffer,
+            cull_base + cull_config.materialOffset,
+            instance_bytes
+        }
+    }};
+
+    vector<VkWriteDescriptorSet> cull_set_updates;
+
+    for (uint32_t binding_idx = 0; binding_idx < buffer_infos.size();
+         binding_idx++) {
+        bool material_binding = binding_idx == 5 || binding_idx == 8;
+        if (material_binding && !use_materials) continue;
+
+        VkWriteDescriptorSet binding_update;
+        binding_update.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        binding_update.pNext = nullptr;
+        binding_update.dstSet = cull.descriptorSet;
+        binding_update.dstBinding = binding_idx;
+        binding_update.dstArrayElement = 0;
+        binding_update.descriptorCount = 1;
+        binding_update.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        binding_update.pImageInfo = nullptr;
+        binding_update.pBufferInfo = &buffer_infos[binding_idx];
+        binding_update.pTexelBufferView = nullptr;
+
+        cull_set_updates.push_back(binding_update);
+    }
+
+    dev.dt.updateDescriptorSets(dev.hdl,
+            static_cast<uint32_t>(cull_set_updates.size()),
+            cull_set_updates.data(), 0, nullptr);
+
+    frame_state.vertexBuffers[1] = cull_buffer.buffer;
+    frame_state.vertexOffsets[1] = cull_base + cull_config.transformOffset;
+
+    if (use_materials) {
+        frame_state.vertexBuffers[2] = cull_buffer.buffer;
+        frame_state.vertexOffsets[2] = cull_base + cull_config.materialOffset;
+    }
+}
+
+// Writes one attachment of a frame into the result buffer in its packed
+// format. The attachment must be in SHADER_READ_ONLY_OPTIMAL.
+static void recordPack(const DeviceState &dev,
+                       VkCommandBuffer copy_cmd,
+                       const PerFrameState &state,
+                       const FramebufferConfig &fb_cfg,
+                       const PipelineState &pipeline,
+                       VkDescriptorSet pack_set,
+                       uint32_t num_channels,
+                       uint32_t format,
+                       bool grayscale,
+                       bool channels_first,
+                       float max_value,
+                       VkDeviceSize buffer_offset)
+{
+    uint32_t batch_size = state.batchFBOffsets.size();
+
+    uint32_t num_elements =
+        fb_cfg.imgWidth * fb_cfg.imgHeight * batch_size * num_channels;
+    uint32_t elems_per_word = format == PACK_FORMAT_UNORM8 ? 4 : 2;
+    uint32_t num_words = (num_elements + elems_per_word - 1) / elems_per_word;
+
+    PackPushConstant pack_const {
+        state.baseFBOffset,
+        state.baseFBLayer,
+        fb_cfg.layeredOutput,
+        fb_cfg.imgWidth,
+        fb_cfg.imgHeight,
+        fb_cfg.numImagesWidePerBatch,
+        num_channels,
+        grayscale,
+        format,
+        channels_first,
+        num_elements,
+        num_words,
+        static_cast<uint32_t>(buffer_offset / sizeof(uint32_t)),
+        max_value
     };
+
+    dev.dt.cmdBindPipeline(copy_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                           pipeline.packPipeline);
+
+    dev.dt.cmdBindDescriptorSets(copy_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                 pipeline.packLayout, 0, 1, &pack_set,
+                                 0, nullptr);
+
+    dev.dt.cmdPushConstants(copy_cmd, pipeline.packLayout,
+                            VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                            sizeof(PackPushConstant), &pack_const);
+
+    // Every implementation supports at least 65535 workgroups in X, the
+    // shader loops over any remaining words
+    uint32_t num_workgroups = min(
+        (num_words + VulkanConfig::pack_workgroup_size - 1) /
+            VulkanConfig::pack_workgroup_size,
+        65535u);
+
+    dev.dt.cmdDispatch(copy_cmd, num_workgroups, 1, 1);
 }
 
 static void recordFBToLinearCopy(const DeviceState &dev,
                                  const PerFrameState &state,
                                  const FramebufferConfig &fb_cfg,
-                                 const FramebufferState &fb)
+                                 const FramebufferState &fb,
+                                 const PipelineState &pipeline)
 {
     // FIXME move this to FramebufferState
     vector<VkImageMemoryBarrier> fb_barriers;
@@ -860,15 +1605,17 @@ static void recordFBToLinearCopy(const DeviceState &dev,
             VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
             nullptr,
             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-            VK_ACCESS_TRANSFER_READ_BIT,
-            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            fb_cfg.packColor ? VK_ACCESS_SHADER_READ_BIT :
+                VK_ACCESS_TRANSFER_READ_BIT,
             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            fb_cfg.packColor ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL :
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
             VK_QUEUE_FAMILY_IGNORED,
             VK_QUEUE_FAMILY_IGNORED,
             fb.attachments[0].image,
             {
                 VK_IMAGE_ASPECT_COLOR_BIT,
-                0, 1, 0, 1
+                0, 1, 0, VK_REMAINING_ARRAY_LAYERS
             }
         });
     }
@@ -878,15 +1625,17 @@ static void recordFBToLinearCopy(const DeviceState &dev,
             VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
             nullptr,
             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-            VK_ACCESS_TRANSFER_READ_BIT,
-            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            fb_cfg.packDepth ? VK_ACCESS_SHADER_READ_BIT :
+                VK_ACCESS_TRANSFER_READ_BIT,
             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            fb_cfg.packDepth ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL :
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
             VK_QUEUE_FAMILY_IGNORED,
             VK_QUEUE_FAMILY_IGNORED,
             fb.attachments[fb.attachments.size() - 2].image,
             {
                 VK_IMAGE_ASPECT_COLOR_BIT,
-                0, 1, 0, 1
+                0, 1, 0, VK_REMAINING_ARRAY_LAYERS
             }
         });
     }
@@ -898,20 +1647,158 @@ static void recordFBToLinearCopy(const DeviceState &dev,
     REQ_VK(dev.dt.beginCommandBuffer(copy_cmd, &begin_info));
     dev.dt.cmdPipelineBarrier(copy_cmd,
                               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                              VK_PIPELINE_STAGE_TRANSFER_BIT,
+                              VK_PIPELINE_STAGE_TRANSFER_BIT |
+                                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
                               VK_DEPENDENCY_BY_REGION_BIT,
                               0, nullptr, 0, nullptr,
                               static_cast<uint32_t>(fb_barriers.size()),
                               fb_barriers.data());
 
-    uint32_t batch_size = state.batchFBOffsets.size();
+    // Packed attachments are returned to TRANSFER_SRC_OPTIMAL afterwards,
+    // which the display path expects
+    vector<VkImageMemoryBarrier> restore_barriers;
+    auto add_restore_barrier = [&](VkImage image) {
+        restore_barriers.emplace_back(VkImageMemoryBarrier {
+            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            nullptr,
+            VK_ACCESS_SHADER_READ_BIT,
+            VK_ACCESS_TRANSFER_READ_BIT,
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_QUEUE_FAMILY_IGNORED,
+            VK_QUEUE_FAMILY_IGNORED,
+            image,
+            {
+                VK_IMAGE_ASPECT_COLOR_BIT,
+                0, 1, 0, VK_REMAINING_ARRAY_LAYERS
+            }
+        });
+    };
 
-    DynArray<VkBufferImageCopy> copy_regions(batch_size);
+    if (fb_cfg.packColor) {
+        recordPack(dev, copy_cmd, state, fb_cfg, pipeline, fb.colorPackSet,
+                   getNumColorChannels(fb_cfg.colorFormat),
+                   isHalfFloat(fb_cfg.colorFormat) ?
+                       PACK_FORMAT_FLOAT16 : PACK_FORMAT_UNORM8,
+                   fb_cfg.colorFormat == ColorFormat::R8,
+                   fb_cfg.colorLayout == ColorLayout::CHW,
+                   1.f, state.colorBufferOffset);
 
-    auto make_copy_cmd = [&](VkDeviceSize base_offset, uint32_t texel_bytes,
-                             VkImage src_image) {
+        add_restore_barrier(fb.attachments[0].image);
+    }
 
-        uint32_t cur_offset = base_offset;
+    if (fb_cfg.packDepth) {
+        recordPack(dev, copy_cmd, state, fb_cfg, pipeline, fb.depthPackSet,
+                   1,
+                   fb_cfg.depthFormat == DepthFormat::Float16 ?
+                       PACK_FORMAT_FLOAT16 : PACK_FORMAT_UINT16_MM,
+                   false, false,
+                   fb_cfg.maxDepth, state.depthBufferOffset);
+
+        add_restore_barrier(fb.attachments[fb.attachments.size() - 2].image);
+    }
+
+    // Packed output for caller memory is still written to the result
+    // buffer by the pack pass, and copied over afterwards
+    bool copy_packed = (fb_cfg.packColor && state.colorOutput.hostPtr) ||
+        (fb_cfg.packDepth && state.depthOutput.hostPtr);
+
+    if (restore_barriers.size() > 0) {
+        VkMemoryBarrier pack_barrier {
+            VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            nullptr,
+            VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_TRANSFER_READ_BIT
+        };
+
+        dev.dt.cmdPipelineBarrier(copy_cmd,
+                                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                  VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                  0, copy_packed ? 1 : 0, &pack_barrier,
+                                  0, nullptr,
+                                  static_cast<uint32_t>(
+                                      restore_barriers.size()),
+                                  restore_barriers.data());
+    }
+
+    // Caller memory only holds this frame, so it's written from offset 0
+    auto output_target = [&](const FrameOutput &output,
+                             VkDeviceSize frame_offset) {
+        if (output.imported) {
+            return pair(output.imported->buffer, VkDeviceSize(0));
+        } else if (output.staging) {
+            return pair(output.staging->buffer, VkDeviceSize(0));
+        }
+
+        return pair(fb.getResultBuffer(), frame_offset);
+    };
+
+    auto copy_packed_output = [&](const FrameOutput &output,
+                                  VkDeviceSize frame_offset,
+                                  VkDeviceSize num_bytes) {
+        if (!output.hostPtr) return;
+
+        auto [dst_buffer, dst_offset] = output_target(output, frame_offset);
+
+        VkBufferCopy region {
+            frame_offset,
+            dst_offset,
+            num_bytes
+        };
+
+        dev.dt.cmdCopyBuffer(copy_cmd, fb.getResultBuffer(), dst_buffer,
+                             1, &region);
+    };
+
+    if (fb_cfg.packColor) {
+        copy_packed_output(state.colorOutput, state.colorBufferOffset,
+                           fb_cfg.colorLinearBytesPerFrame);
+    }
+
+    if (fb_cfg.packDepth) {
+        copy_packed_output(state.depthOutput, state.depthBufferOffset,
+                           fb_cfg.depthLinearBytesPerFrame);
+    }
+
+    uint32_t batch_size = state.batchFBOffsets.size();
+
+    // Layers are packed back to back in the buffer, so a layered frame
+    // is read back with a single region covering every env
+    uint32_t num_regions = fb_cfg.layeredOutput ? 1 : batch_size;
+
+    DynArray<VkBufferImageCopy> copy_regions(num_regions);
+
+    auto make_copy_cmd = [&](const FrameOutput &output,
+                             VkDeviceSize frame_offset,
+                             uint32_t texel_bytes,
+                             VkImage src_image) {
+        auto [dst_buffer, base_offset] = output_target(output, frame_offset);
+
+        if (fb_cfg.layeredOutput) {
+            VkBufferImageCopy &region = copy_regions[0];
+            region.bufferOffset = base_offset;
+            region.bufferRowLength = 0;
+            region.bufferImageHeight = 0;
+            region.imageSubresource = {
+                VK_IMAGE_ASPECT_COLOR_BIT,
+                0, state.baseFBLayer, batch_size
+            };
+            region.imageOffset = { 0, 0, 0 };
+            region.imageExtent = {
+                fb_cfg.imgWidth,
+                fb_cfg.imgHeight,
+                1
+            };
+
+            dev.dt.cmdCopyImageToBuffer(copy_cmd,
+                                        src_image,
+                                        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                        dst_buffer,
+                                        1, copy_regions.data());
+            return;
+        }
+
+        uint32_t cur_offset = base_offset;
 
         for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
             glm::u32vec2 cur_fb_pos = state.batchFBOffsets[batch_idx];
@@ -941,21 +1828,42 @@ static void recordFBToLinearCopy(const DeviceState &dev,
         dev.dt.cmdCopyImageToBuffer(copy_cmd,
                                     src_image,
                                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                    fb.resultBuffer.buffer,
+                                    dst_buffer,
                                     batch_size,
                                     copy_regions.data());
     };
 
-    if (fb_cfg.colorOutput) {
-        make_copy_cmd(state.colorBufferOffset, sizeof(uint8_t) * 4,
+    if (fb_cfg.colorOutput && !fb_cfg.packColor) {
+        make_copy_cmd(state.colorOutput, state.colorBufferOffset,
+                      sizeof(uint8_t) * 4,
                       fb.attachments[0].image);
     }
 
-    if (fb_cfg.depthOutput) {
-        make_copy_cmd(state.depthBufferOffset, sizeof(float),
+    if (fb_cfg.depthOutput && !fb_cfg.packDepth) {
+        make_copy_cmd(state.depthOutput, state.depthBufferOffset,
+                      sizeof(float),
                       fb.attachments[fb.attachments.size() - 2].image);
     }
 
+    // Fences and semaphores only cover device accesses, so the writes
+    // must explicitly be made available to the host
+    if (fb_cfg.hostReadback || state.colorOutput.hostPtr ||
+        state.depthOutput.hostPtr) {
+        VkMemoryBarrier host_barrier {
+            VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            nullptr,
+            VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_HOST_READ_BIT
+        };
+
+        dev.dt.cmdPipelineBarrier(copy_cmd,
+                                  VK_PIPELINE_STAGE_TRANSFER_BIT |
+                                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                  VK_PIPELINE_STAGE_HOST_BIT,
+                                  0, 1, &host_barrier, 0, nullptr,
+                                  0, nullptr);
+    }
+
     REQ_VK(dev.dt.endCommandBuffer(copy_cmd));
 }
 
@@ -966,12 +1874,17 @@ CommandStreamState::CommandStreamState(
         const RenderState &render_state,
         const PipelineState &pl,
         const FramebufferState &framebuffer,
+        VkDescriptorSet material_set,
         MemoryAllocator &alc,
         QueueManager &queue_manager,
         uint32_t batch_size,
         uint32_t stream_idx,
         uint32_t num_frames_inflight,
-        bool cpu_sync)
+        bool cpu_sync,
+        bool indirect_draw,
+        bool gpu_culling,
+        bool cpu_culling,
+        ThreadPool *record_pool)
     : inst(i),
       dev(d),
       pipeline(pl),
@@ -980,21 +1893,48 @@ CommandStreamState::CommandStreamState(
       alloc(alc),
       fb_cfg_(fb_cfg),
       fb_(framebuffer),
+      material_set_(material_set),
       render_pass_(render_state.renderPass),
       per_render_buffer_(alloc.makeHostBuffer(
                 render_state.paramPositions.totalParamBytes *
                     num_frames_inflight)),
+      cull_buffer_(),
       render_size_(fb_cfg.imgWidth, fb_cfg.imgHeight),
       render_extent_(render_size_.x * fb_cfg.numImagesWidePerBatch,
                      render_size_.y * fb_cfg.numImagesTallPerBatch),
       frame_states_(),
-      cur_frame_(0)
+      cur_frame_(0),
+      indirect_draw_(indirect_draw || gpu_culling),
+      gpu_culling_(gpu_culling),
+      cpu_culling_(cpu_culling && !gpu_culling),
+      record_pool_(record_pool),
+      slice_pools_(),
+      frame_timeline_(makeTimelineSemaphore(dev)),
+      next_ticket_(1),
+      env_order_(),
+      light_bounds_()
 {
+    // Command pools can't be used from multiple threads, so each slice
+    // gets its own
+    uint32_t num_slices = 0;
+    if (record_pool_) {
+        num_slices = min(record_pool_->numThreads() + 1, batch_size);
+    }
+
+    for (uint32_t slice_idx = 0; slice_idx < num_slices; slice_idx++) {
+        slice_pools_.push_back(makeCmdPool(dev, dev.gfxQF));
+    }
+
+    if (gpu_culling_) {
+        cull_buffer_.emplace(alloc.makeLocalBuffer(
+                render_state.cullPositions.totalBytes * num_frames_inflight));
+    }
+
     frame_states_.reserve(num_frames_inflight);
     for (uint32_t frame_idx = 0; frame_idx < num_frames_inflight;
          frame_idx++) {
         frame_states_.emplace_back(makeFrameState(dev,
-                fb_cfg,
+                fb_cfg, fb_,
                 render_state.paramPositions,
                 per_render_buffer_,
                 gfxPool,
@@ -1003,9 +1943,1070 @@ CommandStreamState::CommandStreamState(
                 cpu_sync, batch_size,
                 frame_idx, num_frames_inflight, stream_idx));
 
-        recordFBToLinearCopy(dev, frame_states_.back(), fb_cfg_, fb_);
+        if (gpu_culling_) {
+            initFrameCullState(dev, render_state.paramPositions,
+                               render_state.cullPositions,
+                               per_render_buffer_, *cull_buffer_,
+                               render_state.cullDescriptorPool,
+                               render_state.cullDescriptorLayout,
+                               frame_idx, frame_states_.back());
+        }
+
+        frame_states_.back().envUploads.resize(batch_size);
+
+        for (VkCommandPool slice_pool : slice_pools_) {
+            frame_states_.back().sliceCommands.push_back(
+                makeCmdBuffer(dev, slice_pool,
+                              VK_COMMAND_BUFFER_LEVEL_SECONDARY));
+        }
+
+        recordFBToLinearCopy(dev, frame_states_.back(), fb_cfg_, fb_,
+                             pipeline);
+    }
+}
+
+void CommandStreamState::signalTimeline(PerFrameState &frame_state)
+{
+    // Submitted separately so the submit functions don't need to know
+    // about the timeline. The signal still waits on every earlier
+    // submission to the queue.
+    frame_state.ticket = next_ticket_++;
+
+    VkTimelineSemaphoreSubmitInfo timeline_info {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &frame_state.ticket;
+
+    VkSubmitInfo signal_submit {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        &timeline_info,
+        0, nullptr, nullptr,
+        0, nullptr,
+        1, &frame_timeline_
+    };
+
+    gfxQueue.submit(dev, 1, &signal_submit, VK_NULL_HANDLE);
+}
+
+void * CommandStreamState::getReadbackPtr(VkDeviceSize offset,
+                                          VkDeviceSize num_bytes) const
+{
+    if (!fb_.readbackBuffer) {
+        cerr << "Host pointers require RenderOptions::HostReadback" << endl;
+        fatalExit();
+    }
+
+    fb_.readbackBuffer->invalidate(dev, offset, num_bytes);
+
+    return reinterpret_cast<uint8_t *>(fb_.readbackBuffer->ptr) + offset;
+}
+
+uint8_t * CommandStreamState::getColorHostPtr(uint32_t frame_idx) const
+{
+    return reinterpret_cast<uint8_t *>(getReadbackPtr(
+        frame_states_[frame_idx].colorBufferOffset,
+        fb_cfg_.colorLinearBytesPerFrame));
+}
+
+float * CommandStreamState::getDepthHostPtr(uint32_t frame_idx) const
+{
+    return reinterpret_cast<float *>(getReadbackPtr(
+        frame_states_[frame_idx].depthBufferOffset,
+        fb_cfg_.depthLinearBytesPerFrame));
+}
+
+void CommandStreamState::setFrameOutput(uint32_t frame_idx,
+                                        FrameOutput &output,
+                                        void *ptr, size_t num_bytes,
+                                        VkDeviceSize frame_bytes)
+{
+    if (ptr != nullptr && num_bytes < frame_bytes) {
+        cerr << "Output memory too small, frame needs " << frame_bytes <<
+            " bytes" << endl;
+        fatalExit();
+    }
+
+    output.hostPtr = ptr;
+    output.numBytes = frame_bytes;
+    output.imported.reset();
+    output.staging.reset();
+
+    if (ptr != nullptr) {
+        // Only whole import granules can be imported, but the copy never
+        // touches the tail of the caller's range anyway
+        VkDeviceSize alignment = alloc.getHostImportAlignment();
+        VkDeviceSize import_bytes = alignment == 0 ? 0 :
+            (num_bytes / alignment) * alignment;
+
+        if (import_bytes >= frame_bytes) {
+            output.imported = alloc.importHostBuffer(ptr, import_bytes);
+        }
+
+        if (!output.imported) {
+            output.staging.emplace(alloc.makeReadbackBuffer(frame_bytes));
+        }
+    }
+
+    // Beginning the command buffer again implicitly resets it
+    recordFBToLinearCopy(dev, frame_states_[frame_idx], fb_cfg_, fb_,
+                         pipeline);
+}
+
+void CommandStreamState::setColorOutput(uint32_t frame_idx, void *ptr,
+                                        size_t num_bytes)
+{
+    setFrameOutput(frame_idx, frame_states_[frame_idx].colorOutput,
+                   ptr, num_bytes, fb_cfg_.colorLinearBytesPerFrame);
+}
+
+void CommandStreamState::setDepthOutput(uint32_t frame_idx, void *ptr,
+                                        size_t num_bytes)
+{
+    setFrameOutput(frame_idx, frame_states_[frame_idx].depthOutput,
+                   ptr, num_bytes, fb_cfg_.depthLinearBytesPerFrame);
+}
+
+void CommandStreamState::copyStagedOutputs(uint32_t frame_idx) const
+{
+    const PerFrameState &frame_state = frame_states_[frame_idx];
+
+    for (const FrameOutput *output :
+            { &frame_state.colorOutput, &frame_state.depthOutput }) {
+        if (!output->staging) continue;
+
+        output->staging->invalidate(dev, 0, output->numBytes);
+        memcpy(output->hostPtr, output->staging->ptr, output->numBytes);
+    }
+}
+
+bool CommandStreamState::isTicketComplete(uint64_t ticket) const
+{
+    uint64_t completed;
+    REQ_VK(dev.dt.getSemaphoreCounterValue(dev.hdl, frame_timeline_,
+                                           &completed));
+
+    return completed >= ticket;
+}
+
+bool CommandStreamState::waitForTicket(uint64_t ticket,
+                                       uint64_t timeout) const
+{
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &frame_timeline_;
+    wait_info.pValues = &ticket;
+
+    VkResult res = dev.dt.waitSemaphores(dev.hdl, &wait_info, timeout);
+    if (res == VK_TIMEOUT) {
+        return false;
+    }
+
+    REQ_VK(res);
+
+    return true;
+}
+
+void CommandStreamState::beginCommands(VkCommandBuffer render_cmd)
+{
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    REQ_VK(dev.dt.beginCommandBuffer(render_cmd, &begin_info));
+}
+
+void CommandStreamState::bindPipeline(VkCommandBuffer render_cmd,
+                                      const PerFrameState &frame_state)
+{
+    array<VkDescriptorSet, 2> desc_sets {
+        frame_state.frameSet,
+        material_set_
+    };
+
+    dev.dt.cmdBindDescriptorSets(render_cmd,
+                                 VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                 pipeline.gfxLayout, 0,
+                                 material_set_ != VK_NULL_HANDLE ? 2 : 1,
+                                 desc_sets.data(),
+                                 0, nullptr);
+
+    // Binding 0 is left to bindGeometry
+    dev.dt.cmdBindVertexBuffers(render_cmd, 1,
+                                frame_state.vertexBuffers.size() - 1,
+                                frame_state.vertexBuffers.data() + 1,
+                                frame_state.vertexOffsets.data() + 1);
+
+    // FIXME
+    dev.dt.cmdBindPipeline(render_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                           pipeline.gfxPipeline);
+}
+
+void CommandStreamState::beginRenderPass(VkCommandBuffer render_cmd,
+                                         const PerFrameState &frame_state,
+                                         VkSubpassContents contents)
+{
+    bindPipeline(render_cmd, frame_state);
+
+    VkRenderPassBeginInfo render_begin;
+    render_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_begin.pNext = nullptr;
+    render_begin.renderPass = render_pass_;
+    render_begin.framebuffer = frame_state.framebuffer;
+    render_begin.renderArea.offset = {
+        static_cast<int32_t>(frame_state.baseFBOffset.x), 
+        static_cast<int32_t>(frame_state.baseFBOffset.y) 
+    };
+    render_begin.renderArea.extent = { render_extent_.x, 
+                                       render_extent_.y };
+    render_begin.clearValueCount =
+        static_cast<uint32_t>(fb_cfg_.clearValues.size());
+    render_begin.pClearValues = fb_cfg_.clearValues.data();
+
+    dev.dt.cmdBeginRenderPass(render_cmd, &render_begin, contents);
+}
+
+void CommandStreamState::groupEnvsByScene(const vector<Environment> &envs)
+{
+    env_order_.resize(envs.size());
+    for (uint32_t batch_idx = 0; batch_idx < envs.size(); batch_idx++) {
+        env_order_[batch_idx] = batch_idx;
+    }
+
+    // Stable so the order only changes when the batch's scenes do,
+    // which keeps prerecorded indirect commands and upload tracking valid
+    stable_sort(env_order_.begin(), env_order_.end(),
+                [&envs](uint32_t a, uint32_t b) {
+                    return envs[a].state_->scene.get() <
+                        envs[b].state_->scene.get();
+                });
+}
+
+void CommandStreamState::waitForSceneUploads(
+        const vector<Environment> &envs) const
+{
+    vector<VkSemaphore> semaphores;
+    vector<uint64_t> values;
+
+    const Scene *prev_scene = nullptr;
+    for (uint32_t batch_idx : env_order_) {
+        const Scene *scene = envs[batch_idx].state_->scene.get();
+        if (scene == prev_scene) continue;
+        prev_scene = scene;
+
+        uint64_t cur_value;
+        REQ_VK(dev.dt.getSemaphoreCounterValue(dev.hdl,
+                                               scene->ready.semaphore,
+                                               &cur_value));
+
+        if (cur_value < scene->ready.value) {
+            semaphores.push_back(scene->ready.semaphore);
+            values.push_back(scene->ready.value);
+        }
+    }
+
+    if (semaphores.empty()) return;
+
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = static_cast<uint32_t>(semaphores.size());
+    wait_info.pSemaphores = semaphores.data();
+    wait_info.pValues = values.data();
+
+    REQ_VK(dev.dt.waitSemaphores(dev.hdl, &wait_info, UINT64_MAX));
+}
+
+void CommandStreamState::bindEnvironment(VkCommandBuffer render_cmd,
+                                         const PerFrameState &frame_state,
+                                         uint32_t batch_idx)
+{
+    RenderPushConstant push_const {
+        batch_idx,
+        // Relative to the frame's framebuffer, which starts at its
+        // baseFBLayer
+        fb_cfg_.layeredOutput ? batch_idx : 0
+    };
+
+    dev.dt.cmdPushConstants(render_cmd, pipeline.gfxLayout,
+                            VK_SHADER_STAGE_VERTEX_BIT |
+                                VK_SHADER_STAGE_FRAGMENT_BIT,
+                            0,
+                            sizeof(RenderPushConstant),
+                            &push_const);
+
+    glm::u32vec2 batch_offset = frame_state.batchFBOffsets[batch_idx];
+
+    VkViewport viewport;
+    viewport.x = batch_offset.x;
+    viewport.y = batch_offset.y;
+    viewport.width = render_size_.x;
+    viewport.height = render_size_.y;
+    viewport.minDepth = 0.f;
+    viewport.maxDepth = 1.f;
+
+    dev.dt.cmdSetViewport(render_cmd, 0, 1, &viewport);
+}
+
+void CommandStreamState::bindGeometry(VkCommandBuffer render_cmd,
+                                      const Scene &scene,
+                                      VkBuffer &bound_geometry)
+{
+    VkBuffer geometry = scene.geometry.buffer;
+    if (geometry == bound_geometry || geometry == VK_NULL_HANDLE) return;
+
+    VkDeviceSize offset = 0;
+    dev.dt.cmdBindVertexBuffers(render_cmd, 0, 1, &geometry, &offset);
+    dev.dt.cmdBindIndexBuffer(render_cmd, geometry, 0,
+                              VK_INDEX_TYPE_UINT32);
+
+    bound_geometry = geometry;
+}
+
+void CommandStreamState::endRenderPass(VkCommandBuffer render_cmd)
+{
+    dev.dt.cmdEndRenderPass(render_cmd);
+
+    REQ_VK(dev.dt.endCommandBuffer(render_cmd));
+}
+
+void CommandStreamState::recordCulling(VkCommandBuffer render_cmd,
+                                       const PerFrameState &frame_state,
+                                       uint32_t num_draws)
+{
+    const PerFrameCullState &cull = frame_state.cull;
+
+    // Previous submission of this frame may still be reading the culled
+    // draws and instance data
+    dev.dt.cmdPipelineBarrier(render_cmd,
+                              VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                                  VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                              VK_PIPELINE_STAGE_TRANSFER_BIT |
+                                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                              0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+    // Reset instance counts by copying in the host written draws
+    if (num_draws > 0) {
+        VkBufferCopy draw_copy {
+            frame_state.drawBufferOffset,
+            cull.drawBufferOffset,
+            num_draws * sizeof(VkDrawIndexedIndirectCommand)
+        };
+
+        dev.dt.cmdCopyBuffer(render_cmd, per_render_buffer_.buffer,
+                             cull_buffer_->buffer, 1, &draw_copy);
+    }
+
+    VkMemoryBarrier copy_barrier {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        nullptr,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+
+    dev.dt.cmdPipelineBarrier(render_cmd,
+                              VK_PIPELINE_STAGE_TRANSFER_BIT,
+                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                              0, 1, &copy_barrier, 0, nullptr, 0, nullptr);
+
+    dev.dt.cmdBindPipeline(render_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                           pipeline.cullPipeline);
+
+    dev.dt.cmdBindDescriptorSets(render_cmd,
+                                 VK_PIPELINE_BIND_POINT_COMPUTE,
+                                 pipeline.cullLayout, 0,
+                                 1, &cull.descriptorSet,
+                                 0, nullptr);
+
+    // Workgroup counts are written per frame alongside the instance count
+    dev.dt.cmdDispatchIndirect(render_cmd, per_render_buffer_.buffer,
+                               cull.infoBufferOffset);
+
+    VkMemoryBarrier cull_barrier {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        nullptr,
+        VK_ACCESS_SHADER_WRITE_BIT,
+        VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+            VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+    };
+
+    dev.dt.cmdPipelineBarrier(render_cmd,
+                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                              VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                                  VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                              0, 1, &cull_barrier, 0, nullptr, 0, nullptr);
+}
+
+static constexpr InstanceRange clean_range { ~0u, 0 };
+
+static inline void mergeRange(InstanceRange &dst, const InstanceRange &src)
+{
+    dst.first = min(dst.first, src.first);
+    dst.second = max(dst.second, src.second);
+}
+
+void CommandStreamState::beginEnvUpload(uint32_t batch_idx,
+                                        const Environment &env)
+{
+    EnvUploadState &upload = frame_states_[cur_frame_].envUploads[batch_idx];
+    uint32_t num_meshes = env.transforms_.size();
+
+    // Dirty ranges are only forwarded to the same slot of other frames,
+    // so once an env changes slots or streams its older copies can't be
+    // patched
+    EnvironmentState &env_state = *env.state_;
+    if (env_state.uploadStream != this || env_state.uploadSlot != batch_idx) {
+        env_state.uploadStream = this;
+        env_state.uploadSlot = batch_idx;
+        env_state.uploadID = EnvironmentState::makeUploadID();
+    }
+
+    if (upload.envID == env_state.uploadID &&
+        upload.meshOffsets.size() == num_meshes) {
+        return;
+    }
+
+    // Different env in this slot, everything needs to be rewritten
+    upload.envID = env_state.uploadID;
+    upload.meshOffsets.assign(num_meshes, ~0u);
+    upload.meshCounts.assign(num_meshes, 0);
+    upload.pendingDirty.assign(num_meshes, clean_range);
+}
+
+InstanceRange CommandStreamState::consumeDirtyRange(uint32_t batch_idx,
+                                                    const Environment &env,
+                                                    uint32_t mesh_idx,
+                                                    uint32_t cur_instance)
+{
+    uint32_t num_instances = env.transforms_[mesh_idx].size();
+    EnvUploadState &upload = frame_states_[cur_frame_].envUploads[batch_idx];
+    InstanceRange &env_dirty = env.dirty_ranges_[mesh_idx];
+
+    // If the instances were written to the same place last time this
+    // frame was rendered, only the modified ones need to be copied
+    InstanceRange copy_range { 0, num_instances };
+    if (upload.meshOffsets[mesh_idx] == cur_instance &&
+        upload.meshCounts[mesh_idx] == num_instances) {
+        copy_range = upload.pendingDirty[mesh_idx];
+        mergeRange(copy_range, env_dirty);
+        copy_range.second = min(copy_range.second, num_instances);
+
+        if (copy_range.first >= copy_range.second) {
+            copy_range = { 0, 0 };
+        }
+    }
+
+    upload.meshOffsets[mesh_idx] = cur_instance;
+    upload.meshCounts[mesh_idx] = num_instances;
+    upload.pendingDirty[mesh_idx] = clean_range;
+
+    for (uint32_t frame_idx = 0; frame_idx < frame_states_.size();
+         frame_idx++) {
+        if (frame_idx == cur_frame_) continue;
+
+        EnvUploadState &other =
+            frame_states_[frame_idx].envUploads[batch_idx];
+        if (other.envID == upload.envID &&
+            mesh_idx < other.pendingDirty.size()) {
+            mergeRange(other.pendingDirty[mesh_idx], env_dirty);
+        }
+    }
+
+    env_dirty = clean_range;
+
+    return copy_range;
+}
+
+uint32_t CommandStreamState::copyInstances(const Environment &env,
+                                           uint32_t batch_idx,
+                                           uint32_t mesh_idx,
+                                           uint32_t cur_instance,
+                                           const Frustum *frustum,
+                                           bool track_dirty,
+                                           glm::mat4x3 *transform_ptr,
+                                           uint32_t *material_ptr,
+                                           InstanceRange &written)
+{
+    const auto &transforms = env.transforms_[mesh_idx];
+    uint32_t num_instances = transforms.size();
+
+    if (frustum) {
+        const InlineMesh &mesh = env.state_->scene->meshes[mesh_idx];
+
+        uint32_t num_visible = cullInstances(*frustum, mesh.boundingSphere,
+            transforms.data(),
+            material_ptr ? env.materials_[mesh_idx].data() : nullptr,
+            num_instances, transform_ptr, material_ptr);
+
+        written = { 0, num_visible };
+
+        return num_visible;
+    }
+
+    written = { 0, num_instances };
+    if (track_dirty) {
+        written = consumeDirtyRange(batch_idx, env, mesh_idx, cur_instance);
+    }
+
+    uint32_t num_written = written.second - written.first;
+
+    memcpy(transform_ptr + written.first, transforms.data() + written.first,
+           sizeof(glm::mat4x3) * num_written);
+
+    if (material_ptr) {
+        memcpy(material_ptr + written.first,
+               env.materials_[mesh_idx].data() + written.first,
+               num_written * sizeof(uint32_t));
+    }
+
+    return num_instances;
+}
+
+void CommandStreamState::addFlushRange(PerFrameState &frame_state,
+                                       const void *ptr,
+                                       VkDeviceSize num_bytes)
+{
+    if (num_bytes == 0) return;
+
+    VkDeviceSize offset = reinterpret_cast<const uint8_t *>(ptr) -
+        reinterpret_cast<const uint8_t *>(per_render_buffer_.ptr);
+
+    frame_state.flushRanges.emplace_back(offset, num_bytes);
+}
+
+void CommandStreamState::addInstanceFlushRange(PerFrameState &frame_state,
+                                               uint32_t base_instance,
+                                               const InstanceRange &written)
+{
+    uint32_t first_instance = base_instance + written.first;
+    uint32_t num_written = written.second - written.first;
+
+    addFlushRange(frame_state, frame_state.transformPtr + first_instance,
+                  num_written * sizeof(glm::mat4x3));
+
+    if (frame_state.materialPtr) {
+        addFlushRange(frame_state, frame_state.materialPtr + first_instance,
+                      num_written * sizeof(uint32_t));
+    }
+}
+
+void CommandStreamState::flushParams(PerFrameState &frame_state)
+{
+    auto &ranges = frame_state.flushRanges;
+    if (ranges.empty()) return;
+
+    // Coalesce overlapping and adjacent ranges to minimize flush calls
+    sort(ranges.begin(), ranges.end());
+
+    VkDeviceSize start = ranges[0].first;
+    VkDeviceSize end = start + ranges[0].second;
+    for (uint32_t range_idx = 1; range_idx < ranges.size(); range_idx++) {
+        auto [offset, num_bytes] = ranges[range_idx];
+        if (offset > end) {
+            per_render_buffer_.flush(dev, start, end - start);
+            start = offset;
+        }
+
+        end = max(end, offset + num_bytes);
     }
 
+    per_render_buffer_.flush(dev, start, end - start);
+
+    ranges.clear();
+}
+
+void CommandStreamState::assignLights(PerFrameState &frame_state,
+                                      const Environment &env,
+                                      uint32_t batch_idx,
+                                      uint32_t &light_offset,
+                                      uint32_t &index_offset)
+{
+    constexpr uint32_t tile_dim = VulkanConfig::light_tile_dim;
+    constexpr uint32_t num_tiles = VulkanConfig::light_tiles_per_env;
+    // The last tile holds lights that affect every tile
+    constexpr uint32_t global_tile = num_tiles - 1;
+
+    const vector<LightProperties> &lights = env.state_->lights;
+    uint32_t num_lights = lights.size();
+    assert(light_offset + num_lights <= VulkanConfig::max_lights);
+
+    LightProperties *light_ptr = frame_state.lightPtr + light_offset;
+    LightTile *tiles = frame_state.lightTilePtr + batch_idx * num_tiles;
+
+    // Count the lights in each tile, then fill in the index lists
+    array<uint32_t, num_tiles> tile_counts {};
+    light_bounds_.resize(num_lights);
+
+    for (uint32_t light_idx = 0; light_idx < num_lights; light_idx++) {
+        const LightProperties &light = lights[light_idx];
+        float radius = light.position.w;
+
+        glm::vec3 view_pos =
+            env.view_ * glm::vec4(glm::vec3(light.position), 1.f);
+
+        light_ptr[light_idx] = {
+            glm::vec4(view_pos, radius),
+            light.color
+        };
+
+        glm::u32vec4 &bounds = light_bounds_[light_idx];
+        if (radius <= 0.f) {
+            bounds = glm::u32vec4(0);
+            tile_counts[global_tile]++;
+            continue;
+        }
+
+        if (!sphereTileBounds(env.state_->projection, view_pos, radius,
+                              tile_dim, bounds)) {
+            bounds = glm::u32vec4(0);
+            continue;
+        }
+
+        for (uint32_t y = bounds.y; y < bounds.w; y++) {
+            for (uint32_t x = bounds.x; x < bounds.z; x++) {
+                tile_counts[y * tile_dim + x]++;
+            }
+        }
+    }
+
+    for (uint32_t tile_idx = 0; tile_idx < num_tiles; tile_idx++) {
+        tiles[tile_idx] = { index_offset, 0 };
+        index_offset += tile_counts[tile_idx];
+    }
+
+    assert(index_offset <= VulkanConfig::max_light_indices);
+
+    uint32_t *index_ptr = frame_state.lightIndexPtr;
+    for (uint32_t light_idx = 0; light_idx < num_lights; light_idx++) {
+        uint32_t global_idx = light_offset + light_idx;
+        const glm::u32vec4 &bounds = light_bounds_[light_idx];
+
+        if (lights[light_idx].position.w <= 0.f) {
+            LightTile &tile = tiles[global_tile];
+            index_ptr[tile.offset + tile.count++] = global_idx;
+            continue;
+        }
+
+        for (uint32_t y = bounds.y; y < bounds.w; y++) {
+            for (uint32_t x = bounds.x; x < bounds.z; x++) {
+                LightTile &tile = tiles[y * tile_dim + x];
+                index_ptr[tile.offset + tile.count++] = global_idx;
+            }
+        }
+    }
+
+    light_offset += num_lights;
+}
+
+void CommandStreamState::writeViewsAndLights(PerFrameState &frame_state,
+                                             const vector<Environment> &envs)
+{
+    ViewInfo *view_ptr = frame_state.viewPtr;
+
+    addFlushRange(frame_state, view_ptr, sizeof(ViewInfo) * envs.size());
+
+    for (const Environment &env : envs) {
+        view_ptr->view = env.view_;
+        view_ptr->projection = env.state_->projection;
+        view_ptr++;
+    }
+
+    if (!frame_state.lightPtr) return;
+
+    // Each env's lights are transformed into its view space and binned
+    // into screen tiles, so fragments only shade against nearby lights
+    uint32_t light_offset = 0;
+    uint32_t index_offset = 0;
+    for (uint32_t batch_idx = 0; batch_idx < envs.size(); batch_idx++) {
+        assignLights(frame_state, envs[batch_idx], batch_idx,
+                     light_offset, index_offset);
+    }
+
+    addFlushRange(frame_state, frame_state.lightPtr,
+                  light_offset * sizeof(LightProperties));
+    addFlushRange(frame_state, frame_state.lightIndexPtr,
+                  index_offset * sizeof(uint32_t));
+    addFlushRange(frame_state, frame_state.lightTilePtr,
+                  envs.size() * VulkanConfig::light_tiles_per_env *
+                      sizeof(LightTile));
+}
+
+uint32_t CommandStreamState::recordEnvDraws(VkCommandBuffer render_cmd,
+                                            PerFrameState &frame_state,
+                                            const vector<Environment> &envs,
+                                            uint32_t order_begin,
+                                            uint32_t order_end,
+                                            uint32_t base_instance,
+                                            bool track_dirty)
+{
+    uint32_t cur_instance = base_instance;
+    glm::mat4x3 *transform_ptr = frame_state.transformPtr + base_instance;
+    uint32_t *material_ptr = frame_state.materialPtr ?
+        frame_state.materialPtr + base_instance : nullptr;
+    VkBuffer bound_geometry = VK_NULL_HANDLE;
+    for (uint32_t order_idx = order_begin; order_idx < order_end;
+         order_idx++) {
+        uint32_t batch_idx = env_order_[order_idx];
+        const Environment &env = envs[batch_idx];
+        const Scene &scene = *(env.state_->scene);
+
+        bindEnvironment(render_cmd, frame_state, batch_idx);
+        bindGeometry(render_cmd, scene, bound_geometry);
+
+        optional<Frustum> frustum;
+        if (cpu_culling_) {
+            frustum = extractFrustum(env.state_->projection, env.view_);
+        }
+
+        if (track_dirty) {
+            beginEnvUpload(batch_idx, env);
+        }
+
+        for (uint32_t mesh_idx = 0; mesh_idx < scene.meshes.size();
+                mesh_idx++) {
+            if (env.transforms_[mesh_idx].size() == 0) continue;
+
+            InstanceRange written;
+            uint32_t num_instances = copyInstances(env, batch_idx, mesh_idx,
+                cur_instance, frustum ? &*frustum : nullptr, track_dirty,
+                transform_ptr, material_ptr, written);
+
+            if (track_dirty) {
+                addInstanceFlushRange(frame_state, cur_instance, written);
+            }
+
+            if (num_instances == 0) continue;
+
+            auto &mesh = scene.meshes[mesh_idx];
+
+            dev.dt.cmdDrawIndexed(render_cmd, mesh.numIndices, num_instances,
+                                  mesh.startIndex, mesh.vertexOffset,
+                                  cur_instance);
+
+            cur_instance += num_instances;
+            transform_ptr += num_instances;
+
+            if (material_ptr) {
+                material_ptr += num_instances;
+            }
+        }
+    }
+
+    return cur_instance - base_instance;
+}
+
+uint32_t CommandStreamState::recordDraws(PerFrameState &frame_state,
+                                         const vector<Environment> &envs)
+{
+    VkCommandBuffer render_cmd = frame_state.commands[0];
+    beginCommands(render_cmd);
+
+    const uint32_t num_envs = envs.size();
+    uint32_t num_slices = min<uint32_t>(frame_state.sliceCommands.size(),
+                                        num_envs);
+
+    if (num_slices <= 1) {
+        beginRenderPass(render_cmd, frame_state);
+
+        uint32_t num_instances = recordEnvDraws(render_cmd, frame_state,
+                                                envs, 0, num_envs, 0, true);
+
+        endRenderPass(render_cmd);
+
+        return num_instances;
+    }
+
+    // Each slice records a contiguous range of the env order and writes
+    // instance data starting after every instance of the envs before it,
+    // so slices never touch the same region of the param buffer
+    uint32_t envs_per_slice = (num_envs + num_slices - 1) / num_slices;
+    num_slices = (num_envs + envs_per_slice - 1) / envs_per_slice;
+
+    DynArray<uint32_t> slice_instance_offsets(num_slices);
+    uint32_t total_instances = 0;
+    for (uint32_t slice_idx = 0; slice_idx < num_slices; slice_idx++) {
+        slice_instance_offsets[slice_idx] = total_instances;
+
+        uint32_t order_end = min((slice_idx + 1) * envs_per_slice, num_envs);
+        for (uint32_t order_idx = slice_idx * envs_per_slice;
+             order_idx < order_end; order_idx++) {
+            const Environment &env = envs[env_order_[order_idx]];
+            for (const auto &transforms : env.transforms_) {
+                total_instances += transforms.size();
+            }
+        }
+    }
+
+    assert(total_instances < VulkanConfig::max_instances);
+
+    VkCommandBufferInheritanceInfo inheritance_info {};
+    inheritance_info.sType =
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance_info.renderPass = render_pass_;
+    inheritance_info.subpass = 0;
+    inheritance_info.framebuffer = frame_state.framebuffer;
+
+    VkCommandBufferBeginInfo slice_begin_info {};
+    slice_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    slice_begin_info.flags =
+        VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    slice_begin_info.pInheritanceInfo = &inheritance_info;
+
+    record_pool_->parallelFor(num_slices, [&](uint32_t slice_idx) {
+        VkCommandBuffer slice_cmd = frame_state.sliceCommands[slice_idx];
+        REQ_VK(dev.dt.beginCommandBuffer(slice_cmd, &slice_begin_info));
+
+        // Bound state isn't inherited from the primary command buffer
+        bindPipeline(slice_cmd, frame_state);
+
+        uint32_t order_begin = slice_idx * envs_per_slice;
+        uint32_t order_end = min(order_begin + envs_per_slice, num_envs);
+
+        // Slices can't share the upload tracking state, so they write
+        // every instance
+        recordEnvDraws(slice_cmd, frame_state, envs, order_begin, order_end,
+                       slice_instance_offsets[slice_idx], false);
+
+        REQ_VK(dev.dt.endCommandBuffer(slice_cmd));
+    });
+
+    beginRenderPass(render_cmd, frame_state,
+                    VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+    dev.dt.cmdExecuteCommands(render_cmd, num_slices,
+                              frame_state.sliceCommands.data());
+
+    endRenderPass(render_cmd);
+
+    addInstanceFlushRange(frame_state, 0, { 0, total_instances });
+
+    // With CPU culling this also counts culled instances, which only
+    // leave gaps between slices
+    return total_instances;
+}
+
+bool CommandStreamState::isRecordingCurrent(
+        const PerFrameState &frame_state,
+        const vector<Environment> &envs) const
+{
+    const auto &recorded_scenes = frame_state.recordedScenes;
+    if (recorded_scenes.size() != envs.size()) {
+        return false;
+    }
+
+    for (uint32_t batch_idx = 0; batch_idx < envs.size(); batch_idx++) {
+        if (recorded_scenes[batch_idx] != envs[batch_idx].state_->scene) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CommandStreamState::recordIndirectDraws(PerFrameState &frame_state,
+                                             const vector<Environment> &envs)
+{
+    VkCommandBuffer render_cmd = frame_state.commands[0];
+    beginCommands(render_cmd);
+
+    if (gpu_culling_) {
+        uint32_t total_draws = 0;
+        for (const Environment &env : envs) {
+            total_draws += env.state_->scene->meshes.size();
+        }
+
+        recordCulling(render_cmd, frame_state, total_draws);
+    }
+
+    beginRenderPass(render_cmd, frame_state);
+
+    // Each env gets a fixed range of draws covering every mesh in its
+    // scene. Only instance counts and offsets are written per frame, so
+    // the mesh specific arguments are filled in once here. With GPU
+    // culling the full draws are rewritten each frame instead, since
+    // empty meshes are compacted out of the range.
+    uint32_t num_draws = 0;
+    frame_state.recordedScenes.assign(envs.size(), nullptr);
+    VkBuffer bound_geometry = VK_NULL_HANDLE;
+    for (uint32_t batch_idx : env_order_) {
+        const shared_ptr<Scene> &scene = envs[batch_idx].state_->scene;
+
+        bindEnvironment(render_cmd, frame_state, batch_idx);
+        bindGeometry(render_cmd, *scene, bound_geometry);
+
+        uint32_t num_meshes = scene->meshes.size();
+        assert(num_draws + num_meshes <= VulkanConfig::max_draws);
+
+        for (uint32_t mesh_idx = 0; !gpu_culling_ && mesh_idx < num_meshes;
+             mesh_idx++) {
+            const InlineMesh &mesh = scene->meshes[mesh_idx];
+
+            VkDrawIndexedIndirectCommand &draw =
+                frame_state.drawPtr[num_draws + mesh_idx];
+            draw.indexCount = mesh.numIndices;
+            draw.instanceCount = 0;
+            draw.firstIndex = mesh.startIndex;
+            draw.vertexOffset = mesh.vertexOffset;
+            draw.firstInstance = 0;
+        }
+
+        if (num_meshes > 0 && gpu_culling_) {
+            dev.dt.cmdDrawIndexedIndirectCount(render_cmd,
+                cull_buffer_->buffer,
+                frame_state.cull.drawBufferOffset +
+                    num_draws * sizeof(VkDrawIndexedIndirectCommand),
+                per_render_buffer_.buffer,
+                frame_state.cull.drawCountBufferOffset +
+                    batch_idx * sizeof(uint32_t),
+                num_meshes, sizeof(VkDrawIndexedIndirectCommand));
+        } else if (num_meshes > 0) {
+            dev.dt.cmdDrawIndexedIndirect(render_cmd,
+                per_render_buffer_.buffer,
+                frame_state.drawBufferOffset +
+                    num_draws * sizeof(VkDrawIndexedIndirectCommand),
+                num_meshes, sizeof(VkDrawIndexedIndirectCommand));
+        }
+
+        num_draws += num_meshes;
+        frame_state.recordedScenes[batch_idx] = scene;
+    }
+
+    endRenderPass(render_cmd);
+}
+
+uint32_t CommandStreamState::writeIndirectDraws(
+        PerFrameState &frame_state,
+        const vector<Environment> &envs)
+{
+    uint32_t cur_instance = 0;
+    VkDrawIndexedIndirectCommand *draw_ptr = frame_state.drawPtr;
+    glm::mat4x3 *transform_ptr = frame_state.transformPtr;
+    uint32_t *material_ptr = frame_state.materialPtr;
+    for (uint32_t batch_idx : env_order_) {
+        const Environment &env = envs[batch_idx];
+        uint32_t num_meshes = env.state_->scene->meshes.size();
+
+        optional<Frustum> frustum;
+        if (cpu_culling_) {
+            frustum = extractFrustum(env.state_->projection, env.view_);
+        }
+
+        beginEnvUpload(batch_idx, env);
+
+        for (uint32_t mesh_idx = 0; mesh_idx < num_meshes; mesh_idx++) {
+            uint32_t num_instances = 0;
+            if (env.transforms_[mesh_idx].size() > 0) {
+                InstanceRange written;
+                num_instances = copyInstances(env, batch_idx, mesh_idx,
+                    cur_instance, frustum ? &*frustum : nullptr, true,
+                    transform_ptr, material_ptr, written);
+
+                addInstanceFlushRange(frame_state, cur_instance, written);
+            }
+
+            draw_ptr->instanceCount = num_instances;
+            draw_ptr->firstInstance = cur_instance;
+            draw_ptr++;
+
+            cur_instance += num_instances;
+            transform_ptr += num_instances;
+
+            if (material_ptr) {
+                material_ptr += num_instances;
+            }
+        }
+    }
+
+    addFlushRange(frame_state, frame_state.drawPtr,
+                  (draw_ptr - frame_state.drawPtr) *
+                      sizeof(VkDrawIndexedIndirectCommand));
+
+    return cur_instance;
+}
+
+uint32_t CommandStreamState::writeCullingDraws(
+        PerFrameState &frame_state,
+        const vector<Environment> &envs)
+{
+    PerFrameCullState &cull = frame_state.cull;
+
+    uint32_t cur_instance = 0;
+    uint32_t env_draw_base = 0;
+    glm::mat4x3 *transform_ptr = frame_state.transformPtr;
+    uint32_t *material_ptr = frame_state.materialPtr;
+    uint32_t *instance_draw_ptr = cull.instanceDrawPtr;
+    for (uint32_t batch_idx : env_order_) {
+        const Environment &env = envs[batch_idx];
+        const Scene &scene = *(env.state_->scene);
+        uint32_t num_meshes = scene.meshes.size();
+
+        // Instance counts start at 0 and are filled in by the culling
+        // pass, firstInstance reserves room for every instance. Nonzero
+        // firstInstance needs drawIndirectFirstInstance, which makeDevice
+        // enables for GpuCulling.
+        uint32_t num_env_draws = 0;
+        for (uint32_t mesh_idx = 0; mesh_idx < num_meshes; mesh_idx++) {
+            uint32_t num_instances = env.transforms_[mesh_idx].size();
+            if (num_instances == 0) continue;
+
+            const InlineMesh &mesh = scene.meshes[mesh_idx];
+            uint32_t draw_idx = env_draw_base + num_env_draws;
+
+            frame_state.drawPtr[draw_idx] = {
+                mesh.numIndices,
+                0,
+                mesh.startIndex,
+                static_cast<int32_t>(mesh.vertexOffset),
+                cur_instance
+            };
+
+            cull.drawPtr[draw_idx] = {
+                mesh.aabbMin,
+                batch_idx,
+                mesh.aabbMax,
+                0
+            };
+
+            instance_draw_ptr = fill_n(instance_draw_ptr, num_instances,
+                                       draw_idx);
+
+            memcpy(transform_ptr, env.transforms_[mesh_idx].data(),
+                   sizeof(glm::mat4x3) * num_instances);
+
+            cur_instance += num_instances;
+            transform_ptr += num_instances;
+
+            if (material_ptr) {
+                memcpy(material_ptr, env.materials_[mesh_idx].data(),
+                       num_instances * sizeof(uint32_t));
+
+                material_ptr += num_instances;
+            }
+
+            num_env_draws++;
+        }
+
+        cull.drawCountPtr[batch_idx] = num_env_draws;
+        env_draw_base += num_meshes;
+    }
+
+    *cull.infoPtr = {
+        (cur_instance + VulkanConfig::cull_workgroup_size - 1) /
+            VulkanConfig::cull_workgroup_size,
+        1,
+        1,
+        cur_instance
+    };
+
+    addInstanceFlushRange(frame_state, 0, { 0, cur_instance });
+    addFlushRange(frame_state, frame_state.drawPtr,
+                  env_draw_base * sizeof(VkDrawIndexedIndirectCommand));
+    addFlushRange(frame_state, cull.drawPtr,
+                  env_draw_base * sizeof(DrawCullInfo));
+    addFlushRange(frame_state, cull.instanceDrawPtr,
+                  cur_instance * sizeof(uint32_t));
+    addFlushRange(frame_state, cull.infoPtr, sizeof(CullingInfo));
+    addFlushRange(frame_state, cull.drawCountPtr,
+                  envs.size() * sizeof(uint32_t));
+
+    return cur_instance;
 }
 
 uint32_t CommandStreamState::render(const vector<Environment> &envs)
@@ -1028,21 +3029,102 @@ uint32_t CommandStreamState::render(const vector<Environment> &envs)
     });
 }
 
+static uint32_t getNumFramesInFlight(const RenderConfig &cfg,
+                                     RenderOptions opts)
+{
+    if (cfg.numFramesInFlight > 0) {
+        return cfg.numFramesInFlight;
+    }
+
+    return (opts & RenderOptions::DoubleBuffered) ? 2 : 1;
+}
+
+DeviceFeatures getDeviceFeatures(RenderOptions opts)
+{
+    bool gpu_culling = opts & RenderOptions::GpuCulling;
+
+    return DeviceFeatures {
+        gpu_culling || (opts & RenderOptions::IndirectDraw),
+        gpu_culling,
+        opts & RenderOptions::LayeredOutput,
+    };
+}
+
 template <typename PipelineType>
 VulkanState::VulkanState(const RenderConfig &config,
                          const RenderFeatures<PipelineType> &features,
                          const DeviceUUID &uuid)
-    : VulkanState(config, features, [&config, &uuid]() {
+    : VulkanState(config, features, [&config, &features, &uuid]() {
         InstanceState inst_state(false, {});
         DeviceState dev_state(
                 inst_state.makeDevice(uuid,
                                       config.numStreams + config.numLoaders,
                                       1,
-                                      config.numLoaders, nullptr));
+                                      config.numLoaders,
+                                      getDeviceFeatures(features.options),
+                                      nullptr));
         return CoreVulkanHandles { move(inst_state), move(dev_state) };
     }())
 {}
 
+template <typename PipelineType>
+static uint32_t getMaterialParamBinding()
+{
+    using Props = PipelineProps<PipelineType>;
+
+    if constexpr (Props::needMaterial) {
+        // Material params follow the sampler and textures
+        return Props::PerSceneLayout::NumBindings - 1;
+    } else {
+        return 0;
+    }
+}
+
+template <typename PipelineType>
+static type_index getSceneLayoutType()
+{
+    using Props = PipelineProps<PipelineType>;
+
+    // The layout type encodes each binding's type, count, stages and
+    // flags. Immutable samplers all come from makeImmutableSampler.
+    if constexpr (Props::needMaterial) {
+        return typeid(typename Props::PerSceneLayout);
+    } else {
+        return typeid(void);
+    }
+}
+
+template <typename PipelineType>
+PipelineVariant::PipelineVariant(const InstanceState &inst,
+                                 const DeviceState &dev,
+                                 MemoryAllocator &alloc,
+                                 const RenderConfig &cfg,
+                                 const RenderFeatures<PipelineType> &features,
+                                 VkPipelineCache pipeline_cache,
+                                 uint32_t vertex_stride)
+    : fbCfg(PipelineImpl<PipelineType>::getFramebufferConfig(
+              cfg, getNumFramesInFlight(cfg, features.options),
+              features.options)),
+      renderState(PipelineImpl<PipelineType>::makeRenderState(
+              dev, fbCfg, cfg.batchSize, cfg.numStreams,
+              getNumFramesInFlight(cfg, features.options),
+              features.options, alloc)),
+      pipeline(PipelineImpl<PipelineType>::makePipeline(
+              dev, fbCfg, renderState, pipeline_cache, vertex_stride)),
+      fb(makeFramebuffer(inst, dev, alloc, fbCfg, renderState)),
+      batchSize(cfg.batchSize),
+      maxNumStreams(cfg.numStreams),
+      numFramesInFlight(getNumFramesInFlight(cfg, features.options)),
+      needMaterial(PipelineProps<PipelineType>::needMaterial),
+      cpuSync(features.options & RenderOptions::CpuSynchronization),
+      indirectDraw(features.options & RenderOptions::IndirectDraw),
+      gpuCulling(features.options & RenderOptions::GpuCulling),
+      cpuCulling(features.options & RenderOptions::CpuCulling),
+      parallelRecording(
+          features.options & RenderOptions::ParallelRecording),
+      numStreams(0)
+{}
+
 template <typename PipelineType>
 VulkanState::VulkanState(const RenderConfig &cfg,
                          const RenderFeatures<PipelineType> &features,
@@ -1051,64 +3133,187 @@ VulkanState::VulkanState(const RenderConfig &cfg,
       dev(move(handles.dev)),
       queueMgr(dev),
       alloc(dev, inst),
-      fbCfg(PipelineImpl<PipelineType>::getFramebufferConfig(
-              cfg.batchSize, cfg.imgWidth,
-              cfg.imgHeight, cfg.numStreams,
-              features.options)),
-      renderState(PipelineImpl<PipelineType>::makeRenderState(
-              dev, cfg.batchSize, cfg.numStreams,
-              features.options, alloc)),
-      pipeline(PipelineImpl<PipelineType>::makePipeline(
-              dev, fbCfg, renderState)),
-      fb(makeFramebuffer(dev, alloc, fbCfg, renderState.renderPass)),
+      pipelineCachePath(getPipelineCachePath(inst, dev, cfg)),
+      pipelineCache(loadPipelineCache(dev, pipelineCachePath)),
       globalTransform(cfg.coordinateTransform),
       loader_impl_(
               LoaderImpl::create<typename PipelineType::Vertex,
                                  typename PipelineType::MaterialParams>()),
+      scene_vertex_attrs_(
+              PipelineProps<PipelineType>::vertexAttributes.begin(),
+              PipelineProps<PipelineType>::vertexAttributes.end()),
+      scene_vertex_stride_(sizeof(typename PipelineType::Vertex)),
+      scene_material_type_(typeid(typename PipelineType::MaterialParams)),
+      scene_layout_type_(getSceneLayoutType<PipelineType>()),
+      variants_(),
+      material_table_(),
+      geometry_heap_(alloc, scene_vertex_stride_,
+                     cfg.geometryBlockBytes > 0 ? cfg.geometryBlockBytes :
+                         VulkanConfig::default_geometry_block_bytes),
+      load_pool_(max(thread::hardware_concurrency(), 2u) - 1),
       num_loaders_(0),
-      num_streams_(0),
       max_num_loaders_(cfg.numLoaders),
-      max_num_streams_(cfg.numStreams),
-      batch_size_(cfg.batchSize),
-      double_buffered_(features.options & RenderOptions::DoubleBuffered),
-      cpu_sync_(features.options & RenderOptions::CpuSynchronization)
-{}
+      loader_staging_bytes_(cfg.loaderStagingBytes > 0 ?
+          cfg.loaderStagingBytes :
+          VulkanConfig::default_loader_staging_bytes),
+      record_pool_()
+{
+    addVariant(cfg, features);
+
+    const RenderState &render_state = variants_[0].renderState;
+    material_table_.emplace(dev, alloc,
+                            render_state.sceneDescriptorLayout,
+                            render_state.makeScenePool,
+                            getMaterialParamBinding<PipelineType>(),
+                            loader_impl_.materialParamBytes);
+}
+
+VulkanState::~VulkanState()
+{
+    if (!pipelineCachePath.empty()) {
+        savePipelineCache(dev, pipelineCache, pipelineCachePath);
+    }
+
+    dev.dt.destroyPipelineCache(dev.hdl, pipelineCache, nullptr);
+}
+
+template <typename PipelineType>
+uint32_t VulkanState::addVariant(const RenderConfig &cfg,
+                                 const RenderFeatures<PipelineType> &features)
+{
+    using Props = PipelineProps<PipelineType>;
+
+    // Scenes are only loaded once, in the first variant's format, so
+    // every variant has to read a subset of the same vertex layout
+    for (const VkVertexInputAttributeDescription &attr :
+         Props::vertexAttributes) {
+        if (attr.location >= scene_vertex_attrs_.size() ||
+            scene_vertex_attrs_[attr.location].format != attr.format ||
+            scene_vertex_attrs_[attr.location].offset != attr.offset) {
+            cerr << "Pipeline vertex format is incompatible with the " <<
+                "renderer's scenes" << endl;
+            fatalExit();
+        }
+    }
+
+    if (Props::needMaterial &&
+        type_index(typeid(typename PipelineType::MaterialParams)) !=
+            scene_material_type_) {
+        cerr << "Pipeline materials are incompatible with the " <<
+            "renderer's scenes" << endl;
+        fatalExit();
+    }
+
+    if (Props::needTextures && !dev.textureUpdateAfterBind) {
+        cerr << "GPU does not support " <<
+            "descriptorBindingSampledImageUpdateAfterBind and " <<
+            "descriptorBindingUpdateUnusedWhilePending, which pipelines " <<
+            "with textures need" << endl;
+        fatalExit();
+    }
+
+    // Pipelines can share MaterialParams but still differ in textures
+    if (Props::needMaterial &&
+        getSceneLayoutType<PipelineType>() != scene_layout_type_) {
+        cerr << "Pipeline material descriptors are incompatible with " <<
+            "the renderer's material table" << endl;
+        fatalExit();
+    }
+
+    // The device only has the features the first pipeline asked for
+    DeviceFeatures needed_features = getDeviceFeatures(features.options);
+    if (needed_features.multiDrawIndirect &&
+        !dev.features.multiDrawIndirect) {
+        cerr << "RenderOptions::IndirectDraw and RenderOptions::GpuCulling " <<
+            "need multiDrawIndirect, which is only enabled if the " <<
+            "renderer's first pipeline uses one of them" << endl;
+        fatalExit();
+    }
+
+    if (needed_features.drawIndirectCount &&
+        !dev.features.drawIndirectCount) {
+        cerr << "RenderOptions::GpuCulling needs drawIndirectCount, which " <<
+            "is only enabled if the renderer's first pipeline uses it" <<
+            endl;
+        fatalExit();
+    }
+
+    if (needed_features.viewportIndexLayer &&
+        !dev.features.viewportIndexLayer) {
+        cerr << "RenderOptions::LayeredOutput needs " <<
+            VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME <<
+            ", which is only enabled if the renderer's first pipeline " <<
+            "uses it" << endl;
+        fatalExit();
+    }
+
+    if ((features.options & RenderOptions::ParallelRecording) &&
+        !record_pool_) {
+        record_pool_.reset(
+            new ThreadPool(max(thread::hardware_concurrency(), 2u) - 1));
+    }
 
-LoaderState VulkanState::makeLoader()
+    variants_.emplace_back(inst, dev, alloc, cfg, features, pipelineCache,
+                           scene_vertex_stride_);
+
+    return variants_.size() - 1;
+}
+
+Handle<LoaderState> VulkanState::makeLoader()
 {
     num_loaders_++;
     assert(num_loaders_ <= max_num_loaders_);
 
-    return LoaderState(dev, loader_impl_,
-                       renderState.sceneDescriptorLayout,
-                       renderState.makeScenePool,
+    return make_handle<LoaderState>(dev, loader_impl_,
+                       *material_table_,
+                       geometry_heap_,
+                       load_pool_,
                        alloc, queueMgr,
-                       globalTransform);
+                       globalTransform,
+                       loader_staging_bytes_);
 }
 
-CommandStreamState VulkanState::makeStream()
+CommandStreamState VulkanState::makeStream(uint32_t variant_idx)
 {
-    uint32_t stream_idx = num_streams_++;
-    assert(stream_idx < max_num_streams_);
+    PipelineVariant &variant = variants_[variant_idx];
 
-    uint32_t num_frames_inflight = double_buffered_ ? 2 : 1;
+    uint32_t stream_idx = variant.numStreams++;
+    assert(stream_idx < variant.maxNumStreams);
 
     return CommandStreamState(inst,
                               dev,
-                              fbCfg,
-                              renderState,
-                              pipeline,
-                              fb,
+                              variant.fbCfg,
+                              variant.renderState,
+                              variant.pipeline,
+                              variant.fb,
+                              // addVariant checks every layout with a
+                              // material set matches the table's
+                              variant.needMaterial ?
+                                  material_table_->getSet() :
+                                  VK_NULL_HANDLE,
                               alloc,
                               queueMgr,
-                              batch_size_,
+                              variant.batchSize,
                               stream_idx,
-                              num_frames_inflight,
-                              cpu_sync_);
+                              variant.numFramesInFlight,
+                              variant.cpuSync,
+                              variant.indirectDraw,
+                              variant.gpuCulling,
+                              variant.cpuCulling,
+                              variant.parallelRecording ?
+                                  record_pool_.get() : nullptr);
 }
 
 int VulkanState::getFramebufferFD() const
 {
+    const FramebufferState &fb = variants_[0].fb;
+
+    if (fb.resultMem == VK_NULL_HANDLE) {
+        cerr << "Framebuffer can't be exported with " <<
+            "RenderOptions::HostReadback" << endl;
+        fatalExit();
+    }
+
     VkMemoryGetFdInfoKHR fd_info;
     fd_info.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
     fd_info.pNext = nullptr;
@@ -1123,7 +3328,7 @@ int VulkanState::getFramebufferFD() const
 
 uint64_t VulkanState::getFramebufferBytes() const
 {
-    return fbCfg.totalLinearBytes;
+    return variants_[0].fbCfg.totalLinearBytes;
 }
 
 }
@@ -7,6 +7,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <typeindex>
 #include <vector>
 
 #include <glm/glm.hpp>
@@ -15,9 +16,11 @@
 #include <v4r/config.hpp>
 #include <v4r/environment.hpp>
 
+#include "culling.hpp"
 #include "descriptors.hpp"
 #include "scene.hpp"
 #include "shader.hpp"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 #include "vulkan_handles.hpp"
 #include "vulkan_memory.hpp"
@@ -36,6 +39,9 @@ public:
     uint32_t frameHeight;
     uint32_t totalWidth;
     uint32_t totalHeight;
+    uint32_t totalLayers;
+    // batchSize when layered, otherwise frames share layer 0
+    uint32_t layersPerFrame;
 
     uint64_t colorLinearBytesPerFrame;
     uint64_t depthLinearBytesPerFrame;
@@ -45,18 +51,34 @@ public:
 
     bool colorOutput;
     bool depthOutput;
+    bool layeredOutput;
+    bool hostReadback;
+
+    // packColor / packDepth are set when the output is written by the
+    // packing pass rather than copied
+    ColorFormat colorFormat;
+    ColorLayout colorLayout;
+    bool packColor;
+    DepthFormat depthFormat;
+    float maxDepth;
+    bool packDepth;
 
     std::vector<VkClearValue> clearValues;
 };
 
-// FIXME separate out things like the layout, cache (maybe renderpass)
-// into PipelineManager
+// FIXME separate out things like the layout (maybe renderpass) into
+// PipelineManager
 struct PipelineState {
     std::vector<VkShaderModule> shaders;
 
-    VkPipelineCache pipelineCache;
     VkPipelineLayout gfxLayout;
     VkPipeline gfxPipeline;
+
+    VkPipelineLayout cullLayout;
+    VkPipeline cullPipeline;
+
+    VkPipelineLayout packLayout;
+    VkPipeline packPipeline;
 };
 
 struct ParamBufferConfig {
@@ -69,17 +91,46 @@ struct ParamBufferConfig {
     VkDeviceSize totalMaterialIndexBytes;
 
     VkDeviceSize lightsOffset;
+    VkDeviceSize lightIndicesOffset;
+    VkDeviceSize lightTilesOffset;
     VkDeviceSize totalLightParamBytes;
 
+    VkDeviceSize drawOffset;
+    VkDeviceSize totalDrawBytes;
+
+    VkDeviceSize cullInfoOffset;
+    VkDeviceSize drawCountOffset;
+    VkDeviceSize drawCullOffset;
+    VkDeviceSize instanceDrawOffset;
+    VkDeviceSize totalCullBytes;
+
     VkDeviceSize totalParamBytes;
 };
 
+// Layout of the device local buffer the culling pass writes surviving
+// instances and draws into
+struct CullBufferConfig {
+    VkDeviceSize transformOffset;
+    VkDeviceSize materialOffset;
+    VkDeviceSize drawOffset;
+
+    VkDeviceSize totalBytes;
+};
+
 struct RenderState {
     ParamBufferConfig paramPositions;
+    CullBufferConfig cullPositions;
 
     VkDescriptorSetLayout frameDescriptorLayout;
     VkDescriptorPool frameDescriptorPool;
 
+    VkDescriptorSetLayout cullDescriptorLayout;
+    VkDescriptorPool cullDescriptorPool;
+
+    VkDescriptorSetLayout packDescriptorLayout;
+    VkDescriptorPool packDescriptorPool;
+    VkSampler packSampler;
+
     VkDescriptorSetLayout sceneDescriptorLayout;
     DescriptorManager::MakePoolType makeScenePool;
     VkSampler textureSampler;
@@ -93,37 +144,108 @@ struct PipelineProps;
 template <typename PipelineType>
 struct PipelineImpl {
     static FramebufferConfig getFramebufferConfig(
-            uint32_t batch_size, uint32_t img_width, uint32_t img_height,
-            uint32_t num_streams, const RenderOptions &opts);
+            const RenderConfig &cfg, uint32_t num_frames_per_stream,
+            const RenderOptions &opts);
 
     static RenderState makeRenderState(const DeviceState &dev,
+                                       const FramebufferConfig &fb_cfg,
                                        uint32_t batch_size,
                                        uint32_t num_streams,
+                                       uint32_t num_frames_per_stream,
                                        const RenderOptions &opts,
                                        MemoryAllocator &alloc);
 
     static PipelineState makePipeline(const DeviceState &dev,
                                       const FramebufferConfig &fb_cfg,
-                                      const RenderState &render_state);
+                                      const RenderState &render_state,
+                                      VkPipelineCache pipeline_cache,
+                                      uint32_t vertex_stride);
 };
 
 struct FramebufferState {
 public:
     std::vector<LocalImage> attachments;
-    std::vector<VkImageView> attachmentViews; 
 
-    VkFramebuffer hdl;
+    // With layered output every frame gets a framebuffer over just its
+    // own layers, since the render pass clears every layer it's given.
+    // Otherwise frames sit side by side in one framebuffer and the render
+    // area keeps them apart.
+    std::vector<VkImageView> attachmentViews;
+    std::vector<VkFramebuffer> hdls;
 
-    LocalBuffer resultBuffer;
+    VkFramebuffer getFrameHandle(uint32_t global_frame_idx) const
+    {
+        return hdls.size() == 1 ? hdls[0] : hdls[global_frame_idx];
+    }
+
+    // Exactly one of resultBuffer (device local, exported to CUDA) and
+    // readbackBuffer (host mapped) is set, see RenderOptions::HostReadback
+    std::optional<LocalBuffer> resultBuffer;
     VkDeviceMemory resultMem;
+    std::optional<HostBuffer> readbackBuffer;
+
+    // Array views of the attachments read by the packing pass
+    VkImageView colorPackView;
+    VkDescriptorSet colorPackSet;
+    VkImageView depthPackView;
+    VkDescriptorSet depthPackSet;
+
+    VkBuffer getResultBuffer() const
+    {
+        return readbackBuffer ? readbackBuffer->buffer :
+            resultBuffer->buffer;
+    }
+};
+
+struct PerFrameCullState {
+    VkDescriptorSet descriptorSet;
+
+    CullingInfo *infoPtr;
+    VkDeviceSize infoBufferOffset;
+    DrawCullInfo *drawPtr;
+    uint32_t *instanceDrawPtr;
+    uint32_t *drawCountPtr;
+    VkDeviceSize drawCountBufferOffset;
+
+    VkDeviceSize drawBufferOffset;
+};
+
+using InstanceRange = std::pair<uint32_t, uint32_t>;
+
+// Layout of the instance data last written for a batch slot into one
+// frame's param buffer, used to skip rewriting unchanged instances
+struct EnvUploadState {
+    // EnvironmentState::uploadID of the env written, 0 if none
+    uint64_t envID = 0;
+    std::vector<uint32_t> meshOffsets;
+    std::vector<uint32_t> meshCounts;
+
+    // Instances modified since this frame's copy was written, that were
+    // only uploaded into the other frames
+    std::vector<InstanceRange> pendingDirty;
+};
+
+// Caller owned host memory a frame's output is copied into. The copy
+// targets the imported memory directly when possible, otherwise
+// staging, which is copied to hostPtr when the frame is waited on.
+struct FrameOutput {
+    void *hostPtr;
+    VkDeviceSize numBytes;
+    std::optional<LocalBuffer> imported;
+    std::optional<HostBuffer> staging;
 };
 
 struct PerFrameState {
     VkFence fence;
+    // Timeline value signaled when the last batch rendered into this
+    // frame completes
+    uint64_t ticket;
     std::array<VkCommandBuffer, 2> commands;
     
     glm::u32vec2 baseFBOffset;
     DynArray<glm::u32vec2> batchFBOffsets;
+    uint32_t baseFBLayer;
+    VkFramebuffer framebuffer;
 
     VkDeviceSize colorBufferOffset;
     VkDeviceSize depthBufferOffset;
@@ -136,7 +258,27 @@ struct PerFrameState {
     ViewInfo *viewPtr;
     uint32_t *materialPtr;
     LightProperties *lightPtr;
-    uint32_t *numLightsPtr;
+    uint32_t *lightIndexPtr;
+    LightTile *lightTilePtr;
+
+    VkDeviceSize drawBufferOffset;
+    VkDrawIndexedIndirectCommand *drawPtr;
+
+    // Scenes referenced by the prerecorded indirect render commands
+    std::vector<std::shared_ptr<Scene>> recordedScenes;
+
+    PerFrameCullState cull;
+
+    // Secondary command buffers for parallel recording, one per slice
+    std::vector<VkCommandBuffer> sliceCommands;
+
+    std::vector<EnvUploadState> envUploads;
+
+    // Byte ranges of the param buffer written this frame
+    std::vector<std::pair<VkDeviceSize, VkDeviceSize>> flushRanges;
+
+    FrameOutput colorOutput;
+    FrameOutput depthOutput;
 };
 
 class CommandStreamState {
@@ -147,12 +289,17 @@ public:
                        const RenderState &render_state,
                        const PipelineState &pipeline,
                        const FramebufferState &fb,
+                       VkDescriptorSet material_set,
                        MemoryAllocator &alc,
                        QueueManager &queue_manager,
                        uint32_t batch_size,
                        uint32_t stream_idx,
                        uint32_t num_frames_inflight,
-                       bool cpu_sync);
+                       bool cpu_sync,
+                       bool indirect_draw,
+                       bool gpu_culling,
+                       bool cpu_culling,
+                       ThreadPool *record_pool);
 
     CommandStreamState(const CommandStreamState &) = delete;
     CommandStreamState(CommandStreamState &&) = default;
@@ -173,6 +320,11 @@ public:
         return frame_states_[frame_idx].baseFBOffset;
     }
 
+    uint32_t getFBLayer(uint32_t frame_idx) const
+    {
+        return frame_states_[frame_idx].baseFBLayer;
+    }
+
     VkDeviceSize getColorOffset(uint32_t frame_idx) const
     {
         return frame_states_[frame_idx].colorBufferOffset; 
@@ -183,6 +335,30 @@ public:
         return frame_states_[frame_idx].depthBufferOffset;
     }
 
+    VkDeviceSize getColorBytesPerFrame() const
+    {
+        return fb_cfg_.colorLinearBytesPerFrame;
+    }
+
+    VkDeviceSize getDepthBytesPerFrame() const
+    {
+        return fb_cfg_.depthLinearBytesPerFrame;
+    }
+
+    // Only valid with RenderOptions::HostReadback, once the frame is
+    // complete. Invalidates just the requested range of the frame.
+    uint8_t *getColorHostPtr(uint32_t frame_idx) const;
+    float *getDepthHostPtr(uint32_t frame_idx) const;
+
+    // Re-records the frame's copy commands, so the frame must not be in
+    // flight. A null ptr reverts to the internal result buffer.
+    void setColorOutput(uint32_t frame_idx, void *ptr, size_t num_bytes);
+    void setDepthOutput(uint32_t frame_idx, void *ptr, size_t num_bytes);
+
+    // Completes delivery into caller memory that couldn't be imported.
+    // Must be called after the frame is complete.
+    void copyStagedOutputs(uint32_t frame_idx) const;
+
     VkFence getFence(uint32_t frame_idx) const
     {
         return frame_states_[frame_idx].fence;
@@ -192,6 +368,19 @@ public:
         return cur_frame_;
     }
 
+    uint64_t getTicket(uint32_t frame_idx) const
+    {
+        return frame_states_[frame_idx].ticket;
+    }
+
+    VkSemaphore getTimeline() const
+    {
+        return frame_timeline_;
+    }
+
+    bool isTicketComplete(uint64_t ticket) const;
+    bool waitForTicket(uint64_t ticket, uint64_t timeout) const;
+
     uint32_t getNumFrames() const {
         return frame_states_.size();
     }
@@ -211,15 +400,129 @@ public:
     MemoryAllocator &alloc;
 
 private:
+    void *getReadbackPtr(VkDeviceSize offset, VkDeviceSize num_bytes) const;
+
+    void setFrameOutput(uint32_t frame_idx, FrameOutput &output,
+                        void *ptr, size_t num_bytes,
+                        VkDeviceSize frame_bytes);
+
+    void signalTimeline(PerFrameState &frame_state);
+
+    void beginCommands(VkCommandBuffer render_cmd);
+
+    // Binds the pipeline with the frame's and the material table's sets,
+    // which cover every scene in the batch, and the instance buffers
+    void bindPipeline(VkCommandBuffer render_cmd,
+                      const PerFrameState &frame_state);
+
+    void beginRenderPass(VkCommandBuffer render_cmd,
+                         const PerFrameState &frame_state,
+                         VkSubpassContents contents =
+                             VK_SUBPASS_CONTENTS_INLINE);
+
+    void groupEnvsByScene(const std::vector<Environment> &envs);
+
+    // Blocks until every scene in the batch has finished uploading
+    void waitForSceneUploads(const std::vector<Environment> &envs) const;
+
+    void bindEnvironment(VkCommandBuffer render_cmd,
+                         const PerFrameState &frame_state,
+                         uint32_t batch_idx);
+
+    // Binds the geometry heap block holding scene's vertices and indices,
+    // unless bound_geometry shows it's already bound
+    void bindGeometry(VkCommandBuffer render_cmd, const Scene &scene,
+                      VkBuffer &bound_geometry);
+
+    void endRenderPass(VkCommandBuffer render_cmd);
+
+    void recordCulling(VkCommandBuffer render_cmd,
+                       const PerFrameState &frame_state,
+                       uint32_t num_draws);
+
+    void beginEnvUpload(uint32_t batch_idx, const Environment &env);
+
+    InstanceRange consumeDirtyRange(uint32_t batch_idx,
+                                    const Environment &env,
+                                    uint32_t mesh_idx,
+                                    uint32_t cur_instance);
+
+    uint32_t copyInstances(const Environment &env,
+                           uint32_t batch_idx,
+                           uint32_t mesh_idx,
+                           uint32_t cur_instance,
+                           const Frustum *frustum,
+                           bool track_dirty,
+                           glm::mat4x3 *transform_ptr,
+                           uint32_t *material_ptr,
+                           InstanceRange &written);
+
+    void addFlushRange(PerFrameState &frame_state, const void *ptr,
+                       VkDeviceSize num_bytes);
+
+    void addInstanceFlushRange(PerFrameState &frame_state,
+                               uint32_t base_instance,
+                               const InstanceRange &written);
+
+    void flushParams(PerFrameState &frame_state);
+
+    void assignLights(PerFrameState &frame_state,
+                      const Environment &env,
+                      uint32_t batch_idx,
+                      uint32_t &light_offset,
+                      uint32_t &index_offset);
+
+    void writeViewsAndLights(PerFrameState &frame_state,
+                             const std::vector<Environment> &envs);
+
+    uint32_t recordEnvDraws(VkCommandBuffer render_cmd,
+                            PerFrameState &frame_state,
+                            const std::vector<Environment> &envs,
+                            uint32_t order_begin,
+                            uint32_t order_end,
+                            uint32_t base_instance,
+                            bool track_dirty);
+
+    uint32_t recordDraws(PerFrameState &frame_state,
+                         const std::vector<Environment> &envs);
+
+    bool isRecordingCurrent(const PerFrameState &frame_state,
+                            const std::vector<Environment> &envs) const;
+
+    void recordIndirectDraws(PerFrameState &frame_state,
+                             const std::vector<Environment> &envs);
+
+    uint32_t writeIndirectDraws(PerFrameState &frame_state,
+                                const std::vector<Environment> &envs);
+
+    uint32_t writeCullingDraws(PerFrameState &frame_state,
+                               const std::vector<Environment> &envs);
+
     const FramebufferConfig &fb_cfg_;
     const FramebufferState &fb_;
+    VkDescriptorSet material_set_;
     VkRenderPass render_pass_;
     HostBuffer per_render_buffer_;
+    std::optional<LocalBuffer> cull_buffer_;
 
     glm::u32vec2 render_size_;
     glm::u32vec2 render_extent_;
     std::vector<PerFrameState> frame_states_;
     uint32_t cur_frame_;
+    bool indirect_draw_;
+    bool gpu_culling_;
+    bool cpu_culling_;
+    ThreadPool *record_pool_;
+    std::vector<VkCommandPool> slice_pools_;
+
+    VkSemaphore frame_timeline_;
+    uint64_t next_ticket_;
+
+    // Batch indices sorted so envs sharing a scene are recorded together
+    std::vector<uint32_t> env_order_;
+
+    // Scratch space for assigning lights to tiles
+    std::vector<glm::u32vec4> light_bounds_;
 };
 
 struct CoreVulkanHandles {
@@ -227,6 +530,41 @@ struct CoreVulkanHandles {
     DeviceState dev;
 };
 
+// Optional device features a pipeline created with opts relies on
+DeviceFeatures getDeviceFeatures(RenderOptions opts);
+
+// Everything specific to one PipelineType: its framebuffers, render pass
+// and pipelines. A VulkanState hosts one or more variants, which share
+// its device, queues, loaders and scenes.
+struct PipelineVariant {
+    template <typename PipelineType>
+    PipelineVariant(const InstanceState &inst,
+                    const DeviceState &dev,
+                    MemoryAllocator &alloc,
+                    const RenderConfig &cfg,
+                    const RenderFeatures<PipelineType> &features,
+                    VkPipelineCache pipeline_cache,
+                    uint32_t vertex_stride);
+
+    const FramebufferConfig fbCfg;
+    const RenderState renderState;
+    const PipelineState pipeline;
+    const FramebufferState fb;
+
+    const uint32_t batchSize;
+    const uint32_t maxNumStreams;
+    const uint32_t numFramesInFlight;
+    // Whether the pipeline layout has the material set
+    const bool needMaterial;
+    const bool cpuSync;
+    const bool indirectDraw;
+    const bool gpuCulling;
+    const bool cpuCulling;
+    const bool parallelRecording;
+
+    std::atomic_uint32_t numStreams;
+};
+
 class VulkanState {
 public:
     template <typename PipelineType>
@@ -239,18 +577,36 @@ public:
                 const RenderFeatures<PipelineType> &features,
                 CoreVulkanHandles &&handles);
 
-    LoaderState makeLoader();
-    CommandStreamState makeStream();
+    // Writes back the pipeline cache
+    ~VulkanState();
+
+    // Returns the index of the new variant. Must not race with makeStream.
+    template <typename PipelineType>
+    uint32_t addVariant(const RenderConfig &cfg,
+                        const RenderFeatures<PipelineType> &features);
+
+    Handle<LoaderState> makeLoader();
+    CommandStreamState makeStream(uint32_t variant_idx = 0);
 
+    // Only the first variant's framebuffer is exported
     int getFramebufferFD() const;
     uint64_t getFramebufferBytes() const;
 
-    glm::u32vec2 getImageDimensions() const
+    glm::u32vec2 getImageDimensions(uint32_t variant_idx = 0) const
     {
-        return glm::u32vec2(fbCfg.imgWidth, fbCfg.imgHeight);
+        const FramebufferConfig &fb_cfg = variants_[variant_idx].fbCfg;
+        return glm::u32vec2(fb_cfg.imgWidth, fb_cfg.imgHeight);
     }
 
-    bool isDoubleBuffered() const { return double_buffered_; }
+    uint32_t getNumFramesInFlight() const
+    {
+        return variants_[0].numFramesInFlight;
+    }
+
+    const PipelineVariant &getVariant(uint32_t variant_idx) const
+    {
+        return variants_[variant_idx];
+    }
 
     const InstanceState inst;
     const DeviceState dev;
@@ -258,25 +614,36 @@ public:
     QueueManager queueMgr;
     MemoryAllocator alloc;
 
-    const FramebufferConfig fbCfg;
-    const RenderState renderState;
-    const PipelineState pipeline;
-    const FramebufferState fb;
+    // Empty when pipelines aren't cached on disk
+    const std::string pipelineCachePath;
+    const VkPipelineCache pipelineCache;
 
     const glm::mat4 globalTransform;
 
 private:
     const LoaderImpl loader_impl_;
 
-    std::atomic_uint32_t num_loaders_;
-    std::atomic_uint32_t num_streams_;
+    // Format of the vertices and materials loaders produce, which every
+    // variant has to be able to draw
+    const std::vector<VkVertexInputAttributeDescription> scene_vertex_attrs_;
+    const uint32_t scene_vertex_stride_;
+    const std::type_index scene_material_type_;
+    // Every variant binds the material table's set, so their scene set
+    // layouts must be defined identically to the one it was allocated with
+    const std::type_index scene_layout_type_;
+
+    std::deque<PipelineVariant> variants_;
+    std::optional<MaterialTable> material_table_;
+    GeometryHeap geometry_heap_;
+    // Decodes textures and meshes for every loader, the loading thread
+    // joins in too
+    ThreadPool load_pool_;
 
+    std::atomic_uint32_t num_loaders_;
     const uint32_t max_num_loaders_;
-    const uint32_t max_num_streams_;
+    const VkDeviceSize loader_staging_bytes_;
 
-    const uint32_t batch_size_;
-    const bool double_buffered_;
-    const bool cpu_sync_;
+    std::unique_ptr<ThreadPool> record_pool_;
 };
 
 }